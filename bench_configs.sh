@@ -0,0 +1,40 @@
+#!/bin/bash
+# Usage: ./bench_configs.sh [video file] [runs]
+# Builds the player in every configuration under build/<config> and reports the decode throughput
+# of a headless replay of the video (see lib/replay.c). The pgo configuration is trained on the
+# same headless run first.
+input=${1:-richard-feynman.mp4}
+runs=${2:-3}
+jobs=$(nproc 2>/dev/null || sysctl -n hw.ncpu)
+pgo_dir="$PWD/build/pgo-profile"
+
+configure() {
+	cmake -S . -B "build/$1" "${@:2}" > /dev/null && cmake --build "build/$1" -j"$jobs" > /dev/null
+}
+
+bench() {
+	echo "== $1 =="
+	for i in $(seq 1 $runs); do
+		"./build/$1/main" --replay /dev/null "$input" | grep fps
+	done
+}
+
+configure debug -DCMAKE_BUILD_TYPE=Debug || exit 1
+configure release -DCMAKE_BUILD_TYPE=Release || exit 1
+configure native -DCMAKE_BUILD_TYPE=Release -DWITCH_NATIVE=ON || exit 1
+configure lto -DCMAKE_BUILD_TYPE=Release -DWITCH_NATIVE=ON -DWITCH_LTO=ON || exit 1
+
+# Instrumented and optimized builds share build/pgo, gcc keys the profiles by object file path.
+rm -rf "$pgo_dir"
+configure pgo -DCMAKE_BUILD_TYPE=Release -DWITCH_NATIVE=ON -DWITCH_LTO=ON \
+	-DWITCH_PGO=GENERATE -DWITCH_PGO_DIR="$pgo_dir" || exit 1
+"./build/pgo/main" --replay /dev/null "$input" > /dev/null || exit 1
+if ls "$pgo_dir"/*.profraw > /dev/null 2>&1; then
+	llvm-profdata merge -o "$pgo_dir/witch.profdata" "$pgo_dir"/*.profraw || exit 1
+fi
+configure pgo -DCMAKE_BUILD_TYPE=Release -DWITCH_NATIVE=ON -DWITCH_LTO=ON \
+	-DWITCH_PGO=USE -DWITCH_PGO_DIR="$pgo_dir" || exit 1
+
+for config in debug release native lto pgo; do
+	bench $config
+done
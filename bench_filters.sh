@@ -0,0 +1,24 @@
+#!/bin/bash
+# Usage: ./bench_filters.sh <video file> [runs]
+# Headless decode throughput without a filter graph and with each of the filter chains below, the
+# difference to the first line is the overhead of the chain.
+runs=${2:-3}
+chains=(
+	""
+	"null"
+	"yadif"
+	"scale=1280:-1"
+	"yadif,scale=1280:-1"
+	"crop=iw/2:ih/2,eq=contrast=1.2:saturation=1.3"
+	"hqdn3d"
+)
+for chain in "${chains[@]}"; do
+	echo "== filters: ${chain:-none} =="
+	for i in $(seq 1 $runs); do
+		if [ -z "$chain" ]; then
+			./build/main --replay /dev/null $1 | grep fps
+		else
+			./build/main --replay /dev/null --vf "$chain" $1 | grep fps
+		fi
+	done
+done
@@ -0,0 +1,9 @@
+# Usage: ./bench_startup.sh <video file> [runs]
+# Prints the per-phase startup timings of the default and the fast-start mode.
+runs=${2:-5}
+for mode in "" "--fast-start"; do
+	echo "== mode: ${mode:-default} =="
+	for i in $(seq 1 $runs); do
+		./build/main --bench-startup ${mode:+"$mode"} "$1"
+	done
+done
@@ -1,10 +1,3 @@
-gcc main.c\
-	-lavcodec -lavformat -lswresample\
-	-lSDL2 -lSDL2_image\
-	-o build/main\
-	-I include\
-	-I /opt/homebrew/Cellar/ffmpeg/6.0/include\
-	-I /opt/homebrew/Cellar/sdl2/2.26.5/include/SDL2\
-	-I /opt/homebrew/Cellar/sdl2_image/2.6.3_1/include/SDL2\
-	-L lib\
-	
+# Usage: ./build.sh [extra cmake options, e.g. -DCMAKE_BUILD_TYPE=Debug -DWITCH_NATIVE=ON]
+# Configures and builds into build/, the player ends up in build/main.
+cmake -S . -B build "$@" && cmake --build build -j"$(nproc 2>/dev/null || sysctl -n hw.ncpu)"
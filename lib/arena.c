@@ -0,0 +1,98 @@
+#include "arena.h"
+
+// Bump allocator. Memory is handed out from blocks of block_size bytes (bigger requests get a block
+// of their own) and only released all at once by arena_reset/arena_destroy. arena_alloc takes a
+// spinlock so the session arena can be grown from any thread.
+
+// Every block allocation across all arenas, which is all the allocating this code does on its own.
+static SDL_atomic_t arena_block_allocs;
+
+static ArenaBlock* arena_new_block(Arena *a, size_t size) {
+    ArenaBlock *block = av_malloc(sizeof(ArenaBlock));
+    if (block == NULL) {
+        return NULL;
+    }
+    block->data = av_malloc(size);
+    if (block->data == NULL) {
+        av_free(block);
+        return NULL;
+    }
+    block->size = size;
+    block->used = 0;
+    block->next = NULL;
+    a->capacity += size;
+    a->nb_blocks++;
+    SDL_AtomicAdd(&arena_block_allocs, 1);
+    return block;
+}
+
+int arena_init(Arena *a, size_t block_size) {
+    SDL_memset(a, 0, sizeof(Arena));
+    a->block_size = block_size;
+    a->first = a->current = arena_new_block(a, block_size);
+    if (a->first == NULL) {
+        fprintf(stderr, "Failed to allocate an arena block.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Returns zeroed memory aligned to ARENA_ALIGNMENT.
+void* arena_alloc(Arena *a, size_t size) {
+    size = FFALIGN(size, ARENA_ALIGNMENT);
+    SDL_AtomicLock(&a->lock);
+    ArenaBlock *block = a->current;
+    // Blocks after current are left over from before an arena_reset, reuse them before allocating.
+    while (block->used + size > block->size && block->next != NULL) {
+        block = block->next;
+    }
+    if (block->used + size > block->size) {
+        ArenaBlock *new_block = arena_new_block(a, FFMAX(size, a->block_size));
+        if (new_block == NULL) {
+            SDL_AtomicUnlock(&a->lock);
+            fprintf(stderr, "Failed to grow the arena by %zu bytes.\n", size);
+            return NULL;
+        }
+        block->next = new_block;
+        block = new_block;
+    }
+    a->current = block;
+    void *ptr = block->data + block->used;
+    block->used += size;
+    a->used += size;
+    if (a->used > a->peak) {
+        a->peak = a->used;
+    }
+    SDL_AtomicUnlock(&a->lock);
+
+    SDL_memset(ptr, 0, size);
+    return ptr;
+}
+
+// Forgets every allocation but keeps the blocks for reuse.
+void arena_reset(Arena *a) {
+    SDL_AtomicLock(&a->lock);
+    for (ArenaBlock *block = a->first; block != NULL; block = block->next) {
+        block->used = 0;
+    }
+    a->current = a->first;
+    a->used = 0;
+    SDL_AtomicUnlock(&a->lock);
+}
+
+void arena_destroy(Arena *a) {
+    ArenaBlock *block = a->first;
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        av_free(block->data);
+        av_free(block);
+        block = next;
+    }
+    a->first = a->current = NULL;
+    a->used = a->capacity = 0;
+    a->nb_blocks = 0;
+}
+
+int arena_total_block_allocs() {
+    return SDL_AtomicGet(&arena_block_allocs);
+}
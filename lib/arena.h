@@ -0,0 +1,29 @@
+#include <SDL.h>
+#include <libavutil/mem.h>
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#define ARENA_ALIGNMENT 32
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size, used;
+    uint8_t *data;
+} ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock *first, *current;
+    size_t block_size;
+    size_t used, peak, capacity;
+    int nb_blocks;
+    SDL_SpinLock lock;
+} Arena;
+
+int arena_init(Arena *a, size_t block_size);
+void* arena_alloc(Arena *a, size_t size);
+void arena_reset(Arena *a);
+void arena_destroy(Arena *a);
+int arena_total_block_allocs(void);
+
+#endif
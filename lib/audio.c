@@ -0,0 +1,317 @@
+#include "audio.h"
+#include "output.h"
+
+// Audio output. The device callback never decodes or takes a lock: the audio feeder thread runs
+// audio_decode_frame and keeps audio_ring filled up to the target latency, the callback copies out
+// of it and wakes the feeder once it is below the target again. The audio clock is the media time
+// of what was fed minus everything still queued in the ring and the device buffer.
+//
+// Audio only playback uses SDL's push model instead: there is no callback, the audio pusher thread
+// decodes a large batch, queues it with a single SDL_QueueAudio call and sleeps until the device has
+// played most of what is queued. That wakes the process a few times per second instead of once per
+// device buffer.
+
+#define DEFAULT_AUDIO_LATENCY_MS 100
+#define LOW_LATENCY_AUDIO_MS 20
+// SDL wants a power of two for the device buffer.
+#define MIN_AUDIO_DEVICE_SAMPLES 64
+#define MAX_AUDIO_DEVICE_SAMPLES 4096
+// Push mode: what one SDL_QueueAudio call hands over, and how much is left queued when the pusher
+// wakes up to decode the next batch.
+#define AUDIO_PUSH_BATCH_MS 500
+#define AUDIO_PUSH_LOW_WATER_MS 250
+
+static int audio_latency_ms(MediaPlayerState *m) {
+    if (m->audio_latency_ms > 0) {
+        return m->audio_latency_ms;
+    }
+    return m->low_latency ? LOW_LATENCY_AUDIO_MS : DEFAULT_AUDIO_LATENCY_MS;
+}
+
+// Device buffer for the target latency at freq. Half of the latency goes to the device, the other
+// half is kept in the ring to ride out scheduling hiccups of the feeder.
+int audio_device_samples(MediaPlayerState *m, int freq) {
+    if (m->audio_only) {
+        return MAX_AUDIO_DEVICE_SAMPLES;
+    }
+    int target = freq * audio_latency_ms(m) / 1000 / 2;
+    int samples = MIN_AUDIO_DEVICE_SAMPLES;
+    while (samples * 2 <= target && samples < MAX_AUDIO_DEVICE_SAMPLES) {
+        samples *= 2;
+    }
+    return samples;
+}
+
+static int audio_ring_fill(AudioRing *ring) {
+    return (unsigned int)SDL_AtomicGet(&ring->write_pos) - (unsigned int)SDL_AtomicGet(&ring->read_pos);
+}
+
+// Copies as much of src as fits, returns the number of bytes written.
+static int audio_ring_write(AudioRing *ring, const uint8_t *src, int size) {
+    unsigned int write_pos = SDL_AtomicGet(&ring->write_pos);
+    int space = ring->capacity - audio_ring_fill(ring);
+    size = FFMIN(size, space);
+    // The callback is done with everything before read_pos.
+    SDL_MemoryBarrierAcquire();
+    int offset = write_pos & (ring->capacity - 1);
+    int first = FFMIN(size, ring->capacity - offset);
+    SDL_memcpy(ring->data + offset, src, first);
+    SDL_memcpy(ring->data, src + first, size - first);
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&ring->write_pos, write_pos + size);
+    return size;
+}
+
+static int audio_ring_read(AudioRing *ring, uint8_t *dst, int size) {
+    if (SDL_AtomicSet(&ring->discard, 0)) {
+        unsigned int discard_pos = SDL_AtomicGet(&ring->discard_pos);
+        // Whatever was written after the discard is kept.
+        if ((int)(discard_pos - (unsigned int)SDL_AtomicGet(&ring->read_pos)) > 0) {
+            SDL_AtomicSet(&ring->read_pos, discard_pos);
+        }
+    }
+    unsigned int read_pos = SDL_AtomicGet(&ring->read_pos);
+    int fill = audio_ring_fill(ring);
+    size = FFMIN(size, fill);
+    SDL_MemoryBarrierAcquire();
+    int offset = read_pos & (ring->capacity - 1);
+    int first = FFMIN(size, ring->capacity - offset);
+    SDL_memcpy(dst, ring->data + offset, first);
+    SDL_memcpy(dst + first, ring->data, size - first);
+    SDL_MemoryBarrierRelease();
+    SDL_AtomicSet(&ring->read_pos, read_pos + size);
+    return size;
+}
+
+static int audio_bytes_per_second(MediaPlayerState *m) {
+    return m->audio_spec.freq * m->audio_spec.channels * av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
+}
+
+// Sizes the ring from the spec the device was opened with.
+int audio_output_init(MediaPlayerState *m) {
+    m->audio_device_delay = (double)m->audio_spec.samples / m->audio_spec.freq;
+    int bytes_per_second = audio_bytes_per_second(m);
+    int device_bytes = m->audio_spec.samples * m->audio_spec.channels * av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
+    if (m->audio_only) {
+        m->audio_push_size = (int64_t)bytes_per_second * AUDIO_PUSH_BATCH_MS / 1000;
+        m->audio_push_buffer = arena_alloc(&m->audio_scratch, m->audio_push_size);
+        if (m->audio_push_buffer == NULL) {
+            fprintf(stderr, "Failed to allocate the audio push buffer.\n");
+            return -1;
+        }
+        return 0;
+    }
+    m->audio_ring_target = FFMAX((int64_t)bytes_per_second * audio_latency_ms(m) / 1000 - device_bytes, device_bytes);
+
+    AudioRing *ring = &m->audio_ring;
+    ring->capacity = 4096;
+    while (ring->capacity < 2 * m->audio_ring_target) {
+        ring->capacity *= 2;
+    }
+    ring->data = arena_alloc(&m->audio_scratch, ring->capacity);
+    if (ring->data == NULL) {
+        fprintf(stderr, "Failed to allocate the audio ring.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Media time being heard right now: the fed position minus what is still queued, scaled by the
+// playback rate since every second of output covers rate seconds of media.
+double audio_clock_get(MediaPlayerState *m) {
+    SDL_AtomicLock(&m->audio_clock_lock);
+    double pts = m->audio_clock_pts;
+    unsigned int pos = m->audio_clock_pos;
+    SDL_AtomicUnlock(&m->audio_clock_lock);
+    // In push mode audio_clock_pts is the end of everything queued so far.
+    int queued = m->audio_only ? (int)SDL_GetQueuedAudioSize(m->audio_device_id)
+                               : (int)(pos - (unsigned int)SDL_AtomicGet(&m->audio_ring.read_pos));
+    double device = m->audio_device_delay;
+    if (!m->audio_only) {
+        // The device buffer was full at the last callback and has been playing out since.
+        Uint32 since_ms = SDL_GetTicks() - (Uint32)SDL_AtomicGet(&m->audio_callback_ms);
+        device = FFMAX(device - since_ms / 1000.0, 0.0);
+    }
+    double rate = SDL_AtomicGet(&m->playback_rate) / 100.0;
+    return pts - ((double)queued / audio_bytes_per_second(m) + device) * rate;
+}
+
+// Whether audio_clock_get follows what is heard for the frames of serial. Not without a device,
+// before the first samples were heard, after the last and until audio from after the seek is fed.
+int audio_clock_valid(MediaPlayerState *m, int serial) {
+    if (m->audio_device_id == 0 || m->audio_only || !m->audio_started || m->audio_finished) {
+        return 0;
+    }
+    SDL_AtomicLock(&m->audio_clock_lock);
+    int clock_serial = m->audio_clock_serial;
+    SDL_AtomicUnlock(&m->audio_clock_lock);
+    return clock_serial == serial;
+}
+
+// The audio is over once the callback has played out the ring, the refresh lets the main loop find
+// out.
+static void audio_play_out(MediaPlayerState *m) {
+    while (!m->quit && audio_ring_fill(&m->audio_ring) > 0) {
+        SDL_SemWait(m->audio_ring.space);
+    }
+    m->audio_finished = 1;
+    SDL_Event event = { .user = { .type = REFRESH_VIDEO_DISPLAY, .code = REFRESH_END_OF_STREAM } };
+    SDL_PushEvent(&event);
+}
+
+// Keeps going past the end of the stream, audio_decode_frame waits for a seek then.
+int audio_feeder(void *arg) {
+    MediaPlayerState *m = (MediaPlayerState *)arg;
+    double bytes_per_second = audio_bytes_per_second(m);
+
+    while (!m->quit) {
+        if (m->audio_buffer_index >= m->audio_buffer_size) {
+            if (m->audio_eof && !m->audio_finished) {
+                audio_play_out(m);
+                continue;
+            }
+            m->audio_buffer_index = 0;
+            m->audio_buffer_size = audio_decode_frame(m);
+            // Only on quit, damaged packets are skipped.
+            if (m->audio_buffer_size < 0) {
+                m->audio_buffer_size = 0;
+                break;
+            }
+            continue;
+        }
+        if (audio_ring_fill(&m->audio_ring) >= m->audio_ring_target) {
+            // Also blocks while paused, the callback does not run until the device resumes.
+            SDL_SemWait(m->audio_ring.space);
+            continue;
+        }
+
+        int size = FFMIN(m->audio_buffer_size - m->audio_buffer_index, m->audio_ring_target);
+        m->audio_buffer_index += audio_ring_write(&m->audio_ring, m->audio_buffer + m->audio_buffer_index, size);
+
+        double rate = SDL_AtomicGet(&m->playback_rate) / 100.0;
+        double unfed = (m->audio_buffer_size - m->audio_buffer_index) / bytes_per_second * rate;
+        SDL_AtomicLock(&m->audio_clock_lock);
+        m->audio_clock_pts = m->audio_decoded_pts - unfed;
+        m->audio_clock_pos = SDL_AtomicGet(&m->audio_ring.write_pos);
+        m->audio_clock_serial = m->audio_serial;
+        SDL_AtomicUnlock(&m->audio_clock_lock);
+    }
+    return 0;
+}
+
+// Fills audio_push_buffer from the decoded audio, returns the number of bytes collected. Stops
+// early at the end of the stream, damaged packets are skipped by audio_decode_frame and only the
+// end of stream marker finishes playback.
+static int audio_push_collect(MediaPlayerState *m) {
+    int size = 0;
+    while (size < m->audio_push_size && !m->quit) {
+        if (m->audio_buffer_index >= m->audio_buffer_size) {
+            if (m->audio_eof) {
+                m->audio_finished = 1;
+                break;
+            }
+            m->audio_buffer_index = 0;
+            m->audio_buffer_size = audio_decode_frame(m);
+            if (m->audio_buffer_size < 0) {
+                m->audio_buffer_size = 0;
+                break;
+            }
+            continue;
+        }
+        if (m->audio_discarded) {
+            m->audio_discarded = 0;
+            size = 0;
+        }
+        int n = FFMIN(m->audio_buffer_size - m->audio_buffer_index, m->audio_push_size - size);
+        SDL_memcpy(m->audio_push_buffer + size, m->audio_buffer + m->audio_buffer_index, n);
+        m->audio_buffer_index += n;
+        size += n;
+    }
+    return size;
+}
+
+int audio_pusher(void *arg) {
+    MediaPlayerState *m = (MediaPlayerState *)arg;
+    double bytes_per_second = audio_bytes_per_second(m);
+    int low_water = bytes_per_second * AUDIO_PUSH_LOW_WATER_MS / 1000;
+    m->stats.audio_push_begin = SDL_GetPerformanceCounter();
+
+    while (!m->quit && !m->audio_finished) {
+        int queued = SDL_GetQueuedAudioSize(m->audio_device_id);
+        if (queued > low_water) {
+            SDL_Delay(FFMAX(1, (int)((queued - low_water) / bytes_per_second * 1000)));
+            continue;
+        }
+        m->stats.audio_pusher_wakeups++;
+
+        int size = audio_push_collect(m);
+        if (size == 0) {
+            continue;
+        }
+        if (SDL_QueueAudio(m->audio_device_id, m->audio_push_buffer, size) != 0) {
+            PRINT_SDL_ERROR();
+            break;
+        }
+        m->audio_started = 1;
+        m->stats.audio_pushes++;
+        m->stats.audio_pushed_bytes += size;
+
+        double rate = SDL_AtomicGet(&m->playback_rate) / 100.0;
+        double unqueued = (m->audio_buffer_size - m->audio_buffer_index) / bytes_per_second * rate;
+        SDL_AtomicLock(&m->audio_clock_lock);
+        m->audio_clock_pts = m->audio_decoded_pts - unqueued;
+        m->audio_clock_serial = m->audio_serial;
+        SDL_AtomicUnlock(&m->audio_clock_lock);
+    }
+    m->stats.audio_push_end = SDL_GetPerformanceCounter();
+    m->audio_finished = 1;
+
+    // Nothing else ends playback without a window, quit once the device has played everything.
+    while (!m->quit && SDL_GetQueuedAudioSize(m->audio_device_id) > 0) {
+        SDL_Delay(AUDIO_PUSH_LOW_WATER_MS / 2);
+    }
+    SDL_Event event = { .type = SDL_QUIT };
+    SDL_PushEvent(&event);
+    return 0;
+}
+
+void audio_callback(void *userdata, Uint8 *stream, int len) {
+    MediaPlayerState *m = (MediaPlayerState *)userdata;
+    SDL_AtomicSet(&m->audio_callback_ms, (int)SDL_GetTicks());
+    m->stats.audio_callbacks++;
+    m->stats.audio_queued_bytes += audio_ring_fill(&m->audio_ring);
+
+    int read = audio_ring_read(&m->audio_ring, stream, len);
+    if (read > 0) {
+        m->audio_started = 1;
+    }
+    // One pending post is enough, the feeder rechecks the fill after each wakeup.
+    if (audio_ring_fill(&m->audio_ring) < m->audio_ring_target && SDL_SemValue(m->audio_ring.space) == 0) {
+        SDL_SemPost(m->audio_ring.space);
+    }
+    if (read < len) {
+        SDL_memset(stream + read, 0, len - read);
+        // Not filling up before the first samples or after the last is expected.
+        if (m->audio_started && !m->audio_finished) {
+            m->stats.audio_underruns++;
+            m->stats.audio_underrun_bytes += len - read;
+        }
+    }
+}
+
+// Thread decoding the audio, on a flush marker. Everything decoded but not yet heard belongs to the
+// position before the seek: the rest of audio_buffer, the ring or the device queue, and in push mode
+// the batch being collected.
+void audio_output_discard(MediaPlayerState *m) {
+    m->audio_buffer_index = 0;
+    m->audio_buffer_size = 0;
+    if (m->audio_only) {
+        m->audio_discarded = 1;
+        if (m->audio_device_id != 0) {
+            SDL_ClearQueuedAudio(m->audio_device_id);
+        }
+        return;
+    }
+    SDL_AtomicSet(&m->audio_ring.discard_pos, SDL_AtomicGet(&m->audio_ring.write_pos));
+    SDL_AtomicSet(&m->audio_ring.discard, 1);
+}
@@ -0,0 +1,16 @@
+#include <SDL.h>
+
+#ifndef AUDIO_H
+#define AUDIO_H
+#include "typedefs.h"
+
+int audio_device_samples(MediaPlayerState *m, int freq);
+int audio_output_init(MediaPlayerState *m);
+double audio_clock_get(MediaPlayerState *m);
+int audio_clock_valid(MediaPlayerState *m, int serial);
+int audio_feeder(void *arg);
+int audio_pusher(void *arg);
+void audio_callback(void *userdata, Uint8 *stream, int len);
+void audio_output_discard(MediaPlayerState *m);
+
+#endif
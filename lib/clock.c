@@ -0,0 +1,52 @@
+#include "clock.h"
+
+// Media time that advances with wall time scaled by the playback rate. With virtual_time set the
+// wall time is simulated and only moves through clock_sleep, which makes frame pacing and drop
+// decisions reproducible from run to run.
+
+double clock_now(PlaybackClock *c) {
+    if (c->virtual_time) {
+        return c->virtual_now;
+    }
+    return (double)SDL_GetPerformanceCounter() / (double)SDL_GetPerformanceFrequency();
+}
+
+void clock_sleep(PlaybackClock *c, double seconds) {
+    if (c->virtual_time) {
+        c->virtual_now += seconds;
+        return;
+    }
+    SDL_Delay((Uint32)(seconds * 1000));
+}
+
+double clock_get(PlaybackClock *c) {
+    if (!c->started) {
+        return 0.0;
+    }
+    if (c->paused) {
+        return c->pts;
+    }
+    return c->pts + (clock_now(c) - c->updated) * c->rate;
+}
+
+void clock_set(PlaybackClock *c, double pts) {
+    c->pts = pts;
+    c->updated = clock_now(c);
+    c->started = 1;
+}
+
+// Rebases the clock at the current media time so a rate change does not make it jump.
+void clock_set_rate(PlaybackClock *c, double rate) {
+    if (c->started) {
+        clock_set(c, clock_get(c));
+    }
+    c->rate = rate;
+}
+
+// A paused clock holds its media time, it continues from there when resumed.
+void clock_pause(PlaybackClock *c, int paused) {
+    if (c->started) {
+        clock_set(c, clock_get(c));
+    }
+    c->paused = paused;
+}
@@ -0,0 +1,14 @@
+#include <SDL.h>
+
+#ifndef CLOCK_H
+#define CLOCK_H
+#include "typedefs.h"
+
+double clock_now(PlaybackClock *c);
+void clock_sleep(PlaybackClock *c, double seconds);
+double clock_get(PlaybackClock *c);
+void clock_set(PlaybackClock *c, double pts);
+void clock_set_rate(PlaybackClock *c, double rate);
+void clock_pause(PlaybackClock *c, int paused);
+
+#endif
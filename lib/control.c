@@ -0,0 +1,562 @@
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "control.h"
+#include "clock.h"
+#include "decoder.h"
+#include "gopcache.h"
+#include "output.h"
+
+// Local control interface. Clients connect to a Unix domain socket and send one JSON object per line,
+// e.g. {"cmd":"seek","value":42.5}, and get one JSON object per line back in the same order.
+// The control thread only parses the lines. It puts the commands into a ring and wakes the main loop
+// with a CONTROL_EVENT. control_drain runs them there, between two frames, like a key press. Decoders
+// and the audio callback never see the control thread.
+//
+// Commands: open (path, answered once it plays or failed to open), play, pause, seek (value:
+// seconds), rate (value: speed, 1 is normal), track (type: "audio", value: stream index, the next
+// audio stream without), step (value: -1 for a frame back, one forward without), reverse (value: 0
+// stops, toggles without), quit and stats (with --meter the peak, RMS and loudness of the last
+// metered block as well). After a failed open only open and quit work until an input plays.
+
+#define CONTROL_MAX_CLIENTS 8
+// Commands read from the clients before the main loop has to run them.
+#define CONTROL_QUEUE_SIZE 16
+#define CONTROL_LINE_SIZE 1024
+// Fits the stats reply with the levels of METER_MAX_CHANNELS channels.
+#define CONTROL_REPLY_SIZE 2048
+// The control thread pushes another CONTROL_EVENT when the main loop did not get to the commands in
+// this many milliseconds, e.g. because a new input was being opened.
+#define CONTROL_WAIT_MS 100
+
+typedef enum ControlCommandType {
+    CONTROL_INVALID,
+    CONTROL_OPEN,
+    CONTROL_PLAY,
+    CONTROL_PAUSE,
+    CONTROL_SEEK,
+    CONTROL_RATE,
+    CONTROL_TRACK,
+    CONTROL_STEP,
+    CONTROL_REVERSE,
+    CONTROL_QUIT,
+    CONTROL_STATS
+} ControlCommandType;
+
+typedef struct ControlCommand {
+    ControlCommandType type;
+    int client_fd;
+    int has_value;
+    double value;
+    // Track type or the path to open.
+    char arg[CONTROL_LINE_SIZE];
+    char reply[CONTROL_REPLY_SIZE];
+} ControlCommand;
+
+typedef struct ControlClient {
+    int fd;
+    // Received bytes not yet ending in a newline.
+    char line[CONTROL_LINE_SIZE];
+    int length;
+} ControlClient;
+
+struct ControlServer {
+    struct sockaddr_un addr;
+    int listen_fd;
+    ControlClient clients[CONTROL_MAX_CLIENTS];
+    int nb_clients;
+
+    // The control thread fills the slots from write_index on, the main loop runs them up to it and
+    // signals cond. A slot is only refilled after its reply was sent, so the ring needs no lock.
+    ControlCommand commands[CONTROL_QUEUE_SIZE];
+    SDL_atomic_t write_index, read_index;
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+
+    // Set by an open command, main starts playing it once the current input has been torn down. The
+    // open is only answered once its input plays or failed, until then read_index stays on its slot
+    // and the commands behind it wait. Main thread only.
+    char open_path[CONTROL_LINE_SIZE];
+    int open_pending, open_index;
+    // A quit that came in while nothing was playing.
+    int quit;
+    SDL_atomic_t stop;
+    SDL_Thread *tid;
+};
+
+// Start of the value of "key" in a flat JSON object, NULL if the key is missing.
+static const char* json_value(const char *line, const char *key) {
+    char quoted[64];
+    snprintf(quoted, sizeof(quoted), "\"%s\"", key);
+    const char *p = strstr(line, quoted);
+    if (p == NULL) {
+        return NULL;
+    }
+    p += strlen(quoted);
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    if (*p != ':') {
+        return NULL;
+    }
+    p++;
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    return p;
+}
+
+static int json_string(const char *line, const char *key, char *out, int size) {
+    const char *p = json_value(line, key);
+    if (p == NULL || *p != '"') {
+        return -1;
+    }
+    int length = 0;
+    for (p++; *p != '"'; p++) {
+        if (*p == '\0' || length == size - 1) {
+            return -1;
+        }
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+        }
+        out[length++] = *p;
+    }
+    out[length] = '\0';
+    return 0;
+}
+
+static int json_number(const char *line, const char *key, double *out) {
+    const char *p = json_value(line, key);
+    if (p == NULL) {
+        return -1;
+    }
+    char *end;
+    *out = strtod(p, &end);
+    return end == p ? -1 : 0;
+}
+
+static void control_parse(const char *line, ControlCommand *cmd) {
+    static const struct { const char *name; ControlCommandType type; } names[] = {
+        { "open", CONTROL_OPEN }, { "play", CONTROL_PLAY }, { "pause", CONTROL_PAUSE },
+        { "seek", CONTROL_SEEK }, { "rate", CONTROL_RATE }, { "track", CONTROL_TRACK },
+        { "step", CONTROL_STEP }, { "reverse", CONTROL_REVERSE }, { "quit", CONTROL_QUIT },
+        { "stats", CONTROL_STATS },
+    };
+    char name[16];
+    cmd->type = CONTROL_INVALID;
+    cmd->reply[0] = '\0';
+    cmd->arg[0] = '\0';
+    cmd->has_value = json_number(line, "value", &cmd->value) == 0;
+
+    if (json_string(line, "cmd", name, sizeof(name)) != 0) {
+        snprintf(cmd->reply, CONTROL_REPLY_SIZE, "{\"ok\":false,\"error\":\"missing cmd\"}");
+        return;
+    }
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+        if (strcmp(name, names[i].name) == 0) {
+            cmd->type = names[i].type;
+        }
+    }
+    if (cmd->type == CONTROL_INVALID) {
+        snprintf(cmd->reply, CONTROL_REPLY_SIZE, "{\"ok\":false,\"error\":\"unknown cmd\"}");
+    } else if (cmd->type == CONTROL_OPEN && json_string(line, "path", cmd->arg, CONTROL_LINE_SIZE) != 0) {
+        cmd->type = CONTROL_INVALID;
+        snprintf(cmd->reply, CONTROL_REPLY_SIZE, "{\"ok\":false,\"error\":\"open needs a path\"}");
+    } else if ((cmd->type == CONTROL_SEEK || cmd->type == CONTROL_RATE) && !cmd->has_value) {
+        cmd->type = CONTROL_INVALID;
+        snprintf(cmd->reply, CONTROL_REPLY_SIZE, "{\"ok\":false,\"error\":\"%s needs a value\"}", name);
+    } else if (cmd->type == CONTROL_TRACK && json_string(line, "type", cmd->arg, CONTROL_LINE_SIZE) != 0) {
+        snprintf(cmd->arg, CONTROL_LINE_SIZE, "audio");
+    }
+}
+
+// Silence is -INFINITY dB, which JSON has no number for.
+static int json_db(char *out, int size, float db) {
+    return isfinite(db) ? snprintf(out, size, "%.1f", db) : snprintf(out, size, "null");
+}
+
+// The levels of the last metered block, "meter":{...} appended at reply + length.
+static int control_meter(MediaPlayerState *m, char *reply, int length) {
+    AudioMeter *meter = &m->meter;
+    char *out = reply + length;
+    int size = CONTROL_REPLY_SIZE - length, n = 0;
+    SDL_AtomicLock(&meter->lock);
+    n += snprintf(out + n, size - n, ",\"meter\":{\"peak_db\":[");
+    for (int ch = 0; ch < meter->channels; ch++) {
+        n += snprintf(out + n, size - n, ch > 0 ? "," : "");
+        n += json_db(out + n, size - n, meter->peak_db[ch]);
+    }
+    n += snprintf(out + n, size - n, "],\"rms_db\":[");
+    for (int ch = 0; ch < meter->channels; ch++) {
+        n += snprintf(out + n, size - n, ch > 0 ? "," : "");
+        n += json_db(out + n, size - n, meter->rms_db[ch]);
+    }
+    n += snprintf(out + n, size - n, "],\"momentary_lufs\":");
+    n += json_db(out + n, size - n, meter->momentary_lufs);
+    n += snprintf(out + n, size - n, ",\"max_momentary_lufs\":");
+    n += json_db(out + n, size - n, meter->max_momentary_lufs);
+    n += snprintf(out + n, size - n, ",\"max_peak_db\":");
+    n += json_db(out + n, size - n, meter->max_peak_db);
+    n += snprintf(out + n, size - n, ",\"blocks\":%llu}", (unsigned long long)meter->blocks_published);
+    SDL_AtomicUnlock(&meter->lock);
+    return length + n;
+}
+
+static void control_stats(MediaPlayerState *m, char *reply) {
+    PacketQueue *queues[3] = { &m->video_pkt_queue, &m->audio_pkt_queue, &m->subtitle_pkt_queue };
+    int packets[3], bytes[3];
+    for (int i = 0; i < 3; i++) {
+        SDL_LockMutex(queues[i]->mutex);
+        packets[i] = queues[i]->nb_packets;
+        bytes[i] = queues[i]->size;
+        SDL_UnlockMutex(queues[i]->mutex);
+    }
+    // The audio counters are written by the callback, a value off by one callback is fine here.
+    PlayerStats *s = &m->stats;
+    int length = snprintf(reply, CONTROL_REPLY_SIZE,
+             "{\"ok\":true,\"position\":%.3f,\"paused\":%s,\"rate\":%.2f,\"eof\":%s,"
+             "\"frames_displayed\":%llu,\"frames_dropped\":%llu,\"frames_rendered\":%llu,"
+             "\"audio_callbacks\":%llu,\"audio_underruns\":%llu,"
+             "\"video_queue\":{\"packets\":%d,\"bytes\":%d},"
+             "\"audio_queue\":{\"packets\":%d,\"bytes\":%d},"
+             "\"subtitle_queue\":{\"packets\":%d,\"bytes\":%d}",
+             clock_get(&m->clock), m->paused ? "true" : "false", SDL_AtomicGet(&m->playback_rate) / 100.0,
+             m->eof ? "true" : "false", (unsigned long long)s->frames_displayed,
+             (unsigned long long)s->frames_dropped, (unsigned long long)s->frames_rendered,
+             (unsigned long long)s->audio_callbacks, (unsigned long long)s->audio_underruns,
+             packets[0], bytes[0], packets[1], bytes[1], packets[2], bytes[2]);
+    if (m->meter.enabled) {
+        length = control_meter(m, reply, length);
+    }
+    snprintf(reply + length, CONTROL_REPLY_SIZE - length, "}");
+}
+
+static void control_track(MediaPlayerState *m, ControlCommand *cmd) {
+    if (strcmp(cmd->arg, "audio") != 0) {
+        snprintf(cmd->reply, CONTROL_REPLY_SIZE, "{\"ok\":false,\"error\":\"only audio tracks can be switched\"}");
+        return;
+    }
+    if (m->playlist.nb_items > 1) {
+        snprintf(cmd->reply, CONTROL_REPLY_SIZE, "{\"ok\":false,\"error\":\"no track switching in a playlist\"}");
+        return;
+    }
+    int stream_id = cmd->has_value ? (int)cmd->value : next_audio_stream(m);
+    if (stream_id < 0 || stream_id >= (int)m->fmt_ctx->nb_streams ||
+        m->fmt_ctx->streams[stream_id]->codecpar->codec_type != AVMEDIA_TYPE_AUDIO) {
+        snprintf(cmd->reply, CONTROL_REPLY_SIZE, "{\"ok\":false,\"error\":\"not an audio stream\"}");
+        return;
+    }
+    request_audio_stream(m, stream_id);
+    snprintf(cmd->reply, CONTROL_REPLY_SIZE, "{\"ok\":true,\"stream\":%d}", stream_id);
+}
+
+// m is NULL while nothing plays, after an open failed.
+static void control_run(ControlServer *c, MediaPlayerState *m, ControlCommand *cmd) {
+    if (m == NULL && cmd->type != CONTROL_INVALID && cmd->type != CONTROL_OPEN && cmd->type != CONTROL_QUIT) {
+        snprintf(cmd->reply, CONTROL_REPLY_SIZE, "{\"ok\":false,\"error\":\"nothing is playing\"}");
+        return;
+    }
+    switch (cmd->type) {
+        case CONTROL_OPEN:
+            // The input is replaced by tearing the player down, main opens the new one.
+            snprintf(c->open_path, sizeof(c->open_path), "%s", cmd->arg);
+            if (m != NULL) {
+                m->quit = 1;
+            }
+            break;
+        case CONTROL_PLAY:
+            gop_cache_leave(m, 1);
+            break;
+        case CONTROL_PAUSE:
+            gop_cache_reverse(m, 0);
+            set_paused(m, 1);
+            break;
+        case CONTROL_SEEK:
+            gop_cache_leave(m, 0);
+            request_seek(m, cmd->value);
+            break;
+        case CONTROL_RATE:
+            set_playback_rate(m, (int)(cmd->value * 100));
+            snprintf(cmd->reply, CONTROL_REPLY_SIZE, "{\"ok\":true,\"rate\":%.2f}",
+                     SDL_AtomicGet(&m->playback_rate) / 100.0);
+            break;
+        case CONTROL_TRACK:
+            control_track(m, cmd);
+            break;
+        case CONTROL_STEP:
+        case CONTROL_REVERSE: {
+            int ret;
+            if (cmd->type == CONTROL_STEP) {
+                ret = gop_cache_step(m, cmd->has_value && cmd->value < 0 ? -1 : 1);
+            } else {
+                ret = gop_cache_reverse(m, cmd->has_value ? cmd->value != 0 : !m->gop_cache.reverse);
+            }
+            if (ret != 0) {
+                snprintf(cmd->reply, CONTROL_REPLY_SIZE, "{\"ok\":false,\"error\":\"stepping is not possible on this input\"}");
+            } else {
+                snprintf(cmd->reply, CONTROL_REPLY_SIZE, "{\"ok\":true,\"position\":%.3f}", m->gop_cache.position);
+            }
+            break;
+        }
+        case CONTROL_QUIT:
+            if (m != NULL) {
+                m->quit = 1;
+            } else {
+                c->quit = 1;
+            }
+            break;
+        case CONTROL_STATS:
+            control_stats(m, cmd->reply);
+            break;
+        default:
+            break;
+    }
+    if (cmd->reply[0] == '\0') {
+        snprintf(cmd->reply, CONTROL_REPLY_SIZE, "{\"ok\":true}");
+    }
+}
+
+// Runs on the main thread, called for every CONTROL_EVENT.
+void control_drain(ControlServer *c, MediaPlayerState *m) {
+    if (c == NULL || c->open_pending) {
+        return;
+    }
+    int read_index = SDL_AtomicGet(&c->read_index);
+    int write_index = SDL_AtomicGet(&c->write_index);
+    if (read_index == write_index) {
+        return;
+    }
+    for (; read_index != write_index; read_index++) {
+        ControlCommand *cmd = &c->commands[read_index % CONTROL_QUEUE_SIZE];
+        control_run(c, m, cmd);
+        if (cmd->type == CONTROL_OPEN) {
+            // Answered by control_open_done, the commands behind it are for the new input.
+            c->open_pending = 1;
+            c->open_index = read_index;
+            break;
+        }
+    }
+    SDL_LockMutex(c->mutex);
+    SDL_AtomicSet(&c->read_index, read_index);
+    SDL_CondBroadcast(c->cond);
+    SDL_UnlockMutex(c->mutex);
+}
+
+// Main thread, once the input of an open command plays or failed to open. Sends its reply.
+void control_open_done(ControlServer *c, int ok) {
+    if (c == NULL || !c->open_pending) {
+        return;
+    }
+    ControlCommand *cmd = &c->commands[c->open_index % CONTROL_QUEUE_SIZE];
+    if (ok) {
+        snprintf(cmd->reply, CONTROL_REPLY_SIZE, "{\"ok\":true}");
+    } else {
+        snprintf(cmd->reply, CONTROL_REPLY_SIZE, "{\"ok\":false,\"error\":\"failed to open the input\"}");
+    }
+    c->open_pending = 0;
+    SDL_LockMutex(c->mutex);
+    SDL_AtomicSet(&c->read_index, c->open_index + 1);
+    SDL_CondBroadcast(c->cond);
+    SDL_UnlockMutex(c->mutex);
+}
+
+// Main thread, while nothing plays. Runs the commands until an open or a quit comes in, returns 1
+// when there is a path for control_take_open.
+int control_idle(ControlServer *c) {
+    if (c == NULL) {
+        return 0;
+    }
+    SDL_LockMutex(c->mutex);
+    while (c->open_path[0] == '\0' && !c->quit && !SDL_AtomicGet(&c->stop)) {
+        if (SDL_AtomicGet(&c->read_index) != SDL_AtomicGet(&c->write_index)) {
+            SDL_UnlockMutex(c->mutex);
+            control_drain(c, NULL);
+            SDL_LockMutex(c->mutex);
+        } else {
+            SDL_CondWait(c->cond, c->mutex);
+        }
+    }
+    SDL_UnlockMutex(c->mutex);
+    return c->open_path[0] != '\0';
+}
+
+static void control_close_client(ControlServer *c, int index) {
+    close(c->clients[index].fd);
+    c->clients[index] = c->clients[--c->nb_clients];
+}
+
+// Moves the complete lines of a client into the ring until it is full, the rest stays buffered.
+static void control_take_lines(ControlServer *c, ControlClient *client) {
+    char *newline;
+    while (SDL_AtomicGet(&c->write_index) - SDL_AtomicGet(&c->read_index) < CONTROL_QUEUE_SIZE &&
+           (newline = memchr(client->line, '\n', client->length)) != NULL) {
+        *newline = '\0';
+        int write_index = SDL_AtomicGet(&c->write_index);
+        ControlCommand *cmd = &c->commands[write_index % CONTROL_QUEUE_SIZE];
+        control_parse(client->line, cmd);
+        cmd->client_fd = client->fd;
+        SDL_AtomicSet(&c->write_index, write_index + 1);
+
+        int used = newline + 1 - client->line;
+        client->length -= used;
+        memmove(client->line, newline + 1, client->length);
+    }
+}
+
+// Hands everything in the ring to the main loop, waits until it ran and sends the replies.
+static void control_flush(ControlServer *c) {
+    int read_index = SDL_AtomicGet(&c->read_index);
+    int write_index = SDL_AtomicGet(&c->write_index);
+    if (read_index == write_index) {
+        return;
+    }
+    SDL_Event event = { .type = CONTROL_EVENT };
+    SDL_PushEvent(&event);
+    SDL_LockMutex(c->mutex);
+    // Wakes the main thread in control_idle, it gets no events while nothing plays.
+    SDL_CondBroadcast(c->cond);
+    while (SDL_AtomicGet(&c->read_index) != write_index && !SDL_AtomicGet(&c->stop)) {
+        if (SDL_CondWaitTimeout(c->cond, c->mutex, CONTROL_WAIT_MS) == SDL_MUTEX_TIMEDOUT) {
+            SDL_PushEvent(&event);
+        }
+    }
+    SDL_UnlockMutex(c->mutex);
+
+    int done = SDL_AtomicGet(&c->read_index);
+    for (int i = read_index; i != write_index; i++) {
+        ControlCommand *cmd = &c->commands[i % CONTROL_QUEUE_SIZE];
+        if (i - done >= 0) {
+            snprintf(cmd->reply, CONTROL_REPLY_SIZE, "{\"ok\":false,\"error\":\"player stopped\"}");
+        }
+        size_t length = strlen(cmd->reply);
+        cmd->reply[length] = '\n';
+        // A client that went away only loses its reply.
+        send(cmd->client_fd, cmd->reply, length + 1, MSG_NOSIGNAL);
+    }
+    // Commands that never ran are dropped with their error reply.
+    SDL_AtomicSet(&c->read_index, write_index);
+}
+
+static int control_thread(void *arg) {
+    ControlServer *c = arg;
+    struct pollfd fds[CONTROL_MAX_CLIENTS + 1];
+
+    while (!SDL_AtomicGet(&c->stop)) {
+        // Lines left over from a full ring are taken without waiting for more input.
+        int buffered = 0;
+        for (int i = 0; i < c->nb_clients; i++) {
+            buffered |= memchr(c->clients[i].line, '\n', c->clients[i].length) != NULL;
+        }
+        fds[0] = (struct pollfd){ .fd = c->listen_fd, .events = POLLIN };
+        for (int i = 0; i < c->nb_clients; i++) {
+            fds[i + 1] = (struct pollfd){ .fd = c->clients[i].fd, .events = POLLIN };
+        }
+        int nb_fds = c->nb_clients + 1;
+        if (poll(fds, nb_fds, buffered ? 0 : CONTROL_WAIT_MS) < 0 && errno != EINTR) {
+            fprintf(stderr, "Control socket poll failed: %s\n", strerror(errno));
+            return -1;
+        }
+
+        for (int i = nb_fds - 2; i >= 0; i--) {
+            ControlClient *client = &c->clients[i];
+            if (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) {
+                int room = CONTROL_LINE_SIZE - 1 - client->length;
+                ssize_t n = room > 0 ? recv(client->fd, client->line + client->length, room, 0) : 0;
+                if (room == 0) {
+                    fprintf(stderr, "Control line longer than %d bytes, client dropped.\n", CONTROL_LINE_SIZE);
+                }
+                if (n <= 0) {
+                    control_close_client(c, i);
+                    continue;
+                }
+                client->length += n;
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(c->listen_fd, NULL, NULL);
+            if (fd >= 0 && c->nb_clients == CONTROL_MAX_CLIENTS) {
+                close(fd);
+            } else if (fd >= 0) {
+                c->clients[c->nb_clients++] = (ControlClient){ .fd = fd };
+            }
+        }
+
+        for (int i = 0; i < c->nb_clients; i++) {
+            control_take_lines(c, &c->clients[i]);
+        }
+        control_flush(c);
+    }
+    return 0;
+}
+
+ControlServer* control_start(const char *socket_path) {
+    ControlServer *c = av_mallocz(sizeof(ControlServer));
+    if (c == NULL) {
+        fprintf(stderr, "Could not allocate the control server.\n");
+        return NULL;
+    }
+    c->addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(c->addr.sun_path)) {
+        fprintf(stderr, "Control socket path too long: %s\n", socket_path);
+        av_free(c);
+        return NULL;
+    }
+    strcpy(c->addr.sun_path, socket_path);
+
+    c->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (c->listen_fd < 0) {
+        fprintf(stderr, "Could not create the control socket: %s\n", strerror(errno));
+        av_free(c);
+        return NULL;
+    }
+    // A socket file left behind by an earlier run would make bind fail.
+    unlink(socket_path);
+    if (bind(c->listen_fd, (struct sockaddr*)&c->addr, sizeof(c->addr)) != 0 || listen(c->listen_fd, 4) != 0) {
+        fprintf(stderr, "Could not listen on %s: %s\n", socket_path, strerror(errno));
+        close(c->listen_fd);
+        av_free(c);
+        return NULL;
+    }
+
+    c->mutex = SDL_CreateMutex();
+    c->cond = SDL_CreateCond();
+    c->tid = SDL_CreateThread(control_thread, "control-thread", c);
+    return c;
+}
+
+// Path of an open command received since the last call, 0 if there was none.
+int control_take_open(ControlServer *c, char *path, int size) {
+    if (c == NULL || c->open_path[0] == '\0') {
+        return 0;
+    }
+    snprintf(path, size, "%s", c->open_path);
+    c->open_path[0] = '\0';
+    return 1;
+}
+
+void control_stop(ControlServer *c) {
+    if (c == NULL) {
+        return;
+    }
+    SDL_LockMutex(c->mutex);
+    SDL_AtomicSet(&c->stop, 1);
+    SDL_CondBroadcast(c->cond);
+    SDL_UnlockMutex(c->mutex);
+    SDL_WaitThread(c->tid, NULL);
+
+    for (int i = 0; i < c->nb_clients; i++) {
+        close(c->clients[i].fd);
+    }
+    close(c->listen_fd);
+    unlink(c->addr.sun_path);
+    SDL_DestroyCond(c->cond);
+    SDL_DestroyMutex(c->mutex);
+    av_free(c);
+}
@@ -0,0 +1,16 @@
+#include <SDL.h>
+
+#ifndef CONTROL_H
+#define CONTROL_H
+#include "typedefs.h"
+
+typedef struct ControlServer ControlServer;
+
+ControlServer* control_start(const char *socket_path);
+void control_drain(ControlServer *c, MediaPlayerState *m);
+int control_take_open(ControlServer *c, char *path, int size);
+void control_open_done(ControlServer *c, int ok);
+int control_idle(ControlServer *c);
+void control_stop(ControlServer *c);
+
+#endif
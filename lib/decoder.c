@@ -1,121 +1,630 @@
-#include <libswresample/swresample.h>
-#include <libavutil/avutil.h>
+#include <math.h>
 
-#ifndef DECODER
-#include "typedefs.c"
-#include "output.c"
+#include "decoder.h"
+#include "stats.h"
+#include "output.h"
+#include "filter.h"
+#include "timeshift.h"
+#include "playlist.h"
 
-int video_decoder(void *);
+// Fast-start probing limits. Enough for the demuxer to find the codec parameters of typical
+// mp4/mkv files without reading seconds worth of packets up front.
+#define FAST_START_PROBESIZE 32768
+#define FAST_START_ANALYZEDURATION 100000
+// While playing, the demuxer only reads ahead until every played queue holds this many packets
+// (or all of them this many bytes), so hiding the video does not leave it far behind.
+#define DEMUX_MIN_QUEUED_PACKETS 50
+#define DEMUX_MAX_QUEUED_BYTES (16 * 1024 * 1024)
+
+// Makes a blocking open or read of a stalled input return once the player quits.
+int input_interrupt(void *opaque) {
+    return ((MediaPlayerState *)opaque)->quit;
+}
+
+int open_input(MediaPlayerState *mp) {
+    mp->fmt_ctx = avformat_alloc_context();
+    if (mp->fmt_ctx == NULL) {
+        fprintf(stderr, "Failed to allocate the input context.\n");
+        return -1;
+    }
+    mp->fmt_ctx->interrupt_callback = (AVIOInterruptCB){ input_interrupt, mp };
+    AVDictionary *opts = NULL;
+    if (mp->fast_start) {
+        av_dict_set_int(&opts, "probesize", FAST_START_PROBESIZE, 0);
+        av_dict_set_int(&opts, "analyzeduration", FAST_START_ANALYZEDURATION, 0);
+    }
+
+    stats_phase_begin(&mp->stats, STARTUP_PHASE_OPEN);
+    int ret = avformat_open_input(&mp->fmt_ctx, mp->filepath, NULL, &opts);
+    av_dict_free(&opts);
+    if (ret != 0) {
+        fprintf(stderr, "Error opening the input.\n");
+        return -1;
+    }
+    stats_phase_end(&mp->stats, STARTUP_PHASE_OPEN);
+
+    stats_phase_begin(&mp->stats, STARTUP_PHASE_PROBE);
+    if (avformat_find_stream_info(mp->fmt_ctx, NULL) < 0) {
+        fprintf(stderr, "Error finding stream info.\n");
+        return -1;
+    }
+    stats_phase_end(&mp->stats, STARTUP_PHASE_PROBE);
+
+    return 0;
+}
+
+int open_input_thread(void *arg) {
+    return open_input((MediaPlayerState *)arg);
+}
+
+AVCodecContext* open_stream_codec(AVStream *stream, int threads) {
+    const AVCodec *codec = avcodec_find_decoder(stream->codecpar->codec_id);
+    if (codec == NULL) {
+        fprintf(stderr, "Unable to find the decoder.\n");
+        return NULL;
+    }
+    AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
+    if (!codec_ctx) {
+        fprintf(stderr, "Failed to allocate codec context.\n");
+        return NULL;
+    }
+    if (avcodec_parameters_to_context(codec_ctx, stream->codecpar) < 0) {
+        fprintf(stderr, "Error turning codec params from fmt_ctx to codec_ctx.\n");
+        avcodec_free_context(&codec_ctx);
+        return NULL;
+    }
+    codec_ctx->pkt_timebase = stream->time_base;
+    codec_ctx->thread_count = threads;
+    if (avcodec_open2(codec_ctx, codec, NULL) != 0) {
+        fprintf(stderr, "Unable to open the codec.\n");
+        avcodec_free_context(&codec_ctx);
+        return NULL;
+    }
+    return codec_ctx;
+}
+
+static int find_stream_by_language(AVFormatContext *fmt_ctx, enum AVMediaType type, const char *language) {
+    for (int i = 0; i < fmt_ctx->nb_streams; i++) {
+        AVStream *stream = fmt_ctx->streams[i];
+        if (stream->codecpar->codec_type != type) {
+            continue;
+        }
+        AVDictionaryEntry *tag = av_dict_get(stream->metadata, "language", NULL, 0);
+        if (tag != NULL && strcmp(tag->value, language) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int select_stream(AVFormatContext *fmt_ctx, enum AVMediaType type, int requested, const char *language, int related) {
+    if (requested >= 0) {
+        if (requested >= fmt_ctx->nb_streams || fmt_ctx->streams[requested]->codecpar->codec_type != type) {
+            fprintf(stderr, "Stream %d is not a %s stream.\n", requested, av_get_media_type_string(type));
+            return AVERROR_STREAM_NOT_FOUND;
+        }
+        return requested;
+    }
+    if (language != NULL) {
+        int stream_id = find_stream_by_language(fmt_ctx, type, language);
+        if (stream_id >= 0) {
+            return stream_id;
+        }
+        fprintf(stderr, "No %s stream with language %s, falling back to the best stream.\n", av_get_media_type_string(type), language);
+    }
+    return av_find_best_stream(fmt_ctx, type, -1, related, NULL, 0);
+}
+
+// Picks the played video, audio and subtitle streams and marks every other stream AVDISCARD_ALL so the
+// demuxer skips their packets instead of handing them to decoder_thread.
+int select_streams(MediaPlayerState *mp) {
+    AVFormatContext *fmt_ctx = mp->fmt_ctx;
+
+    int video_stream_id = -1;
+    if (!mp->audio_only) {
+        video_stream_id = select_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, mp->requested_video_stream, NULL, -1);
+        if (video_stream_id < 0 && mp->requested_video_stream >= 0) {
+            return -1;
+        }
+    }
+    int audio_stream_id = -1;
+    if (!mp->no_audio) {
+        audio_stream_id = select_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, mp->requested_audio_stream,
+                                        mp->requested_audio_language, video_stream_id);
+    }
+    if (audio_stream_id < 0 && (mp->requested_audio_stream >= 0 || mp->audio_only)) {
+        if (mp->audio_only) {
+            fprintf(stderr, "No audio stream to play.\n");
+        }
+        return -1;
+    }
+    // Subtitles are only shown over video and never fail the open when missing.
+    int subtitle_stream_id = -1;
+    if (video_stream_id >= 0 && !mp->no_subtitles) {
+        subtitle_stream_id = select_stream(fmt_ctx, AVMEDIA_TYPE_SUBTITLE, mp->requested_subtitle_stream, NULL, video_stream_id);
+    }
+    mp->video_stream_id = video_stream_id >= 0 ? video_stream_id : -1;
+    mp->audio_stream_id = audio_stream_id >= 0 ? audio_stream_id : -1;
+    mp->subtitle_stream_id = subtitle_stream_id >= 0 ? subtitle_stream_id : -1;
+
+    for (int i = 0; i < fmt_ctx->nb_streams; i++) {
+        if (i == mp->video_stream_id || i == mp->audio_stream_id || i == mp->subtitle_stream_id) {
+            fmt_ctx->streams[i]->discard = AVDISCARD_DEFAULT;
+        } else {
+            fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    return 0;
+}
 
 int open_codec(const char *filepath, MediaPlayerState *mp)
 {
     if (mp->fmt_ctx == NULL) {
-        if (avformat_open_input(&mp->fmt_ctx, filepath, NULL, NULL) != 0) {
-            fprintf(stderr, "Error opening the input.\n");
+        mp->filepath = filepath;
+        if (open_input(mp) != 0) {
             return -1;
         }
+    }
 
-        if (avformat_find_stream_info(mp->fmt_ctx, NULL) < 0) {
-            fprintf(stderr, "Error finding stream info.\n");
+    if (select_streams(mp) != 0) {
+        return -1;
+    }
+
+    stats_phase_begin(&mp->stats, STARTUP_PHASE_CODEC_OPEN);
+    if (mp->video_stream_id >= 0) {
+        mp->video_codec_ctx = open_stream_codec(mp->fmt_ctx->streams[mp->video_stream_id], mp->decoder_threads);
+        if (mp->video_codec_ctx == NULL) {
+            return -1;
+        }
+    }
+    if (mp->audio_stream_id >= 0) {
+        mp->audio_codec_ctx = open_stream_codec(mp->fmt_ctx->streams[mp->audio_stream_id], mp->decoder_threads);
+        if (mp->audio_codec_ctx == NULL) {
             return -1;
         }
     }
+    if (mp->subtitle_stream_id >= 0) {
+        mp->subtitle_codec_ctx = open_stream_codec(mp->fmt_ctx->streams[mp->subtitle_stream_id], 1);
+        if (mp->subtitle_codec_ctx == NULL) {
+            fprintf(stderr, "Playing without subtitles.\n");
+            mp->fmt_ctx->streams[mp->subtitle_stream_id]->discard = AVDISCARD_ALL;
+            mp->subtitle_stream_id = -1;
+        }
+    }
+    stats_phase_end(&mp->stats, STARTUP_PHASE_CODEC_OPEN);
+    mp->active_audio_stream_id = mp->audio_stream_id;
 
-    for (int i = 0; i < (mp->fmt_ctx)->nb_streams; i++) {
-        switch (mp->fmt_ctx->streams[i]->codecpar->codec_type) {
-            case AVMEDIA_TYPE_AUDIO:
-                mp->audio_stream_id = i;
-                const AVCodec *aCodec = avcodec_find_decoder(mp->fmt_ctx->streams[i]->codecpar->codec_id);
-                if (aCodec == NULL) {
-                    fprintf(stderr, "Unable to find the decoder.\n");
-                    return -1;
-                }
-                mp->audio_codec_ctx = avcodec_alloc_context3(aCodec);
-                if (!mp->audio_codec_ctx) {
-                    fprintf(stderr, "Failed to allocate codec context.\n");
-                    return -1;
-                }
-
-                if (avcodec_parameters_to_context(mp->audio_codec_ctx, mp->fmt_ctx->streams[i]->codecpar) < 0) {
-                    fprintf(stderr, "Error turning codec params from fmt_ctx to codec_ctx.\n");
-                    return -1;
-                }
-                if (avcodec_open2(mp->audio_codec_ctx, aCodec, NULL) != 0) {
-                    fprintf(stderr, "Unable to open the codec.\n");
-                    return -1;
-                }
-                swr_alloc_set_opts2(&mp->resampler_ctx,
-                                                       &mp->audio_codec_ctx->ch_layout, AV_SAMPLE_FMT_S16,               mp->audio_codec_ctx->sample_rate,
-                                                       &mp->audio_codec_ctx->ch_layout, mp->audio_codec_ctx->sample_fmt, mp->audio_codec_ctx->sample_rate,
-                                                       0, NULL);
-                if (mp->resampler_ctx == NULL) {
-                    fprintf(stderr, "Error allocating swr options.\n");
-                    return -1;
-                }
-                if (swr_init(mp->resampler_ctx) < 0) {
-                    fprintf(stderr, "Error initializing swr context.\n");
-                    return -1;
-                }
-                break;
-            case AVMEDIA_TYPE_VIDEO:
-                mp->video_stream_id = i;
-                mp->video_tid = SDL_CreateThread(video_decoder, "video-decoder", mp);
-                const AVCodec *vCodec = avcodec_find_decoder(mp->fmt_ctx->streams[i]->codecpar->codec_id);
-                if (vCodec == NULL) {
-                    fprintf(stderr, "Unable to find the decoder.\n");
-                    return -1;
-                }
-                mp->video_codec_ctx = avcodec_alloc_context3(vCodec);
-                if (!mp->video_codec_ctx) {
-                    fprintf(stderr, "Failed to allocate codec context.\n");
-                    return -1;
-                }
-                if (avcodec_parameters_to_context(mp->video_codec_ctx, mp->fmt_ctx->streams[i]->codecpar) < 0) {
-                    fprintf(stderr, "Error turning codec params from fmt_ctx to codec_ctx.\n");
-                    return -1;
-                }
-                if (avcodec_open2(mp->video_codec_ctx, vCodec, NULL) != 0) {
-                    fprintf(stderr, "Unable to open the codec.\n");
-                    return -1;
-                }
-                break;
-            default:
-                break;
+    return 0;
+}
+
+// Returns the next audio stream after the current one, wrapping around, or -1 if there is none.
+int next_audio_stream(MediaPlayerState *mp) {
+    int nb_streams = mp->fmt_ctx->nb_streams;
+    int current = SDL_AtomicGet(&mp->audio_switch_request);
+    if (current < 0) {
+        current = mp->audio_stream_id;
+    }
+    for (int i = 1; i <= nb_streams; i++) {
+        int stream_id = (current + i) % nb_streams;
+        if (mp->fmt_ctx->streams[stream_id]->codecpar->codec_type == AVMEDIA_TYPE_AUDIO) {
+            return stream_id;
         }
     }
+    return -1;
+}
+
+void request_audio_stream(MediaPlayerState *mp, int stream_id) {
+    if (stream_id >= 0) {
+        SDL_AtomicSet(&mp->audio_switch_request, stream_id);
+        wake_waiters(mp->demux_mutex, mp->demux_cond);
+    }
+}
+
+// Runs on the demuxer thread. Opens the decoder for the new track and flips the demuxer over to it,
+// the audio decoder picks the new codec up from the pending slot without the device being stopped.
+int switch_audio_stream(MediaPlayerState *mp, int stream_id) {
+    if (stream_id == mp->audio_stream_id || mp->resampler_ctx == NULL) {
+        return 0;
+    }
+    if (mp->playlist.nb_items > 1) {
+        fprintf(stderr, "Audio tracks can not be switched while playing a playlist.\n");
+        return -1;
+    }
+    AVStream *stream = mp->fmt_ctx->streams[stream_id];
+    if (stream->codecpar->codec_type != AVMEDIA_TYPE_AUDIO) {
+        fprintf(stderr, "Stream %d is not an audio stream.\n", stream_id);
+        return -1;
+    }
+
+    AVCodecContext *codec_ctx = open_stream_codec(stream, mp->decoder_threads);
+    if (codec_ctx == NULL) {
+        return -1;
+    }
+    SwrContext *resampler_ctx = create_resampler(mp, codec_ctx);
+    if (resampler_ctx == NULL) {
+        avcodec_free_context(&codec_ctx);
+        return -1;
+    }
 
+    SDL_LockMutex(mp->audio_switch_mutex);
+    if (mp->pending_audio_codec_ctx != NULL) {
+        avcodec_free_context(&mp->pending_audio_codec_ctx);
+        swr_free(&mp->pending_resampler_ctx);
+    }
+    mp->pending_audio_codec_ctx = codec_ctx;
+    mp->pending_resampler_ctx = resampler_ctx;
+    mp->pending_audio_stream_id = stream_id;
+    SDL_UnlockMutex(mp->audio_switch_mutex);
+
+    mp->fmt_ctx->streams[mp->audio_stream_id]->discard = AVDISCARD_ALL;
+    stream->discard = AVDISCARD_DEFAULT;
+    mp->audio_stream_id = stream_id;
+    // Packets of the old track still queued are dropped by the audio decoder.
+    return 0;
+}
+
+// Discarding or reading every stream, chosen per pass of bench_demux. The first pass only warms the
+// page cache and is not reported, the timed passes then run in the order discard, all, all, discard
+// so neither mode gets the warmer cache by running second.
+static const int bench_demux_discard[] = { 0, 1, 0, 0, 1 };
+
+// Reads the whole input as fast as possible and reports demux throughput of each timed pass.
+int bench_demux(MediaPlayerState *mp) {
+    AVPacket pkt;
+    int nb_passes = (int)(sizeof(bench_demux_discard) / sizeof(bench_demux_discard[0]));
+    for (int pass = 0; pass < nb_passes; pass++) {
+        int discard = bench_demux_discard[pass];
+        for (int i = 0; i < mp->fmt_ctx->nb_streams; i++) {
+            int played = i == mp->video_stream_id || i == mp->audio_stream_id || i == mp->subtitle_stream_id;
+            mp->fmt_ctx->streams[i]->discard = discard && !played ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+        }
+        if (avformat_seek_file(mp->fmt_ctx, -1, INT64_MIN, 0, INT64_MAX, 0) < 0) {
+            fprintf(stderr, "Failed to seek to the start of the input.\n");
+            return -1;
+        }
+
+        int64_t nb_packets = 0, nb_bytes = 0, nb_played = 0;
+        Uint64 begin = SDL_GetPerformanceCounter();
+        while (av_read_frame(mp->fmt_ctx, &pkt) >= 0) {
+            nb_packets++;
+            nb_bytes += pkt.size;
+            if (pkt.stream_index == mp->video_stream_id || pkt.stream_index == mp->audio_stream_id ||
+                pkt.stream_index == mp->subtitle_stream_id) {
+                nb_played++;
+            }
+            av_packet_unref(&pkt);
+        }
+        double seconds = (double)(SDL_GetPerformanceCounter() - begin) / (double)SDL_GetPerformanceFrequency();
+        if (pass == 0) {
+            continue;
+        }
+
+        printf("%-16s streams=%u packets=%lld (played %lld) bytes=%lld time=%.3fs %.0f pkt/s %.2f MB/s\n",
+               discard ? "discard unused" : "read all", mp->fmt_ctx->nb_streams,
+               (long long)nb_packets, (long long)nb_played, (long long)nb_bytes, seconds,
+               nb_packets / seconds, nb_bytes / seconds / (1024.0 * 1024.0));
+    }
+    return 0;
+}
+
+void request_video_suspend(MediaPlayerState *mp, int suspend) {
+    SDL_AtomicSet(&mp->video_suspend_request, suspend);
+    wake_waiters(mp->demux_mutex, mp->demux_cond);
+}
+
+// Runs on the demuxer thread. A suspended video stream is discarded by the demuxer and its queue
+// emptied, which leaves the video decoder parked in pkt_queue_get. A timeshift keeps recording it,
+// route_packet drops its packets instead.
+static void set_video_suspended(MediaPlayerState *mp, int suspended) {
+    if (mp->timeshift.dir == NULL) {
+        AVFormatContext *input = playlist_input(mp);
+        input->streams[playlist_input_stream(mp, mp->video_stream_id)]->discard = suspended ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+    }
+    if (suspended) {
+        // Keeps the marker of a seek that may still be queued, and the end of the input.
+        pkt_queue_put_flush(&mp->video_pkt_queue, SDL_AtomicGet(&mp->play_serial));
+        if (mp->eof) {
+            pkt_queue_put_eof(&mp->video_pkt_queue, 0);
+        }
+    } else {
+        mp->video_wait_keyframe = 1;
+    }
+    mp->video_suspended = suspended;
+}
+
+static int demux_queue_full(PacketQueue *q, int active, int min_packets) {
+    return !active || q->nb_packets >= min_packets;
+}
+
+// The byte cap never starves a stream whose queue ran empty.
+int play_queues_full(MediaPlayerState *mp) {
+    int video_active = mp->video_stream_id >= 0 && !mp->video_suspended;
+    int audio_active = mp->audio_stream_id >= 0;
+    if (mp->video_pkt_queue.size + mp->audio_pkt_queue.size >= DEMUX_MAX_QUEUED_BYTES) {
+        return demux_queue_full(&mp->video_pkt_queue, video_active, 1) &&
+               demux_queue_full(&mp->audio_pkt_queue, audio_active, 1);
+    }
+    return demux_queue_full(&mp->video_pkt_queue, video_active, DEMUX_MIN_QUEUED_PACKETS) &&
+           demux_queue_full(&mp->audio_pkt_queue, audio_active, DEMUX_MIN_QUEUED_PACKETS);
+}
+
+// Only while playing, replay pulls one stream at a time and needs the others to keep filling. A
+// live input being timeshifted is never held back, the timeshift reader throttles playback instead.
+static int demux_should_wait(MediaPlayerState *mp) {
+    return !mp->headless && mp->timeshift.dir == NULL && play_queues_full(mp);
+}
+
+// Anything the demuxer has to act on besides reading.
+static int demux_has_request(MediaPlayerState *mp, int seek_handled) {
+    return SDL_AtomicGet(&mp->audio_switch_request) >= 0 || SDL_AtomicGet(&mp->seek_serial) != seek_handled ||
+           (mp->video_stream_id >= 0 && SDL_AtomicGet(&mp->video_suspend_request) != mp->video_suspended);
+}
+
+// Sleeps until a decoder takes a packet or a request comes in, at the end of the input until a
+// request comes in. Everything is checked again under demux_mutex, the signals are sent holding it,
+// so none of them gets lost.
+static void demux_wait(MediaPlayerState *mp, int seek_handled) {
+    SDL_LockMutex(mp->demux_mutex);
+    if (!mp->quit && (mp->eof || demux_should_wait(mp)) && !demux_has_request(mp, seek_handled)) {
+        SDL_CondWait(mp->demux_cond, mp->demux_mutex);
+    }
+    SDL_UnlockMutex(mp->demux_mutex);
+}
+
+// Any thread. The thread feeding the packet queues picks the target up, targets past the end of
+// what can be reached land at the end.
+void request_seek(MediaPlayerState *mp, double target) {
+    SDL_AtomicLock(&mp->seek_lock);
+    mp->seek_target = target;
+    SDL_AtomicIncRef(&mp->seek_serial);
+    SDL_AtomicUnlock(&mp->seek_lock);
+    wake_waiters(mp->demux_mutex, mp->demux_cond);
+}
+
+// Returns the serial of a seek requested since *handled, or -1. Sets *target to its target.
+int take_seek_request(MediaPlayerState *mp, int *handled, double *target) {
+    SDL_AtomicLock(&mp->seek_lock);
+    int serial = SDL_AtomicGet(&mp->seek_serial);
+    *target = mp->seek_target;
+    SDL_AtomicUnlock(&mp->seek_lock);
+    if (serial == *handled) {
+        return -1;
+    }
+    *handled = serial;
+    return serial;
+}
+
+// Drops everything queued for playback and leaves a marker with serial in each played queue. The
+// decoders flush their state on it and display_frame drops frames decoded before it.
+void flush_play_queues(MediaPlayerState *mp, int serial) {
+    SDL_AtomicSet(&mp->play_serial, serial);
+    // Playback goes on from the target, the end of the input is marked again once it is reached.
+    mp->eof = 0;
+    if (mp->video_stream_id >= 0) {
+        pkt_queue_put_flush(&mp->video_pkt_queue, serial);
+    }
+    if (mp->audio_stream_id >= 0) {
+        pkt_queue_put_flush(&mp->audio_pkt_queue, serial);
+    }
+    if (mp->subtitle_stream_id >= 0) {
+        pkt_queue_put_flush(&mp->subtitle_pkt_queue, serial);
+    }
+}
+
+// End of the input. Each queue gets a marker the decoder drains on, the decoders then wait for a
+// seek like the thread feeding the queues. Nothing seeks a headless run, there pkt_queue_get fails
+// once the marker has been taken.
+void finish_play_queues(MediaPlayerState *mp) {
+    mp->eof = 1;
+    pkt_queue_put_eof(&mp->video_pkt_queue, mp->headless);
+    pkt_queue_put_eof(&mp->audio_pkt_queue, mp->headless);
+    pkt_queue_put_eof(&mp->subtitle_pkt_queue, mp->headless);
+}
+
+// Seeks within the playlist item being demuxed, target is on the timeline of the first item.
+static void seek_input(MediaPlayerState *mp, int serial, double target) {
+    if (isinf(target)) {
+        return;
+    }
+    AVFormatContext *input = playlist_input(mp);
+    // The clock runs on the pts of the input, so target already includes its start_time. Targets
+    // before the start land on the first keyframe.
+    double start = input->start_time != AV_NOPTS_VALUE ? input->start_time / (double)AV_TIME_BASE : 0.0;
+    int64_t ts = (int64_t)(FFMAX(target - playlist_offset(mp), start) * AV_TIME_BASE);
+    // Lands on the keyframe at or before ts, the frames up to ts are shown late and dropped.
+    if (avformat_seek_file(input, -1, INT64_MIN, ts, ts, 0) < 0) {
+        fprintf(stderr, "Failed to seek to %.3f.\n", target);
+        return;
+    }
+    flush_play_queues(mp, serial);
+    if (mp->video_stream_id >= 0 && !mp->video_suspended) {
+        mp->video_wait_keyframe = 1;
+    }
+}
+
+// Hands pkt to the queue of its stream, takes the reference. Returns -1 when the queue failed.
+int route_packet(MediaPlayerState *mp, AVPacket *pkt) {
+    if (pkt->stream_index == mp->video_stream_id &&
+        (mp->video_suspended || (mp->video_wait_keyframe && !(pkt->flags & AV_PKT_FLAG_KEY)))) {
+        av_packet_unref(pkt);
+        return 0;
+    } else if (pkt->stream_index == mp->video_stream_id) {
+        if (mp->video_wait_keyframe) {
+            // The decoder still holds references from before the suspension.
+            mp->video_wait_keyframe = 0;
+            SDL_AtomicSet(&mp->video_flush, 1);
+        }
+        return pkt_queue_put(&mp->video_pkt_queue, pkt);
+    } else if (pkt->stream_index == mp->audio_stream_id) {
+        return pkt_queue_put(&mp->audio_pkt_queue, pkt);
+    } else if (pkt->stream_index == mp->subtitle_stream_id) {
+        return pkt_queue_put(&mp->subtitle_pkt_queue, pkt);
+    }
+    av_packet_unref(pkt);
     return 0;
 }
 
 int decoder_thread(void *arg) {
     MediaPlayerState *mp = (MediaPlayerState *)arg;
     AVPacket pkt;
+    int seek_handled = 0;
 
-    while (1) {
-        if (av_read_frame(mp->fmt_ctx, &pkt) < 0) {
-            printf("Read total %d packets.\n", mp->video_pkt_queue.nb_packets);
-            printf("No more packets to read from the source.\n");
-            break;
+    while (!mp->quit) {
+        int switch_request = SDL_AtomicSet(&mp->audio_switch_request, -1);
+        if (switch_request >= 0) {
+            switch_audio_stream(mp, switch_request);
+        }
+        int suspend = SDL_AtomicGet(&mp->video_suspend_request);
+        if (mp->video_stream_id >= 0 && suspend != mp->video_suspended) {
+            set_video_suspended(mp, suspend);
+        }
+        // With a timeshift the reader seeks within the recording, the live input keeps going.
+        double seek_target;
+        int seek_serial = mp->timeshift.dir == NULL ? take_seek_request(mp, &seek_handled, &seek_target) : -1;
+        if (seek_serial >= 0) {
+            seek_input(mp, seek_serial, seek_target);
+        }
+        if (mp->eof || demux_should_wait(mp)) {
+            demux_wait(mp, seek_handled);
+            continue;
         }
 
-        if (pkt.stream_index == mp->video_stream_id) {
-            if (pkt_queue_put(&mp->video_pkt_queue, &pkt) != 0) {
+        int read = mp->playlist.nb_items > 1 ? playlist_read_packet(mp, &pkt) : av_read_frame(mp->fmt_ctx, &pkt);
+        if (read < 0 && mp->playlist.nb_items > 1 && playlist_next(mp) == 0) {
+            continue;
+        }
+        if (read < 0) {
+            if (!mp->quit) {
+                printf("Read total %d packets.\n", mp->video_pkt_queue.nb_packets);
+                printf("No more packets to read from the source.\n");
+            }
+            // Nothing seeks a headless run, and a timeshift goes on from the recording.
+            if (mp->headless || mp->timeshift.dir != NULL) {
                 break;
-            };
+            }
+            // Stays around for seeks, sleeping in demux_wait until one comes in.
+            finish_play_queues(mp);
+            continue;
         }
 
-        if (pkt.stream_index == mp->audio_stream_id) {
-            if (pkt_queue_put(&mp->audio_pkt_queue, &pkt) != 0) {
-                break;
-            };
+        int ret = mp->timeshift.dir != NULL ? timeshift_live_packet(mp, &pkt) : route_packet(mp, &pkt);
+        if (ret != 0) {
+            break;
         }
     }
 
+    // After an error as well, the decoders drain and report the end of the stream. A timeshift may
+    // go on playing the recording, its reader marks the end then.
+    if (!mp->quit && !(mp->timeshift.dir != NULL && timeshift_live_ended(mp))) {
+        finish_play_queues(mp);
+    }
     return 0;
 }
 
-int video_decoder(void *arg) {
-    MediaPlayerState *m = (MediaPlayerState *)arg;
+// Moves frame into the next framebuffer slot, waiting for one to be released. Returns -1 on quit.
+int framebuffer_put(MediaPlayerState *m, AVFrame *frame) {
+    SDL_LockMutex(m->framebuffer_mutex);
+    while (m->framebuffer[m->frame_write_index].allocated != 0) {
+        if (m->quit) {
+            SDL_UnlockMutex(m->framebuffer_mutex);
+            return -1;
+        }
+        SDL_CondWait(m->framebuffer_cond, m->framebuffer_mutex);
+    }
+    if (m->display->rect.h == -1) {
+        display_fit(m->display, frame->width, frame->height);
+    }
+    m->framebuffer[m->frame_write_index].serial = (int)(intptr_t)frame->opaque;
+    m->framebuffer[m->frame_write_index].playlist_item = m->playlist.video_item;
+    av_frame_move_ref(m->framebuffer[m->frame_write_index].frame, frame);
+    m->framebuffer[m->frame_write_index].allocated = 1;
+    m->frame_write_index = (m->frame_write_index + 1) % m->framebuffer_size;
+    // Frames after the end of the stream come from a seek, the video goes on.
+    m->video_finished = 0;
+    SDL_CondSignal(m->framebuffer_cond);
+    SDL_UnlockMutex(m->framebuffer_mutex);
+
+    SDL_Event e = { .type = REFRESH_VIDEO_DISPLAY };
+    SDL_PushEvent(&e);
+    return 0;
+}
+
+// Called by the last video stage at the end of the stream and when it returns, display_frame stops
+// waiting for frames. The refresh it pushes lets the main loop find out that the video is over.
+void framebuffer_finish(MediaPlayerState *m) {
+    SDL_LockMutex(m->framebuffer_mutex);
+    m->video_finished = 1;
+    SDL_CondBroadcast(m->framebuffer_cond);
+    SDL_UnlockMutex(m->framebuffer_mutex);
+
+    SDL_Event e = { .user = { .type = REFRESH_VIDEO_DISPLAY, .code = REFRESH_END_OF_STREAM } };
+    SDL_PushEvent(&e);
+}
+
+static int video_output_frame(MediaPlayerState *m, AVFrame *frame) {
+    // The seek serial travels with the frame, through the filter graph as well.
+    frame->opaque = (void *)(intptr_t)m->video_serial;
+    if (m->playlist.video_item > 0) {
+        playlist_frame_to_timeline(m, m->playlist.video_item, frame);
+    }
+    int ret;
+    if (m->video_filters != NULL) {
+        ret = frame_queue_put(&m->filter_queue, frame, m);
+    } else {
+        ret = framebuffer_put(m, frame);
+    }
+    av_frame_unref(frame);
+    return ret;
+}
+
+static int video_receive_frames(MediaPlayerState *m) {
+    AVFrame *frame = m->video_frame;
+    while (avcodec_receive_frame(m->video_codec_ctx, frame) == 0) {
+        if (video_output_frame(m, frame) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Drains the decoder of the item that ended, then continues with the pre-opened decoder of the
+// next one, starting with the frames it already decoded.
+static int video_next_item(MediaPlayerState *m, int index) {
+    avcodec_send_packet(m->video_codec_ctx, NULL);
+    if (video_receive_frames(m) != 0) {
+        return -1;
+    }
+    playlist_take_video(m, index);
+    PlaylistItem *item = &m->playlist.items[index];
+    for (int i = 0; i < item->nb_frames; i++) {
+        int ret = video_output_frame(m, item->frames[i]);
+        av_frame_free(&item->frames[i]);
+        if (ret != 0) {
+            return -1;
+        }
+    }
+    item->nb_frames = 0;
+    return video_receive_frames(m);
+}
+
+// The frames the decoder still holds back for reordering go out first, then the next stage finds
+// out that the stream ended. The decoder takes packets again after the flush of the next seek.
+static int video_end_of_stream(MediaPlayerState *m) {
+    avcodec_send_packet(m->video_codec_ctx, NULL);
+    if (video_receive_frames(m) != 0) {
+        return -1;
+    }
+    if (m->video_filters == NULL) {
+        framebuffer_finish(m);
+        return 0;
+    }
+    // A blank frame marks the end for the filter thread.
+    av_frame_unref(m->video_frame);
+    return frame_queue_put(&m->filter_queue, m->video_frame, m);
+}
+
+static int video_decode_loop(MediaPlayerState *m) {
     AVPacket pkt;
 
     while (1) {
@@ -124,39 +633,63 @@ int video_decoder(void *arg) {
             break;
         }
 
+        if (pkt.stream_index == PLAYLIST_PACKET_STREAM_INDEX) {
+            if (video_next_item(m, pkt.pos) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (pkt.stream_index == EOF_PACKET_STREAM_INDEX) {
+            if (video_end_of_stream(m) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        // At high playback rates most frames get dropped at display anyway, skip decoding the
+        // ones nothing else references.
+        if (SDL_AtomicGet(&m->playback_rate) >= SKIP_NONREF_PLAYBACK_RATE) {
+            m->video_codec_ctx->skip_frame = AVDISCARD_NONREF;
+        } else {
+            m->video_codec_ctx->skip_frame = AVDISCARD_DEFAULT;
+        }
+
+        if (pkt.stream_index == FLUSH_PACKET_STREAM_INDEX) {
+            avcodec_flush_buffers(m->video_codec_ctx);
+            m->video_serial = pkt.pos;
+            continue;
+        }
+        if (SDL_AtomicSet(&m->video_flush, 0)) {
+            avcodec_flush_buffers(m->video_codec_ctx);
+        }
+        // A packet the decoder rejects only costs its frame, the GOP cache does the same.
         if (avcodec_send_packet(m->video_codec_ctx, &pkt) != 0) {
-            fprintf(stderr, "Failed to send the packet to the decoder.\n");
-            return -1;
+            fprintf(stderr, "Failed to send the packet to the decoder, skipping it.\n");
         }
+        av_packet_unref(&pkt);
 
-        AVFrame frame;
-        while (avcodec_receive_frame(m->video_codec_ctx, &frame) == 0) {
-            SDL_LockMutex(m->framebuffer_mutex);
-            while (1) {
-                if (m->framebuffer[m->frame_write_index].allocated == 0) {
-                    if (m->display->rect.h == -1) {
-                        m->display->rect.h = frame.height;
-                        m->display->rect.w = frame.width;
-                        if (m->display->rect.w > WINDOW_WIDTH) {
-                            m->display->rect.w = WINDOW_WIDTH;
-                            m->display->rect.h = (frame.height * m->display->rect.w) / frame.width;
-                        }
-                    }
-                    m->framebuffer[m->frame_write_index].frame = frame;
-                    m->framebuffer[m->frame_write_index].allocated = 1;
-                    m->frame_write_index = (m->frame_write_index + 1) % VIDEO_FRAME_BUFFER_SIZE;
-                    SDL_CondSignal(m->framebuffer_cond);
-                    SDL_Event e;
-                    e.type = REFRESH_VIDEO_DISPLAY;
-                    int resp = SDL_PushEvent(&e);
-                    break;
-                } else {
-                    SDL_CondWait(m->framebuffer_cond, m->framebuffer_mutex);
-                } 
-            }
-            SDL_UnlockMutex(m->framebuffer_mutex);
+        if (video_receive_frames(m) != 0) {
+            return -1;
         }
     }
     return -1;
 }
-#endif
\ No newline at end of file
+
+int video_decoder(void *arg) {
+    MediaPlayerState *m = (MediaPlayerState *)arg;
+    if (m->video_filters != NULL) {
+        m->filter_tid = SDL_CreateThread(video_filter_thread, "video-filter", m);
+        if (m->filter_tid == NULL) {
+            PRINT_SDL_ERROR();
+            framebuffer_finish(m);
+            return -1;
+        }
+    }
+    int ret = video_decode_loop(m);
+    if (m->video_filters != NULL) {
+        // The filter thread drains what is queued and finishes the framebuffer itself.
+        frame_queue_finish(&m->filter_queue);
+    } else {
+        framebuffer_finish(m);
+    }
+    return ret;
+}
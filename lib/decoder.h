@@ -0,0 +1,30 @@
+#include <libswresample/swresample.h>
+#include <libavutil/avutil.h>
+
+#ifndef DECODER_H
+#define DECODER_H
+#include "typedefs.h"
+
+int input_interrupt(void *opaque);
+int open_input(MediaPlayerState *mp);
+int open_input_thread(void *arg);
+int open_codec(const char *filepath, MediaPlayerState *mp);
+AVCodecContext* open_stream_codec(AVStream *stream, int threads);
+int select_streams(MediaPlayerState *mp);
+int next_audio_stream(MediaPlayerState *mp);
+void request_audio_stream(MediaPlayerState *mp, int stream_id);
+void request_video_suspend(MediaPlayerState *mp, int suspend);
+int switch_audio_stream(MediaPlayerState *mp, int stream_id);
+int bench_demux(MediaPlayerState *mp);
+int play_queues_full(MediaPlayerState *mp);
+void request_seek(MediaPlayerState *mp, double target);
+int take_seek_request(MediaPlayerState *mp, int *handled, double *target);
+void flush_play_queues(MediaPlayerState *mp, int serial);
+void finish_play_queues(MediaPlayerState *mp);
+int route_packet(MediaPlayerState *mp, AVPacket *pkt);
+int decoder_thread(void *arg);
+int framebuffer_put(MediaPlayerState *m, AVFrame *frame);
+void framebuffer_finish(MediaPlayerState *m);
+int video_decoder(void *arg);
+
+#endif
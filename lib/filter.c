@@ -0,0 +1,213 @@
+#include <libavfilter/buffersrc.h>
+#include <libavfilter/buffersink.h>
+#include <libavutil/opt.h>
+
+#include "filter.h"
+#include "decoder.h"
+
+// Optional post-processing of decoded video through a libavfilter graph (deinterlacing, cropping,
+// scaling, colour adjustments). It runs on its own thread between the video decoder and the
+// framebuffer, the decoder only blocks once FILTER_QUEUE_SIZE frames are waiting for the graph.
+
+#define FILTER_ARGS_SIZE 256
+
+// Moves frame into the queue, waiting while it is full. Returns -1 on quit.
+int frame_queue_put(FrameQueue *q, AVFrame *frame, MediaPlayerState *m) {
+    SDL_LockMutex(q->mutex);
+    while (q->nb_frames == FILTER_QUEUE_SIZE) {
+        if (m->quit) {
+            SDL_UnlockMutex(q->mutex);
+            return -1;
+        }
+        SDL_CondWait(q->cond, q->mutex);
+    }
+    av_frame_move_ref(q->frames[q->write_index], frame);
+    q->write_index = (q->write_index + 1) % FILTER_QUEUE_SIZE;
+    q->nb_frames++;
+    SDL_CondSignal(q->cond);
+    SDL_UnlockMutex(q->mutex);
+    return 0;
+}
+
+// Returns 0 with the oldest frame moved into frame, 1 once the queue is finished and empty and
+// -1 on quit.
+int frame_queue_get(FrameQueue *q, AVFrame *frame, MediaPlayerState *m) {
+    int ret = 0;
+    SDL_LockMutex(q->mutex);
+    while (1) {
+        if (m->quit) {
+            ret = -1;
+            break;
+        }
+        if (q->nb_frames > 0) {
+            av_frame_move_ref(frame, q->frames[q->read_index]);
+            q->read_index = (q->read_index + 1) % FILTER_QUEUE_SIZE;
+            q->nb_frames--;
+            SDL_CondSignal(q->cond);
+            break;
+        } else if (q->finished) {
+            ret = 1;
+            break;
+        }
+        SDL_CondWait(q->cond, q->mutex);
+    }
+    SDL_UnlockMutex(q->mutex);
+    return ret;
+}
+
+void frame_queue_finish(FrameQueue *q) {
+    SDL_LockMutex(q->mutex);
+    q->finished = 1;
+    SDL_CondBroadcast(q->cond);
+    SDL_UnlockMutex(q->mutex);
+}
+
+// Builds buffer -> video_filters -> buffersink for frames shaped like frame. The sink only accepts
+// yuv420p since that is what the display texture takes, libavfilter inserts the conversion.
+static int filter_graph_init(MediaPlayerState *m, AVFrame *frame) {
+    AVStream *stream = m->fmt_ctx->streams[m->video_stream_id];
+    AVRational sar = frame->sample_aspect_ratio;
+    char args[FILTER_ARGS_SIZE];
+    snprintf(args, sizeof(args), "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
+             frame->width, frame->height, frame->format, stream->time_base.num, stream->time_base.den,
+             sar.num, FFMAX(sar.den, 1));
+
+    m->filter_graph = avfilter_graph_alloc();
+    if (m->filter_graph == NULL) {
+        fprintf(stderr, "Failed to allocate the filter graph.\n");
+        return -1;
+    }
+    // Slice threading for the filters that support it, 0 picks the CPU count like the decoders.
+    m->filter_graph->nb_threads = m->decoder_threads;
+
+    if (avfilter_graph_create_filter(&m->filter_src, avfilter_get_by_name("buffer"), "in", args, NULL, m->filter_graph) < 0 ||
+        avfilter_graph_create_filter(&m->filter_sink, avfilter_get_by_name("buffersink"), "out", NULL, NULL, m->filter_graph) < 0) {
+        fprintf(stderr, "Failed to create the filter graph endpoints.\n");
+        return -1;
+    }
+    enum AVPixelFormat pix_fmts[] = { AV_PIX_FMT_YUV420P, AV_PIX_FMT_NONE };
+    if (av_opt_set_int_list(m->filter_sink, "pix_fmts", pix_fmts, AV_PIX_FMT_NONE, AV_OPT_SEARCH_CHILDREN) < 0) {
+        fprintf(stderr, "Failed to set the filter graph output format.\n");
+        return -1;
+    }
+
+    // Named from the point of view of the chain: its input is the output of "in" and vice versa.
+    AVFilterInOut *outputs = avfilter_inout_alloc();
+    AVFilterInOut *inputs = avfilter_inout_alloc();
+    int ret = -1;
+    if (outputs == NULL || inputs == NULL) {
+        fprintf(stderr, "Failed to allocate the filter graph endpoints.\n");
+        goto end;
+    }
+    outputs->name = av_strdup("in");
+    outputs->filter_ctx = m->filter_src;
+    outputs->pad_idx = 0;
+    outputs->next = NULL;
+    inputs->name = av_strdup("out");
+    inputs->filter_ctx = m->filter_sink;
+    inputs->pad_idx = 0;
+    inputs->next = NULL;
+
+    if (avfilter_graph_parse_ptr(m->filter_graph, m->video_filters, &inputs, &outputs, NULL) < 0) {
+        fprintf(stderr, "Failed to parse the filter chain \"%s\".\n", m->video_filters);
+        goto end;
+    }
+    if (avfilter_graph_config(m->filter_graph, NULL) < 0) {
+        fprintf(stderr, "Failed to configure the filter chain \"%s\".\n", m->video_filters);
+        goto end;
+    }
+    ret = 0;
+end:
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    return ret;
+}
+
+// Pulls everything the graph has ready into the framebuffer. Filters can change the frame rate
+// (yadif=1), so the timestamps are brought back to the stream time base display_frame expects.
+static int filter_drain(MediaPlayerState *m, AVFrame *frame) {
+    AVRational stream_tb = m->fmt_ctx->streams[m->video_stream_id]->time_base;
+    AVRational sink_tb = av_buffersink_get_time_base(m->filter_sink);
+    int ret;
+    while ((ret = av_buffersink_get_frame(m->filter_sink, frame)) >= 0) {
+        if (frame->pts != AV_NOPTS_VALUE) {
+            frame->best_effort_timestamp = av_rescale_q(frame->pts, sink_tb, stream_tb);
+        }
+        ret = framebuffer_put(m, frame);
+        av_frame_unref(frame);
+        if (ret != 0) {
+            return -1;
+        }
+    }
+    if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+        fprintf(stderr, "Failed to get a frame from the filter graph.\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Flushes the frames held back by filters that look ahead, like yadif. The graph takes no frames
+// after that, the next frame builds a new one.
+static int filter_flush(MediaPlayerState *m, AVFrame *out) {
+    if (m->filter_graph == NULL) {
+        return 0;
+    }
+    if (av_buffersrc_add_frame(m->filter_src, NULL) < 0) {
+        return -1;
+    }
+    int ret = filter_drain(m, out);
+    avfilter_graph_free(&m->filter_graph);
+    return ret;
+}
+
+static int video_filter_loop(MediaPlayerState *m, AVFrame *in, AVFrame *out) {
+    while (1) {
+        int ret = frame_queue_get(&m->filter_queue, in, m);
+        if (ret < 0) {
+            return -1;
+        }
+        if (ret == 1) {
+            return filter_flush(m, out);
+        }
+        // The blank frame the video decoder puts at the end of the stream, frames come again after
+        // a seek.
+        if (in->buf[0] == NULL) {
+            if (filter_flush(m, out) != 0) {
+                return -1;
+            }
+            framebuffer_finish(m);
+            continue;
+        }
+
+        if (m->filter_graph == NULL && filter_graph_init(m, in) != 0) {
+            av_frame_unref(in);
+            return -1;
+        }
+        in->pts = in->best_effort_timestamp;
+        // Takes over the reference, in is left blank.
+        if (av_buffersrc_add_frame(m->filter_src, in) < 0) {
+            fprintf(stderr, "Failed to feed the filter graph.\n");
+            av_frame_unref(in);
+            return -1;
+        }
+        if (filter_drain(m, out) != 0) {
+            return -1;
+        }
+    }
+}
+
+int video_filter_thread(void *arg) {
+    MediaPlayerState *m = (MediaPlayerState *)arg;
+    AVFrame *in = av_frame_alloc();
+    AVFrame *out = av_frame_alloc();
+    int ret = -1;
+    if (in == NULL || out == NULL) {
+        fprintf(stderr, "Failed to allocate the filter frames.\n");
+    } else {
+        ret = video_filter_loop(m, in, out);
+    }
+    av_frame_free(&in);
+    av_frame_free(&out);
+    framebuffer_finish(m);
+    return ret;
+}
@@ -0,0 +1,12 @@
+#include <libavfilter/avfilter.h>
+
+#ifndef FILTER_H
+#define FILTER_H
+#include "typedefs.h"
+
+int frame_queue_put(FrameQueue *q, AVFrame *frame, MediaPlayerState *m);
+int frame_queue_get(FrameQueue *q, AVFrame *frame, MediaPlayerState *m);
+void frame_queue_finish(FrameQueue *q);
+int video_filter_thread(void *arg);
+
+#endif
@@ -0,0 +1,15 @@
+#include <stdint.h>
+
+#ifndef FONT_H
+#define FONT_H
+
+// Built in 8x16 bitmap font for printable ASCII, one byte per row with the leftmost pixel in the
+// most significant bit.
+#define FONT_GLYPH_WIDTH 8
+#define FONT_GLYPH_HEIGHT 16
+#define FONT_FIRST_CHAR 32
+#define FONT_NB_GLYPHS 95
+
+extern const uint8_t font_glyphs[FONT_NB_GLYPHS][FONT_GLYPH_HEIGHT];
+
+#endif
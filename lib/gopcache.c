@@ -0,0 +1,526 @@
+#include <math.h>
+#include <stdio.h>
+
+#include "gopcache.h"
+#include "clock.h"
+#include "decoder.h"
+#include "output.h"
+
+// Frame stepping and reverse playback. Stepping or reversing pauses normal playback and hands the
+// display to the GOP cache. Its worker thread has its own demuxer and video decoder: it seeks to the
+// keyframe before a position, decodes the whole GOP forward once and keeps the frames. The main thread
+// then shows them one at a time in either direction, reverse playback is paced by an SDL timer at the
+// frame rate. While the frames of one GOP are shown the worker already decodes the next one in the
+// playing direction, so reverse playback only stalls when decoding a GOP takes longer than showing one.
+// Leaving seeks normal playback to the frame on screen.
+//
+// Frames are kept as the references the decoder handed out. GOPs farthest from the position are
+// evicted once the cache goes over its memory budget.
+
+// Times closer than this are the same frame.
+#define GOP_CACHE_EPSILON 1e-6
+// GOPs decoded forward at most when a seek lands further back than the GOP that was asked for.
+#define GOP_CACHE_MAX_FORWARD 8
+#define GOP_CACHE_FALLBACK_FRAME_DURATION (1.0 / 25)
+
+static size_t frame_bytes(AVFrame *frame) {
+    size_t bytes = 0;
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i] != NULL; i++) {
+        bytes += frame->buf[i]->size;
+    }
+    return bytes;
+}
+
+static double frame_time(GopCache *c, AVFrame *frame) {
+    return frame->best_effort_timestamp * av_q2d(c->time_base);
+}
+
+// GOP covering pos, NULL if it is not cached. Needs mutex, like every function on the entries.
+static GopCacheEntry* gop_cache_lookup(GopCache *c, double pos) {
+    for (int i = 0; i < c->nb_gops; i++) {
+        if (c->gops[i].start <= pos && pos < c->gops[i].end) {
+            return &c->gops[i];
+        }
+    }
+    return NULL;
+}
+
+static GopCacheEntry* gop_cache_neighbour(GopCache *c, GopCacheEntry *gop, int direction) {
+    for (int i = 0; i < c->nb_gops; i++) {
+        GopCacheEntry *other = &c->gops[i];
+        if ((direction > 0 && fabs(other->start - gop->end) < GOP_CACHE_EPSILON) ||
+            (direction < 0 && fabs(other->end - gop->start) < GOP_CACHE_EPSILON)) {
+            return other;
+        }
+    }
+    return NULL;
+}
+
+// References the frame next to pos in direction into c->shown. Returns 1 when it was found, 0 when
+// its GOP still has to be decoded and -1 at the start or end of the input.
+static int gop_cache_find(GopCache *c, double pos, int direction, double *gop_start) {
+    GopCacheEntry *gop = gop_cache_lookup(c, pos);
+    if (gop == NULL) {
+        return 0;
+    }
+    AVFrame *found = NULL;
+    for (int i = 0; i < gop->nb_frames; i++) {
+        double t = frame_time(c, gop->frames[i]);
+        if (direction > 0 && t > pos + GOP_CACHE_EPSILON) {
+            found = gop->frames[i];
+            break;
+        }
+        if (direction < 0 && t < pos - GOP_CACHE_EPSILON) {
+            found = gop->frames[i];
+        }
+    }
+    if (found == NULL) {
+        GopCacheEntry *next = gop_cache_neighbour(c, gop, direction);
+        if (next == NULL) {
+            return isinf(direction > 0 ? gop->end : gop->start) ? -1 : 0;
+        }
+        if (next->nb_frames == 0) {
+            return -1;
+        }
+        gop = next;
+        found = gop->frames[direction > 0 ? 0 : gop->nb_frames - 1];
+    }
+    av_frame_unref(c->shown);
+    if (av_frame_ref(c->shown, found) < 0) {
+        return -1;
+    }
+    *gop_start = gop->start;
+    return 1;
+}
+
+static double gop_distance(GopCacheEntry *gop, double pos) {
+    if (pos < gop->start) {
+        return gop->start - pos;
+    }
+    return pos >= gop->end ? pos - gop->end : 0.0;
+}
+
+static void gop_cache_remove(GopCache *c, int index) {
+    c->bytes -= c->gops[index].bytes;
+    gop_cache_entry_free(&c->gops[index]);
+    c->gops[index] = c->gops[--c->nb_gops];
+}
+
+// Takes over gop. Makes room for it by evicting the GOPs farthest from the requested position.
+static void gop_cache_insert(GopCache *c, GopCacheEntry *gop) {
+    SDL_LockMutex(c->mutex);
+    // The first GOP is decoded a second time when stepping back from it, with an open start.
+    for (int i = 0; i < c->nb_gops; i++) {
+        if (c->gops[i].key_pts == gop->key_pts) {
+            gop_cache_remove(c, i);
+            break;
+        }
+    }
+    while (c->nb_gops > 0 && (c->nb_gops == GOP_CACHE_MAX_GOPS || c->bytes + gop->bytes > c->budget)) {
+        int farthest = 0;
+        for (int i = 1; i < c->nb_gops; i++) {
+            if (gop_distance(&c->gops[i], c->request_pos) > gop_distance(&c->gops[farthest], c->request_pos)) {
+                farthest = i;
+            }
+        }
+        gop_cache_remove(c, farthest);
+        c->evictions++;
+    }
+    if (c->gops_decoded == 1 && gop->bytes * 2 > c->budget) {
+        fprintf(stderr, "The GOP cache holds less than two GOPs of %.0f MB, reverse playback will stall.\n",
+                gop->bytes / (1024.0 * 1024.0));
+    }
+    c->gops[c->nb_gops++] = *gop;
+    c->bytes += gop->bytes;
+    SDL_UnlockMutex(c->mutex);
+}
+
+// Keeps the decoded frames from key up to, not including, next_key.
+static int gop_cache_receive(GopCache *c, GopCacheEntry *gop, int64_t key, int64_t next_key) {
+    while (avcodec_receive_frame(c->codec_ctx, c->frame) == 0) {
+        int64_t pts = c->frame->best_effort_timestamp;
+        // Frames shown before the keyframe belong to the GOP before, they are decoded with it.
+        if (pts == AV_NOPTS_VALUE || pts < key || (next_key != AV_NOPTS_VALUE && pts >= next_key)) {
+            av_frame_unref(c->frame);
+            continue;
+        }
+        if (gop->nb_frames == gop->capacity) {
+            int capacity = FFMAX(2 * gop->capacity, 32);
+            AVFrame **frames = av_realloc_array(gop->frames, capacity, sizeof(AVFrame *));
+            if (frames == NULL) {
+                fprintf(stderr, "Failed to grow the GOP cache entry.\n");
+                av_frame_unref(c->frame);
+                return -1;
+            }
+            gop->frames = frames;
+            gop->capacity = capacity;
+        }
+        AVFrame *frame = av_frame_alloc();
+        if (frame == NULL) {
+            fprintf(stderr, "Failed to allocate a GOP cache frame.\n");
+            av_frame_unref(c->frame);
+            return -1;
+        }
+        av_frame_move_ref(frame, c->frame);
+        gop->bytes += frame_bytes(frame);
+        gop->frames[gop->nb_frames++] = frame;
+    }
+    return 0;
+}
+
+// Decodes the GOP of the keyframe the demuxer was sought to. The packets of the next GOP that are
+// shown before its keyframe are decoded as well, they need the references of this one.
+static int gop_cache_decode(MediaPlayerState *m, GopCacheEntry *gop, int64_t *next_key) {
+    GopCache *c = &m->gop_cache;
+    AVPacket *pkt = c->pkt;
+    int64_t key = AV_NOPTS_VALUE;
+    *next_key = AV_NOPTS_VALUE;
+    Uint64 begin = SDL_GetPerformanceCounter();
+    avcodec_flush_buffers(c->codec_ctx);
+
+    while (!m->quit && av_read_frame(c->fmt_ctx, pkt) >= 0) {
+        int64_t pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+        int keyframe = pkt->flags & AV_PKT_FLAG_KEY;
+        if (pkt->stream_index != m->video_stream_id || (key == AV_NOPTS_VALUE && (!keyframe || pts == AV_NOPTS_VALUE))) {
+            av_packet_unref(pkt);
+            continue;
+        }
+        if (key == AV_NOPTS_VALUE) {
+            key = pts;
+        } else if (*next_key == AV_NOPTS_VALUE && keyframe && pts > key) {
+            *next_key = pts;
+        } else if (*next_key != AV_NOPTS_VALUE && (pts == AV_NOPTS_VALUE || pts > *next_key)) {
+            av_packet_unref(pkt);
+            break;
+        }
+        // A damaged packet only costs its frame, like in normal playback.
+        avcodec_send_packet(c->codec_ctx, pkt);
+        av_packet_unref(pkt);
+        if (gop_cache_receive(c, gop, key, *next_key) != 0) {
+            return -1;
+        }
+    }
+    if (key == AV_NOPTS_VALUE) {
+        return -1;
+    }
+    // The frames the decoder still holds back for reordering.
+    avcodec_send_packet(c->codec_ctx, NULL);
+    if (gop_cache_receive(c, gop, key, *next_key) != 0) {
+        return -1;
+    }
+
+    gop->key_pts = key;
+    gop->start = key * av_q2d(c->time_base);
+    gop->end = *next_key == AV_NOPTS_VALUE ? INFINITY : *next_key * av_q2d(c->time_base);
+    c->gops_decoded++;
+    c->frames_decoded += gop->nb_frames;
+    c->decode_ticks += SDL_GetPerformanceCounter() - begin;
+    return 0;
+}
+
+// Makes sure the GOP covering pos is cached. Returns 0 with its bounds.
+static int gop_cache_ensure(MediaPlayerState *m, double pos, double *start, double *end) {
+    GopCache *c = &m->gop_cache;
+    SDL_LockMutex(c->mutex);
+    GopCacheEntry *cached = gop_cache_lookup(c, pos);
+    if (cached != NULL) {
+        *start = cached->start;
+        *end = cached->end;
+    }
+    SDL_UnlockMutex(c->mutex);
+    if (cached != NULL) {
+        return 0;
+    }
+
+    int64_t ts = (int64_t)floor(pos / av_q2d(c->time_base));
+    for (int i = 0; i < GOP_CACHE_MAX_FORWARD && !m->quit; i++) {
+        // Lands on the keyframe at or before ts, or on the first one when ts is before it.
+        if (avformat_seek_file(c->fmt_ctx, m->video_stream_id, INT64_MIN, ts, ts, 0) < 0 &&
+            avformat_seek_file(c->fmt_ctx, m->video_stream_id, INT64_MIN, ts, INT64_MAX, 0) < 0) {
+            fprintf(stderr, "Failed to seek the GOP cache to %.3f.\n", pos);
+            return -1;
+        }
+        GopCacheEntry gop = { 0 };
+        int64_t next_key;
+        if (gop_cache_decode(m, &gop, &next_key) != 0) {
+            fprintf(stderr, "Failed to decode the GOP at %.3f.\n", pos);
+            gop_cache_entry_free(&gop);
+            return -1;
+        }
+        if (gop.start > pos) {
+            // There is no keyframe before pos, nothing comes before this GOP.
+            gop.start = -INFINITY;
+        }
+        *start = gop.start;
+        *end = gop.end;
+        gop_cache_insert(c, &gop);
+        if (pos < *end) {
+            return 0;
+        }
+        ts = next_key;
+    }
+    return -1;
+}
+
+static int gop_cache_superseded(GopCache *c, int serial) {
+    SDL_LockMutex(c->mutex);
+    int superseded = c->request_serial != serial;
+    SDL_UnlockMutex(c->mutex);
+    return superseded;
+}
+
+static void gop_cache_ready(void) {
+    SDL_Event event = { .user = { .type = GOP_CACHE_EVENT, .code = GOP_CACHE_READY } };
+    SDL_PushEvent(&event);
+}
+
+static int gop_cache_worker(void *arg) {
+    MediaPlayerState *m = (MediaPlayerState *)arg;
+    GopCache *c = &m->gop_cache;
+    int handled = 0;
+
+    SDL_LockMutex(c->mutex);
+    while (!m->quit) {
+        if (c->request_serial == handled) {
+            SDL_CondWait(c->cond, c->mutex);
+            continue;
+        }
+        handled = c->request_serial;
+        double pos = c->request_pos;
+        int direction = c->request_dir;
+        SDL_UnlockMutex(c->mutex);
+
+        double start, end;
+        if (gop_cache_ensure(m, pos, &start, &end) == 0) {
+            gop_cache_ready();
+            // The next GOP in the playing direction, decoded while this one is shown.
+            double next = direction > 0 ? end : start - GOP_CACHE_EPSILON;
+            if (direction != 0 && !isinf(next) && !gop_cache_superseded(c, handled) &&
+                gop_cache_ensure(m, next, &start, &end) == 0) {
+                gop_cache_ready();
+            }
+        }
+        SDL_LockMutex(c->mutex);
+    }
+    SDL_UnlockMutex(c->mutex);
+    return 0;
+}
+
+static void gop_cache_request(GopCache *c, double pos, int direction) {
+    SDL_LockMutex(c->mutex);
+    c->request_pos = pos;
+    c->request_dir = direction;
+    c->request_serial++;
+    SDL_CondSignal(c->cond);
+    SDL_UnlockMutex(c->mutex);
+}
+
+// Opens the input a second time for the worker, only the video stream is read from it.
+static int gop_cache_open(MediaPlayerState *m) {
+    GopCache *c = &m->gop_cache;
+    if (c->tid != NULL) {
+        return 0;
+    }
+    if (c->fmt_ctx != NULL) {
+        // An earlier attempt failed half way.
+        return -1;
+    }
+    c->fmt_ctx = avformat_alloc_context();
+    if (c->fmt_ctx == NULL) {
+        fprintf(stderr, "Failed to allocate the GOP cache input.\n");
+        return -1;
+    }
+    c->fmt_ctx->interrupt_callback = (AVIOInterruptCB){ input_interrupt, m };
+    if (avformat_open_input(&c->fmt_ctx, m->filepath, NULL, NULL) != 0 ||
+        avformat_find_stream_info(c->fmt_ctx, NULL) < 0 || m->video_stream_id >= (int)c->fmt_ctx->nb_streams) {
+        fprintf(stderr, "Failed to open %s for stepping.\n", m->filepath);
+        return -1;
+    }
+    for (int i = 0; i < (int)c->fmt_ctx->nb_streams; i++) {
+        if (i != m->video_stream_id) {
+            c->fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+    AVStream *stream = c->fmt_ctx->streams[m->video_stream_id];
+    c->codec_ctx = open_stream_codec(stream, m->decoder_threads);
+    c->pkt = av_packet_alloc();
+    c->frame = av_frame_alloc();
+    c->shown = av_frame_alloc();
+    if (c->codec_ctx == NULL || c->pkt == NULL || c->frame == NULL || c->shown == NULL) {
+        fprintf(stderr, "Failed to set up the GOP cache decoder.\n");
+        return -1;
+    }
+    c->time_base = stream->time_base;
+    AVRational rate = av_guess_frame_rate(c->fmt_ctx, stream, NULL);
+    c->frame_duration = rate.num > 0 && rate.den > 0 ? av_q2d(av_inv_q(rate)) : GOP_CACHE_FALLBACK_FRAME_DURATION;
+    if (c->budget == 0) {
+        c->budget = (size_t)GOP_CACHE_DEFAULT_BUDGET_MB * 1024 * 1024;
+    }
+
+    c->tid = SDL_CreateThread(gop_cache_worker, "gop-cache", m);
+    if (c->tid == NULL) {
+        PRINT_SDL_ERROR();
+        return -1;
+    }
+    return 0;
+}
+
+static int gop_cache_enter(MediaPlayerState *m) {
+    GopCache *c = &m->gop_cache;
+    if (c->active) {
+        return 0;
+    }
+    if (m->headless || m->video_codec_ctx == NULL) {
+        fprintf(stderr, "There is no video to step through.\n");
+        return -1;
+    }
+    if (m->playlist.nb_items > 1 || m->timeshift.dir != NULL) {
+        fprintf(stderr, "Stepping and reverse playback need a single file input.\n");
+        return -1;
+    }
+    if (gop_cache_open(m) != 0) {
+        return -1;
+    }
+    set_paused(m, 1);
+    c->active = 1;
+    c->pending_step = 0;
+    c->hinted_start = NAN;
+    // The paused clock is at or after the frame on screen, stepping back from it would show that
+    // frame again.
+    c->position = isnan(m->displayed_pts) ? clock_get(&m->clock) : m->displayed_pts;
+    return 0;
+}
+
+// Shows the frame next to the one on screen in direction. When its GOP is not decoded yet the step
+// waits for the worker.
+static int gop_cache_show(MediaPlayerState *m, int direction) {
+    GopCache *c = &m->gop_cache;
+    double gop_start = 0.0;
+    SDL_LockMutex(c->mutex);
+    int found = gop_cache_find(c, c->position, direction, &gop_start);
+    SDL_UnlockMutex(c->mutex);
+
+    if (found == 0) {
+        c->pending_step = direction;
+        gop_cache_request(c, c->position, direction);
+        return 0;
+    }
+    c->pending_step = 0;
+    if (found < 0) {
+        // Start or end of the input.
+        gop_cache_reverse(m, 0);
+        return 0;
+    }
+    c->position = frame_time(c, c->shown);
+    m->displayed_pts = c->position;
+    if (gop_start != c->hinted_start) {
+        // Into another GOP, the worker goes on with the one after it.
+        c->hinted_start = gop_start;
+        gop_cache_request(c, c->position, direction);
+    }
+    return render_frame(m, c->shown);
+}
+
+// Main thread. Steps one frame forward (direction 1) or back (-1), pausing normal playback first.
+int gop_cache_step(MediaPlayerState *m, int direction) {
+    if (gop_cache_enter(m) != 0) {
+        return -1;
+    }
+    gop_cache_reverse(m, 0);
+    return gop_cache_show(m, direction > 0 ? 1 : -1);
+}
+
+// Milliseconds per frame, reverse playback follows the playback rate as well.
+static Uint32 gop_cache_interval(MediaPlayerState *m) {
+    return FFMAX(1, (Uint32)(m->gop_cache.frame_duration * 100000 / SDL_AtomicGet(&m->playback_rate)));
+}
+
+// Runs on SDL's timer thread, possibly while the player is torn down, and keeps its interval. The
+// main thread starts a new timer when the playback rate changes, see gop_cache_retime.
+static Uint32 gop_cache_timer(Uint32 interval, void *arg) {
+    (void)arg;
+    SDL_Event event = { .user = { .type = GOP_CACHE_EVENT, .code = GOP_CACHE_TICK } };
+    SDL_PushEvent(&event);
+    return interval;
+}
+
+static int gop_cache_start_timer(GopCache *c, Uint32 interval) {
+    c->timer = SDL_AddTimer(interval, gop_cache_timer, NULL);
+    if (c->timer == 0) {
+        PRINT_SDL_ERROR();
+        return -1;
+    }
+    c->timer_interval = interval;
+    return 0;
+}
+
+// Main thread, on every tick. Reverse playback follows a playback rate change from the next tick.
+static void gop_cache_retime(MediaPlayerState *m) {
+    GopCache *c = &m->gop_cache;
+    Uint32 interval = gop_cache_interval(m);
+    if (c->timer == 0 || interval == c->timer_interval) {
+        return;
+    }
+    SDL_RemoveTimer(c->timer);
+    if (gop_cache_start_timer(c, interval) != 0) {
+        c->reverse = 0;
+    }
+}
+
+// Main thread. Starts or stops playing backwards from the frame on screen.
+int gop_cache_reverse(MediaPlayerState *m, int reverse) {
+    GopCache *c = &m->gop_cache;
+    if (reverse && gop_cache_enter(m) != 0) {
+        return -1;
+    }
+    if (reverse == c->reverse) {
+        return 0;
+    }
+    c->reverse = reverse;
+    if (reverse) {
+        if (gop_cache_start_timer(c, gop_cache_interval(m)) != 0) {
+            c->reverse = 0;
+            return -1;
+        }
+    } else if (c->timer != 0) {
+        SDL_RemoveTimer(c->timer);
+        c->timer = 0;
+    }
+    return 0;
+}
+
+// Main thread, for every GOP_CACHE_EVENT.
+void gop_cache_event(MediaPlayerState *m, SDL_Event *event) {
+    GopCache *c = &m->gop_cache;
+    if (!c->active) {
+        return;
+    }
+    if (event->user.code == GOP_CACHE_READY) {
+        int step = c->pending_step;
+        if (step != 0) {
+            gop_cache_show(m, step);
+        }
+    } else if (c->reverse) {
+        gop_cache_retime(m);
+        if (c->pending_step != 0) {
+            // The previous frame is still being decoded, reverse playback waits for it.
+            c->stalls++;
+            return;
+        }
+        gop_cache_show(m, -1);
+    }
+}
+
+// Main thread. Normal playback goes on from the frame on screen, it stays paused unless resume.
+void gop_cache_leave(MediaPlayerState *m, int resume) {
+    GopCache *c = &m->gop_cache;
+    if (c->active) {
+        gop_cache_reverse(m, 0);
+        c->active = 0;
+        c->pending_step = 0;
+        request_seek(m, c->position);
+    }
+    if (resume) {
+        set_paused(m, 0);
+    }
+}
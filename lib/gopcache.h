@@ -0,0 +1,12 @@
+#include <SDL.h>
+
+#ifndef GOPCACHE_H
+#define GOPCACHE_H
+#include "typedefs.h"
+
+int gop_cache_step(MediaPlayerState *m, int direction);
+int gop_cache_reverse(MediaPlayerState *m, int reverse);
+void gop_cache_event(MediaPlayerState *m, SDL_Event *event);
+void gop_cache_leave(MediaPlayerState *m, int resume);
+
+#endif
@@ -0,0 +1,426 @@
+#include <math.h>
+#include <libavutil/cpu.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "meter.h"
+#include "output.h"
+
+// Audio level metering on the S16 output of the resampler: per channel peak and RMS, EBU R128
+// momentary loudness (K-weighted, 400 ms window) and optionally a spectrum of the mono downmix.
+// Everything runs on the thread that calls audio_decode_frame, in blocks of 100 ms, and the values
+// of the last complete block are published under meter->lock for the overlay and the reports.
+//
+// Peak and sum of squares are scanned with SSE2 or AVX2 when the channel count divides the vector
+// width, so that lane i always holds channel i % channels. The K-weighting biquads are recursive
+// and stay scalar, they run once per sample and channel on doubles.
+
+#define METER_BLOCKS_PER_SECOND 10
+#define METER_MOMENTARY_BLOCKS 4
+#define METER_SPECTRUM_SIZE 2048
+#define METER_SPECTRUM_MIN_FREQ 20.0
+#define FULL_SCALE_POWER (32768.0 * 32768.0)
+
+// Overlay geometry in pixels and the level range it shows.
+#define METER_BAR_WIDTH 8
+#define METER_BAR_GAP 2
+#define METER_MARGIN 10
+#define METER_BAR_HEIGHT 160
+#define METER_SPECTRUM_HEIGHT 80
+#define METER_FLOOR_DB -60.0f
+#define METER_CLIP_DB -1.0f
+
+#ifdef __SSE2__
+static int meter_scan_sse2(const int16_t *src, int nb_values, uint16_t *lane_peak, int64_t *lane_sq) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i peak = zero;
+    __m128i sq[4] = { zero, zero, zero, zero };
+    int i = 0;
+    for (; i + 8 <= nb_values; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+        // The saturating negation turns -32768 into 32767, one LSB off on a full scale negative peak.
+        peak = _mm_max_epi16(peak, _mm_max_epi16(x, _mm_subs_epi16(zero, x)));
+        // Squares fit in 31 bits, widened to 64 before accumulating.
+        __m128i lo = _mm_mullo_epi16(x, x);
+        __m128i hi = _mm_mulhi_epi16(x, x);
+        __m128i sq_0123 = _mm_unpacklo_epi16(lo, hi);
+        __m128i sq_4567 = _mm_unpackhi_epi16(lo, hi);
+        sq[0] = _mm_add_epi64(sq[0], _mm_unpacklo_epi32(sq_0123, zero));
+        sq[1] = _mm_add_epi64(sq[1], _mm_unpackhi_epi32(sq_0123, zero));
+        sq[2] = _mm_add_epi64(sq[2], _mm_unpacklo_epi32(sq_4567, zero));
+        sq[3] = _mm_add_epi64(sq[3], _mm_unpackhi_epi32(sq_4567, zero));
+    }
+    _mm_storeu_si128((__m128i *)lane_peak, peak);
+    for (int k = 0; k < 4; k++) {
+        _mm_storeu_si128((__m128i *)(lane_sq + 2 * k), sq[k]);
+    }
+    return i;
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static int meter_scan_avx2(const int16_t *src, int nb_values, uint16_t *lane_peak, int64_t *lane_sq) {
+    __m256i peak = _mm256_setzero_si256();
+    __m256i sq[4] = { peak, peak, peak, peak };
+    int i = 0;
+    for (; i + 16 <= nb_values; i += 16) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+        // abs(-32768) stays 0x8000, which is right when compared unsigned.
+        peak = _mm256_max_epu16(peak, _mm256_abs_epi16(x));
+        __m256i lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(x));
+        __m256i hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(x, 1));
+        lo = _mm256_mullo_epi32(lo, lo);
+        hi = _mm256_mullo_epi32(hi, hi);
+        sq[0] = _mm256_add_epi64(sq[0], _mm256_cvtepu32_epi64(_mm256_castsi256_si128(lo)));
+        sq[1] = _mm256_add_epi64(sq[1], _mm256_cvtepu32_epi64(_mm256_extracti128_si256(lo, 1)));
+        sq[2] = _mm256_add_epi64(sq[2], _mm256_cvtepu32_epi64(_mm256_castsi256_si128(hi)));
+        sq[3] = _mm256_add_epi64(sq[3], _mm256_cvtepu32_epi64(_mm256_extracti128_si256(hi, 1)));
+    }
+    _mm256_storeu_si256((__m256i *)lane_peak, peak);
+    for (int k = 0; k < 4; k++) {
+        _mm256_storeu_si256((__m256i *)(lane_sq + 4 * k), sq[k]);
+    }
+    return i;
+}
+#endif
+
+static void meter_select_scan(AudioMeter *meter) {
+    meter->scan = NULL;
+    meter->lanes = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    if (16 % meter->channels == 0 && (av_get_cpu_flags() & AV_CPU_FLAG_AVX2)) {
+        meter->scan = meter_scan_avx2;
+        meter->lanes = 16;
+        return;
+    }
+#endif
+#ifdef __SSE2__
+    if (8 % meter->channels == 0) {
+        meter->scan = meter_scan_sse2;
+        meter->lanes = 8;
+    }
+#endif
+}
+
+// Peak and sum of squares of nb_samples interleaved samples into the current block.
+static void meter_scan(AudioMeter *meter, const int16_t *src, int nb_samples) {
+    int nb_values = nb_samples * meter->channels;
+    int done = 0;
+    if (meter->scan != NULL) {
+        uint16_t lane_peak[METER_MAX_LANES];
+        int64_t lane_sq[METER_MAX_LANES];
+        done = meter->scan(src, nb_values, lane_peak, lane_sq);
+        for (int lane = 0; lane < meter->lanes; lane++) {
+            int ch = lane % meter->channels;
+            meter->block_peak[ch] = FFMAX(meter->block_peak[ch], lane_peak[lane]);
+            meter->block_sq[ch] += lane_sq[lane];
+        }
+    }
+    // done is a multiple of the lane count and so of the channel count.
+    for (int i = done, ch = 0; i < nb_values; i++) {
+        int v = src[i];
+        meter->block_peak[ch] = FFMAX(meter->block_peak[ch], FFABS(v));
+        meter->block_sq[ch] += v * v;
+        if (++ch == meter->channels) {
+            ch = 0;
+        }
+    }
+}
+
+static void meter_k_weight(AudioMeter *meter, const int16_t *src, int nb_samples) {
+    const double *sb = meter->shelf_b, *sa = meter->shelf_a;
+    const double *hb = meter->highpass_b, *ha = meter->highpass_a;
+    for (int ch = 0; ch < meter->channels; ch++) {
+        if (meter->k_gain[ch] == 0.0) {
+            continue;
+        }
+        // Transposed direct form II, z[0..1] for the shelf and z[2..3] for the high pass.
+        double *z = meter->k_state[ch];
+        double sum = 0.0;
+        for (int i = 0; i < nb_samples; i++) {
+            double x = src[i * meter->channels + ch] / 32768.0;
+            double y = sb[0] * x + z[0];
+            z[0] = sb[1] * x - sa[0] * y + z[1];
+            z[1] = sb[2] * x - sa[1] * y;
+            double w = hb[0] * y + z[2];
+            z[2] = hb[1] * y - ha[0] * w + z[3];
+            z[3] = hb[2] * y - ha[1] * w;
+            sum += w * w;
+        }
+        meter->block_k_sq += meter->k_gain[ch] * sum;
+    }
+}
+
+static void meter_spectrum_push(AudioMeter *meter, const int16_t *src, int nb_samples) {
+    float scale = 1.0f / (32768.0f * meter->channels);
+    int mask = meter->spectrum_size - 1;
+    for (int i = 0; i < nb_samples; i++) {
+        int sum = 0;
+        for (int ch = 0; ch < meter->channels; ch++) {
+            sum += src[i * meter->channels + ch];
+        }
+        meter->spectrum_ring[meter->spectrum_pos] = sum * scale;
+        meter->spectrum_pos = (meter->spectrum_pos + 1) & mask;
+    }
+}
+
+static float meter_db(double power) {
+    return power > 0.0 ? (float)(10.0 * log10(power)) : -INFINITY;
+}
+
+// Band levels of the last spectrum_size samples, 0 dB is a full scale sine.
+static void meter_spectrum(AudioMeter *meter, float *spectrum_db) {
+    int mask = meter->spectrum_size - 1;
+    for (int i = 0; i < meter->spectrum_size; i++) {
+        meter->tx_in[i] = meter->spectrum_ring[(meter->spectrum_pos + i) & mask] * meter->spectrum_window[i];
+    }
+    meter->tx_fn(meter->tx, meter->tx_out, meter->tx_in, sizeof(float));
+
+    // A Hann windowed sine of amplitude 1 peaks at size / 4 in its bin.
+    double norm = 4.0 / meter->spectrum_size;
+    for (int band = 0; band < METER_SPECTRUM_BANDS; band++) {
+        double max = 0.0;
+        for (int bin = meter->band_edges[band]; bin < meter->band_edges[band + 1]; bin++) {
+            AVComplexFloat c = meter->tx_out[bin];
+            max = FFMAX(max, (double)c.re * c.re + (double)c.im * c.im);
+        }
+        spectrum_db[band] = meter_db(max * norm * norm);
+    }
+}
+
+static void meter_publish(AudioMeter *meter) {
+    float peak_db[METER_MAX_CHANNELS], rms_db[METER_MAX_CHANNELS], spectrum_db[METER_SPECTRUM_BANDS];
+    float max_peak_db = -INFINITY;
+    for (int ch = 0; ch < meter->channels; ch++) {
+        peak_db[ch] = meter_db((double)meter->block_peak[ch] * meter->block_peak[ch] / FULL_SCALE_POWER);
+        rms_db[ch] = meter_db(meter->block_sq[ch] / (meter->block_size * FULL_SCALE_POWER));
+        max_peak_db = FFMAX(max_peak_db, peak_db[ch]);
+    }
+
+    meter->k_power[meter->nb_blocks % METER_MOMENTARY_BLOCKS] = meter->block_k_sq / meter->block_size;
+    meter->nb_blocks++;
+    int nb_blocks = FFMIN(meter->nb_blocks, METER_MOMENTARY_BLOCKS);
+    double power = 0.0;
+    for (int i = 0; i < nb_blocks; i++) {
+        power += meter->k_power[i];
+    }
+    float momentary_lufs = -0.691f + meter_db(power / nb_blocks);
+
+    if (meter->spectrum) {
+        meter_spectrum(meter, spectrum_db);
+    }
+
+    SDL_AtomicLock(&meter->lock);
+    SDL_memcpy(meter->peak_db, peak_db, sizeof(float) * meter->channels);
+    SDL_memcpy(meter->rms_db, rms_db, sizeof(float) * meter->channels);
+    meter->momentary_lufs = momentary_lufs;
+    if (meter->spectrum) {
+        SDL_memcpy(meter->spectrum_db, spectrum_db, sizeof(spectrum_db));
+    }
+    meter->max_peak_db = FFMAX(meter->max_peak_db, max_peak_db);
+    // The first blocks do not fill the momentary window yet.
+    if (meter->nb_blocks >= METER_MOMENTARY_BLOCKS) {
+        meter->max_momentary_lufs = FFMAX(meter->max_momentary_lufs, momentary_lufs);
+    }
+    meter->blocks_published++;
+    SDL_AtomicUnlock(&meter->lock);
+
+    meter->block_fill = 0;
+    meter->block_k_sq = 0.0;
+    SDL_memset(meter->block_peak, 0, sizeof(meter->block_peak));
+    SDL_memset(meter->block_sq, 0, sizeof(meter->block_sq));
+}
+
+// Meters nb_samples samples per channel in the output format of the audio device.
+void meter_process(AudioMeter *meter, const int16_t *src, int nb_samples) {
+    Uint64 begin = SDL_GetPerformanceCounter();
+    meter->samples += nb_samples;
+    while (nb_samples > 0) {
+        int n = FFMIN(nb_samples, meter->block_size - meter->block_fill);
+        meter_scan(meter, src, n);
+        meter_k_weight(meter, src, n);
+        if (meter->spectrum) {
+            meter_spectrum_push(meter, src, n);
+        }
+        meter->block_fill += n;
+        if (meter->block_fill == meter->block_size) {
+            meter_publish(meter);
+        }
+        src += n * meter->channels;
+        nb_samples -= n;
+    }
+    meter->ticks += SDL_GetPerformanceCounter() - begin;
+}
+
+// K-weighting filters of ITU-R BS.1770 for any sample rate, from the analog prototypes.
+static void meter_k_filters(AudioMeter *meter) {
+    double f0 = 1681.974450955533, gain_db = 3.999843853973347, q = 0.7071752369554196;
+    double k = tan(M_PI * f0 / meter->freq);
+    double vh = pow(10.0, gain_db / 20.0);
+    double vb = pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+    meter->shelf_b[0] = (vh + vb * k / q + k * k) / a0;
+    meter->shelf_b[1] = 2.0 * (k * k - vh) / a0;
+    meter->shelf_b[2] = (vh - vb * k / q + k * k) / a0;
+    meter->shelf_a[0] = 2.0 * (k * k - 1.0) / a0;
+    meter->shelf_a[1] = (1.0 - k / q + k * k) / a0;
+
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = tan(M_PI * f0 / meter->freq);
+    a0 = 1.0 + k / q + k * k;
+    meter->highpass_b[0] = 1.0;
+    meter->highpass_b[1] = -2.0;
+    meter->highpass_b[2] = 1.0;
+    meter->highpass_a[0] = 2.0 * (k * k - 1.0) / a0;
+    meter->highpass_a[1] = (1.0 - k / q + k * k) / a0;
+
+    // Channel weights for 5.1 (FL FR FC LFE BL BR), the LFE is not part of the loudness.
+    for (int ch = 0; ch < meter->channels; ch++) {
+        meter->k_gain[ch] = 1.0;
+    }
+    if (meter->channels == 6) {
+        meter->k_gain[3] = 0.0;
+        meter->k_gain[4] = meter->k_gain[5] = 1.41;
+    }
+}
+
+static int meter_spectrum_init(MediaPlayerState *m) {
+    AudioMeter *meter = &m->meter;
+    int size = METER_SPECTRUM_SIZE;
+    meter->spectrum_size = size;
+    meter->spectrum_ring = arena_alloc(&m->audio_scratch, size * sizeof(float));
+    meter->spectrum_window = arena_alloc(&m->audio_scratch, size * sizeof(float));
+    meter->tx_in = arena_alloc(&m->audio_scratch, size * sizeof(float));
+    meter->tx_out = arena_alloc(&m->audio_scratch, (size / 2 + 1) * sizeof(AVComplexFloat));
+    if (meter->spectrum_ring == NULL || meter->spectrum_window == NULL || meter->tx_in == NULL || meter->tx_out == NULL) {
+        fprintf(stderr, "Failed to allocate the spectrum buffers.\n");
+        return -1;
+    }
+    float scale = 1.0f;
+    if (av_tx_init(&meter->tx, &meter->tx_fn, AV_TX_FLOAT_RDFT, 0, size, &scale, 0) < 0) {
+        fprintf(stderr, "Failed to set up the spectrum transform.\n");
+        return -1;
+    }
+    for (int i = 0; i < size; i++) {
+        meter->spectrum_window[i] = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * i / size);
+    }
+
+    // Log spaced from METER_SPECTRUM_MIN_FREQ to Nyquist, at least one bin per band.
+    double ratio = meter->freq / 2.0 / METER_SPECTRUM_MIN_FREQ;
+    meter->band_edges[0] = 1;
+    for (int band = 1; band <= METER_SPECTRUM_BANDS; band++) {
+        double freq = METER_SPECTRUM_MIN_FREQ * pow(ratio, (double)band / METER_SPECTRUM_BANDS);
+        int edge = (int)lrint(freq * size / meter->freq);
+        meter->band_edges[band] = av_clip(edge, meter->band_edges[band - 1] + 1, size / 2 + 1);
+    }
+    return 0;
+}
+
+// Needs the output format in audio_spec, see setup_resampler.
+int meter_init(MediaPlayerState *m) {
+    AudioMeter *meter = &m->meter;
+    if (m->audio_spec.channels > METER_MAX_CHANNELS) {
+        fprintf(stderr, "Metering supports at most %d channels.\n", METER_MAX_CHANNELS);
+        return -1;
+    }
+    meter->channels = m->audio_spec.channels;
+    meter->freq = m->audio_spec.freq;
+    meter->block_size = meter->freq / METER_BLOCKS_PER_SECOND;
+    meter_k_filters(meter);
+    meter_select_scan(meter);
+
+    for (int ch = 0; ch < METER_MAX_CHANNELS; ch++) {
+        meter->peak_db[ch] = meter->rms_db[ch] = -INFINITY;
+    }
+    for (int band = 0; band < METER_SPECTRUM_BANDS; band++) {
+        meter->spectrum_db[band] = -INFINITY;
+    }
+    meter->momentary_lufs = meter->max_peak_db = meter->max_momentary_lufs = -INFINITY;
+
+    if (meter->spectrum && meter_spectrum_init(m) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Height in pixels of a level between METER_FLOOR_DB and 0 dB.
+static int meter_level_height(float db, int height) {
+    if (!(db > METER_FLOOR_DB)) {
+        return 0;
+    }
+    return (int)(height * (1.0f - FFMIN(db, 0.0f) / METER_FLOOR_DB));
+}
+
+// Draws one bar per channel (RMS filled, peak as a tick, red above METER_CLIP_DB), a white bar for
+// the momentary loudness and the spectrum along the bottom, with one SDL_RenderFillRects per colour.
+int meter_render(MediaPlayerState *m) {
+    AudioMeter *meter = &m->meter;
+    float peak_db[METER_MAX_CHANNELS], rms_db[METER_MAX_CHANNELS], spectrum_db[METER_SPECTRUM_BANDS];
+    SDL_AtomicLock(&meter->lock);
+    SDL_memcpy(peak_db, meter->peak_db, sizeof(peak_db));
+    SDL_memcpy(rms_db, meter->rms_db, sizeof(rms_db));
+    SDL_memcpy(spectrum_db, meter->spectrum_db, sizeof(spectrum_db));
+    float momentary_lufs = meter->momentary_lufs;
+    SDL_AtomicUnlock(&meter->lock);
+
+    int width, height;
+    if (SDL_GetRendererOutputSize(m->display->renderer, &width, &height) != 0) {
+        PRINT_SDL_ERROR();
+        return -1;
+    }
+    SDL_Rect background[2], levels[METER_MAX_CHANNELS + METER_SPECTRUM_BANDS], peaks[METER_MAX_CHANNELS + 1], clipped[METER_MAX_CHANNELS];
+    int nb_levels = 0, nb_peaks = 0, nb_clipped = 0;
+
+    int nb_bars = meter->channels + 1;
+    int x = width - METER_MARGIN - nb_bars * (METER_BAR_WIDTH + METER_BAR_GAP);
+    int bottom = METER_MARGIN + METER_BAR_HEIGHT;
+    background[0] = (SDL_Rect){ x - METER_BAR_GAP, METER_MARGIN - METER_BAR_GAP,
+                                nb_bars * (METER_BAR_WIDTH + METER_BAR_GAP) + METER_BAR_GAP, METER_BAR_HEIGHT + 2 * METER_BAR_GAP };
+    for (int ch = 0; ch < meter->channels; ch++, x += METER_BAR_WIDTH + METER_BAR_GAP) {
+        int h = meter_level_height(rms_db[ch], METER_BAR_HEIGHT);
+        levels[nb_levels++] = (SDL_Rect){ x, bottom - h, METER_BAR_WIDTH, h };
+        h = meter_level_height(peak_db[ch], METER_BAR_HEIGHT);
+        SDL_Rect tick = { x, bottom - h, METER_BAR_WIDTH, 2 };
+        if (peak_db[ch] > METER_CLIP_DB) {
+            clipped[nb_clipped++] = tick;
+        } else if (h > 0) {
+            peaks[nb_peaks++] = tick;
+        }
+    }
+    // LUFS share the dBFS scale, -23 LUFS (the broadcast target) sits at the same height as -23 dBFS.
+    int h = meter_level_height(momentary_lufs, METER_BAR_HEIGHT);
+    peaks[nb_peaks++] = (SDL_Rect){ x, bottom - h, METER_BAR_WIDTH, h };
+
+    int nb_background = 1;
+    if (meter->spectrum) {
+        int band_width = (width / 2) / METER_SPECTRUM_BANDS;
+        int left = METER_MARGIN;
+        int spectrum_bottom = height - METER_MARGIN;
+        background[nb_background++] = (SDL_Rect){ left - METER_BAR_GAP, spectrum_bottom - METER_SPECTRUM_HEIGHT - METER_BAR_GAP,
+                                                   band_width * METER_SPECTRUM_BANDS + 2 * METER_BAR_GAP, METER_SPECTRUM_HEIGHT + 2 * METER_BAR_GAP };
+        for (int band = 0; band < METER_SPECTRUM_BANDS; band++) {
+            int bh = meter_level_height(spectrum_db[band], METER_SPECTRUM_HEIGHT);
+            levels[nb_levels++] = (SDL_Rect){ left + band * band_width, spectrum_bottom - bh, FFMAX(band_width - 1, 1), bh };
+        }
+    }
+
+    SDL_Renderer *renderer = m->display->renderer;
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 160);
+    SDL_RenderFillRects(renderer, background, nb_background);
+    SDL_SetRenderDrawColor(renderer, 40, 200, 80, 255);
+    SDL_RenderFillRects(renderer, levels, nb_levels);
+    SDL_SetRenderDrawColor(renderer, 240, 240, 240, 255);
+    SDL_RenderFillRects(renderer, peaks, nb_peaks);
+    if (nb_clipped > 0) {
+        SDL_SetRenderDrawColor(renderer, 230, 40, 40, 255);
+        SDL_RenderFillRects(renderer, clipped, nb_clipped);
+    }
+    // RenderClear uses the draw colour.
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_NONE);
+    return 0;
+}
@@ -0,0 +1,11 @@
+#include <SDL.h>
+
+#ifndef METER_H
+#define METER_H
+#include "typedefs.h"
+
+int meter_init(MediaPlayerState *m);
+void meter_process(AudioMeter *meter, const int16_t *src, int nb_samples);
+int meter_render(MediaPlayerState *m);
+
+#endif
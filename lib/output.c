@@ -1,20 +1,32 @@
-#include <SDL.h>
-#include <libavcodec/avcodec.h>
+#include <math.h>
 
-#ifndef OUTPUT_H
-#define OUTPUT_H
-#include "typedefs.c"
+#include "output.h"
+#include "stats.h"
+#include "clock.h"
+#include "tempo.h"
+#include "subtitle.h"
+#include "audio.h"
+#include "meter.h"
+#include "timeshift.h"
+#include "playlist.h"
 
-#define PRINT_SDL_ERROR() fprintf(stderr, "[SDL ERROR] %s\n", SDL_GetError())
-#define RENDER_FLAGS (SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC)
-#define WINDOW_HEIGHT 800
-#define WINDOW_WIDTH 640
-#define MAX_AUDIO_FRAME_SIZE 192000
-#define SDL_INIT_FLAGS (SDL_INIT_VIDEO | SDL_INIT_AUDIO)
+// Frames further than this behind the clock are dropped instead of shown, in seconds.
+#define FRAME_DROP_THRESHOLD 0.05
+#define MAX_FRAME_DELAY 1.0
+// The playback clock is moved to the audio clock when they are further apart than this, in seconds.
+#define AUDIO_SYNC_THRESHOLD 0.02
 
-void audio_callback(void *userdata, Uint8 *stream, int len);
+// Scales the picture down to the window width, keeping its aspect ratio.
+void display_fit(DisplayOutput *display, int width, int height) {
+    display->rect.w = width;
+    display->rect.h = height;
+    if (display->rect.w > WINDOW_WIDTH) {
+        display->rect.w = WINDOW_WIDTH;
+        display->rect.h = (height * display->rect.w) / width;
+    }
+}
 
-int setup_sdl(MediaPlayerState *m) {
+static int setup_window(MediaPlayerState *m) {
     SDL_Init(SDL_INIT_FLAGS);
     m->display->window = SDL_CreateWindow("Video streamer", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, WINDOW_WIDTH, WINDOW_HEIGHT, 0);
     if (!m->display->window) {
@@ -24,115 +36,415 @@ int setup_sdl(MediaPlayerState *m) {
     }
 
     m->display->renderer = SDL_CreateRenderer(m->display->window, -1, RENDER_FLAGS);
-    m->display->texture = SDL_CreateTexture(m->display->renderer, SDL_PIXELFORMAT_IYUV, SDL_TEXTUREACCESS_STREAMING, m->video_codec_ctx->width, m->video_codec_ctx->height);
-    const char* error = SDL_GetError();
     if (!m->display->renderer) {
         PRINT_SDL_ERROR();
         SDL_DestroyWindow(m->display->window);
         return -1;
     }
 
-    if (m->audio_stream_id > 0) {
-        SDL_AudioSpec obtained;
-        SDL_AudioSpec desired = { .freq =  m->audio_codec_ctx->sample_rate, .format = AUDIO_S16SYS,
-                                .channels = m->audio_codec_ctx->ch_layout.nb_channels, .callback = audio_callback,
-                                .silence = 0, .samples = m->audio_codec_ctx->frame_size, .userdata = m };
-        m->audio_device_id = SDL_OpenAudioDevice(NULL, 0, &desired, &obtained, SDL_AUDIO_ALLOW_ANY_CHANGE);
+    return 0;
+}
+
+// Does not depend on the video codec, the texture is created from the first decoded frame. When the
+// audio codec is not open yet (fast start) the device is opened with a default spec and the
+// resampler converts to whatever was obtained. Audio only playback gets no window and a device
+// without a callback that is fed with SDL_QueueAudio.
+int setup_sdl(MediaPlayerState *m) {
+    stats_phase_begin(&m->stats, STARTUP_PHASE_WINDOW);
+    if (m->audio_only) {
+        SDL_Init(SDL_INIT_AUDIO | SDL_INIT_EVENTS);
+    } else if (setup_window(m) != 0) {
+        return -1;
+    }
+
+    if (m->audio_codec_ctx != NULL || m->fast_start) {
+        SDL_AudioSpec desired = { .freq = DEFAULT_AUDIO_FREQ, .format = AUDIO_S16SYS,
+                                .channels = DEFAULT_AUDIO_CHANNELS, .callback = audio_callback,
+                                .silence = 0, .userdata = m };
+        if (m->audio_only) {
+            desired.callback = NULL;
+        }
+        if (m->audio_codec_ctx != NULL) {
+            desired.freq = m->audio_codec_ctx->sample_rate;
+            desired.channels = m->audio_codec_ctx->ch_layout.nb_channels;
+        }
+        // Sized for the target latency, audio_output_init works from whatever was obtained.
+        desired.samples = audio_device_samples(m, desired.freq);
+        m->audio_device_id = SDL_OpenAudioDevice(NULL, 0, &desired, &m->audio_spec,
+                                                 SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE | SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
         if (m->audio_device_id == 0) {
             PRINT_SDL_ERROR();
             return -1;
         }
+    }
+    stats_phase_end(&m->stats, STARTUP_PHASE_WINDOW);
+
+    return 0;
+}
+
+// Converts decoded audio of codec_ctx to the S16 format, rate and channel count of the audio device.
+SwrContext* create_resampler(MediaPlayerState *m, AVCodecContext *codec_ctx) {
+    SwrContext *resampler_ctx = NULL;
+    AVChannelLayout out_layout;
+    av_channel_layout_default(&out_layout, m->audio_spec.channels);
+    swr_alloc_set_opts2(&resampler_ctx,
+                        &out_layout,           AV_SAMPLE_FMT_S16,     m->audio_spec.freq,
+                        &codec_ctx->ch_layout, codec_ctx->sample_fmt, codec_ctx->sample_rate,
+                        0, NULL);
+    if (resampler_ctx == NULL) {
+        fprintf(stderr, "Error allocating swr options.\n");
+        return NULL;
+    }
+    if (swr_init(resampler_ctx) < 0) {
+        fprintf(stderr, "Error initializing swr context.\n");
+        swr_free(&resampler_ctx);
+        return NULL;
+    }
+    return resampler_ctx;
+}
+
+// Needs both the audio codec and the output format in audio_spec, which is either what the audio
+// device gave us or set by the caller when headless. Unpauses the device once the resampler is ready.
+int setup_resampler(MediaPlayerState *m) {
+    if (m->audio_spec.freq == 0) {
+        return 0;
+    }
+    if (m->audio_codec_ctx == NULL) {
+        if (m->audio_device_id != 0) {
+            SDL_CloseAudioDevice(m->audio_device_id);
+            m->audio_device_id = 0;
+        }
+        return 0;
+    }
+
+    m->resampler_ctx = create_resampler(m, m->audio_codec_ctx);
+    if (m->resampler_ctx == NULL) {
+        return -1;
+    }
+
+    int bytes_per_sample = m->audio_spec.channels * av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
+    m->audio_buffer = arena_alloc(&m->audio_scratch, MAX_AUDIO_FRAME_SIZE);
+    m->resample_buffer = arena_alloc(&m->audio_scratch, MAX_AUDIO_FRAME_SIZE);
+    if (m->audio_buffer == NULL || m->resample_buffer == NULL) {
+        fprintf(stderr, "Failed to allocate the audio buffer.\n");
+        return -1;
+    }
+    if (tempo_init(&m->tempo, &m->audio_scratch, m->audio_spec.freq, m->audio_spec.channels, MAX_AUDIO_FRAME_SIZE / bytes_per_sample) != 0) {
+        return -1;
+    }
+    if (m->meter.enabled && meter_init(m) != 0) {
+        return -1;
+    }
+
+    if (m->audio_device_id != 0) {
+        if (audio_output_init(m) != 0) {
+            return -1;
+        }
+        if (m->audio_only) {
+            m->audio_tid = SDL_CreateThread(audio_pusher, "audio-pusher", m);
+        } else {
+            m->audio_tid = SDL_CreateThread(audio_feeder, "audio-feeder", m);
+        }
+        if (m->audio_tid == NULL) {
+            PRINT_SDL_ERROR();
+            return -1;
+        }
         SDL_PauseAudioDevice(m->audio_device_id, 0);
     }
+    return 0;
+}
 
+void set_playback_rate(MediaPlayerState *m, int rate) {
+    rate = av_clip(rate, MIN_PLAYBACK_RATE, MAX_PLAYBACK_RATE);
+    SDL_AtomicSet(&m->playback_rate, rate);
+    clock_set_rate(&m->clock, rate / 100.0);
+}
+
+// Main thread only, display_frame is not called while paused. The demuxer keeps filling the queues
+// up to its usual limits, a live input being timeshifted is held on disk instead.
+void set_paused(MediaPlayerState *m, int paused) {
+    if (paused == m->paused) {
+        return;
+    }
+    m->paused = paused;
+    clock_pause(&m->clock, paused);
+    if (m->audio_device_id != 0) {
+        SDL_PauseAudioDevice(m->audio_device_id, paused);
+        // The device buffer starts playing out again now, not at the callback before the pause.
+        SDL_AtomicSet(&m->audio_callback_ms, (int)SDL_GetTicks());
+    }
+    if (paused && m->timeshift.dir != NULL && !m->eof) {
+        timeshift_hold(m);
+    }
+    // The frames that arrived while paused are shown now.
+    for (; !paused && m->pending_refreshes > 0; m->pending_refreshes--) {
+        SDL_Event refresh = { .type = REFRESH_VIDEO_DISPLAY };
+        SDL_PushEvent(&refresh);
+    }
+}
+
+// Seconds until frame is due on the playback clock, negative when it is late. While audio plays
+// the clock follows the audio clock, so frames are shown with the sound actually heard, ring and
+// device latency included. Without audio the first frame starts the clock and is shown right away.
+static double frame_delay(MediaPlayerState *m, AVFrame *frame, int serial) {
+    if (frame->best_effort_timestamp == AV_NOPTS_VALUE) {
+        return 1.0 / 30 / m->clock.rate;
+    }
+    double pts = frame->best_effort_timestamp * av_q2d(m->fmt_ctx->streams[m->video_stream_id]->time_base);
+    if (audio_clock_valid(m, serial)) {
+        // Only past the threshold, small differences are the granularity of the audio clock.
+        double audio = audio_clock_get(m);
+        if (!m->clock.started || fabs(audio - clock_get(&m->clock)) > AUDIO_SYNC_THRESHOLD) {
+            clock_set(&m->clock, audio);
+        }
+    } else if (!m->clock.started) {
+        clock_set(&m->clock, pts);
+        return 0.0;
+    }
+    return (pts - clock_get(&m->clock)) / m->clock.rate;
+}
+
+// The time until SDL_RenderPresent (which waits for vsync) is counted in stats.render_ticks.
+int render_frame(MediaPlayerState *m, AVFrame *frame) {
+    Uint64 begin = SDL_GetPerformanceCounter();
+    if (m->display->texture != NULL && (frame->width != m->display->texture_width || frame->height != m->display->texture_height)) {
+        // A playlist item of another size.
+        SDL_DestroyTexture(m->display->texture);
+        m->display->texture = NULL;
+        display_fit(m->display, frame->width, frame->height);
+        m->subtitle_overlay.dirty = 1;
+    }
+    if (m->display->texture == NULL) {
+        m->display->texture = SDL_CreateTexture(m->display->renderer, SDL_PIXELFORMAT_IYUV, SDL_TEXTUREACCESS_STREAMING, frame->width, frame->height);
+        if (m->display->texture == NULL) {
+            PRINT_SDL_ERROR();
+            return -1;
+        }
+        m->display->texture_width = frame->width;
+        m->display->texture_height = frame->height;
+    }
+    SDL_RenderClear(m->display->renderer);
+    SDL_UpdateYUVTexture(m->display->texture, NULL, frame->data[0], frame->linesize[0],
+                        frame->data[1], frame->linesize[1], frame->data[2],
+                        frame->linesize[2]);
+    SDL_RenderCopy(m->display->renderer, m->display->texture, NULL, &m->display->rect);
+    if (m->subtitle_codec_ctx != NULL) {
+        Uint64 subtitle_begin = SDL_GetPerformanceCounter();
+        if (subtitle_render(m) != 0) {
+            return -1;
+        }
+        m->stats.subtitle_ticks += SDL_GetPerformanceCounter() - subtitle_begin;
+    }
+    if (m->meter.enabled && m->resampler_ctx != NULL && meter_render(m) != 0) {
+        return -1;
+    }
+    m->stats.render_ticks += SDL_GetPerformanceCounter() - begin;
+    m->stats.frames_rendered++;
+    SDL_RenderPresent(m->display->renderer);
     return 0;
 }
 
+static void framebuffer_release(MediaPlayerState *m, FrameBufferItem *item) {
+    av_frame_unref(item->frame);
+    SDL_LockMutex(m->framebuffer_mutex);
+    item->allocated = 0;
+    m->frame_read_index = (m->frame_read_index + 1) % m->framebuffer_size;
+    SDL_CondSignal(m->framebuffer_cond);
+    SDL_UnlockMutex(m->framebuffer_mutex);
+}
+
+// True once every frame has been taken off the framebuffer and the audio has been played out.
+int playback_finished(MediaPlayerState *m) {
+    SDL_LockMutex(m->framebuffer_mutex);
+    int video_done = m->video_tid == NULL || (m->video_finished && !m->framebuffer[m->frame_read_index].allocated);
+    SDL_UnlockMutex(m->framebuffer_mutex);
+    return video_done && (m->audio_tid == NULL || m->audio_finished);
+}
+
+// Shows (or drops, when late) the next frame of the framebuffer. Returns 0 once a frame was taken,
+// 1 when the video decoder is done and no frames are left and -1 on error.
 int display_frame(MediaPlayerState *m) {
-    AVFrame frame;
+    FrameBufferItem *item = &m->framebuffer[m->frame_read_index];
     SDL_LockMutex(m->framebuffer_mutex);
-    while (1) {
-        if (m->framebuffer[m->frame_read_index].allocated == 1) {
-            frame = m->framebuffer[m->frame_read_index].frame;
-            SDL_RenderClear(m->display->renderer);
-            SDL_UpdateYUVTexture(m->display->texture, NULL, frame.data[0], frame.linesize[0],
-                                frame.data[1], frame.linesize[1], frame.data[2],
-                                frame.linesize[2]);
-            const char *error = SDL_GetError();
-            SDL_RenderCopy(m->display->renderer, m->display->texture, NULL, &m->display->rect);
-            SDL_RenderPresent(m->display->renderer);
-            m->framebuffer[m->frame_read_index].allocated = 0;
-            // av_frame_free(m->framebuffer[m->frame_read_index].frame);
-            m->frame_read_index = (m->frame_read_index + 1) % VIDEO_FRAME_BUFFER_SIZE;
-            SDL_CondSignal(m->framebuffer_cond);
-            break;
-        } else {
-            SDL_CondWait(m->framebuffer_cond, m->framebuffer_mutex);
+    while (item->allocated == 0) {
+        if (m->video_finished || m->quit) {
+            SDL_UnlockMutex(m->framebuffer_mutex);
+            return 1;
         }
+        SDL_CondWait(m->framebuffer_cond, m->framebuffer_mutex);
     }
     SDL_UnlockMutex(m->framebuffer_mutex);
 
-    SDL_Delay(1000/30);
+    // video_decoder never writes to an allocated slot, so the frame is used without holding the lock.
+    AVFrame *frame = item->frame;
+    if (item->serial != SDL_AtomicGet(&m->play_serial)) {
+        // Decoded before the last seek.
+        framebuffer_release(m, item);
+        return 0;
+    }
+    if (item->serial != m->clock_serial) {
+        // First frame after a seek, it restarts the clock like the very first frame.
+        m->clock.started = 0;
+        m->clock_serial = item->serial;
+    }
+    double delay = frame_delay(m, frame, item->serial);
+    int dropped = delay < -FRAME_DROP_THRESHOLD;
+    if (frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+        double pts = frame->best_effort_timestamp * av_q2d(m->fmt_ctx->streams[m->video_stream_id]->time_base);
+        if (m->subtitle_codec_ctx != NULL) {
+            subtitle_update(m, pts);
+        }
+        if (!dropped) {
+            m->displayed_pts = pts;
+        }
+        if (!dropped && m->audio_started && !m->audio_finished) {
+            m->stats.av_offset_sum += pts - audio_clock_get(m);
+            m->stats.av_offset_samples++;
+        }
+    }
+    if (m->frame_observer != NULL) {
+        m->frame_observer(m->frame_observer_opaque, frame, dropped);
+    }
+    if (dropped) {
+        m->stats.frames_dropped++;
+    } else {
+        if (delay > 0) {
+            clock_sleep(&m->clock, FFMIN(delay, MAX_FRAME_DELAY));
+        }
+        // Frames still in the framebuffer when the window was hidden are not drawn.
+        if (!m->headless && !SDL_AtomicGet(&m->video_suspend_request) && render_frame(m, frame) != 0) {
+            return -1;
+        }
+        if (m->playlist.nb_items > 1 && frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+            playlist_frame_shown(m, item->playlist_item, frame->best_effort_timestamp * av_q2d(m->fmt_ctx->streams[m->video_stream_id]->time_base));
+        }
+        if (m->stats.frames_displayed == 0) {
+            stats_phase_end(&m->stats, STARTUP_PHASE_FIRST_FRAME);
+            m->stats.block_allocs_at_first_frame = arena_total_block_allocs();
+        }
+        m->stats.frames_displayed++;
+    }
+
+    framebuffer_release(m, item);
+    return 0;
+}
 
-    return 16;
+// Swaps in the decoder prepared by switch_audio_stream once packets of the new track show up.
+// Returns 0 if pkt belongs to the (possibly new) active audio stream.
+int apply_audio_switch(MediaPlayerState *m, AVPacket *pkt) {
+    if (pkt->stream_index == m->active_audio_stream_id) {
+        return 0;
+    }
+    int ret = -1;
+    SDL_LockMutex(m->audio_switch_mutex);
+    if (m->pending_audio_codec_ctx != NULL && pkt->stream_index == m->pending_audio_stream_id) {
+        avcodec_free_context(&m->audio_codec_ctx);
+        swr_free(&m->resampler_ctx);
+        m->audio_codec_ctx = m->pending_audio_codec_ctx;
+        m->resampler_ctx = m->pending_resampler_ctx;
+        m->active_audio_stream_id = m->pending_audio_stream_id;
+        m->pending_audio_codec_ctx = NULL;
+        m->pending_resampler_ctx = NULL;
+        m->pending_audio_stream_id = -1;
+        ret = 0;
+    }
+    SDL_UnlockMutex(m->audio_switch_mutex);
+    return ret;
 }
 
+// Decodes one audio packet into audio_buffer as device format S16. Away from rate 1 the resampled
+// samples go through the WSOLA stage so the speed changes but the pitch does not. Returns the bytes
+// in audio_buffer, -1 on quit and in a headless run once the stream ended. Sets audio_eof once the
+// last samples are in audio_buffer, the next call waits for a seek then.
 int audio_decode_frame(MediaPlayerState *m) {
-  AVPacket pkt;
-  AVFrame *audio_frame = av_frame_alloc();
-  if (pkt_queue_get(&m->audio_pkt_queue, &pkt, m) == 1) {
-    if (avcodec_send_packet(m->audio_codec_ctx, &pkt) != 0) {
-      fprintf(stderr,
-              "[FFMPEG ERROR] Unable to send packet to the decoder. Have you "
-              "already opened the decoder using avcodec_open2?\n.");
-      return -1;
+    AVPacket pkt;
+    if (pkt_queue_get(&m->audio_pkt_queue, &pkt, m) != 0) {
+        return -1;
+    }
+    if (pkt.stream_index == FLUSH_PACKET_STREAM_INDEX) {
+        m->audio_serial = (int)pkt.pos;
+        m->audio_eof = 0;
+        m->audio_finished = 0;
+        avcodec_flush_buffers(m->audio_codec_ctx);
+        tempo_reset(&m->tempo);
+        audio_output_discard(m);
+        return 0;
+    }
+    // At a playlist handover and at the end of the input the decoder is drained. On a handover the
+    // last samples of the item that ended are played before those of the next item.
+    int handover = pkt.stream_index == PLAYLIST_PACKET_STREAM_INDEX;
+    int drain = handover || pkt.stream_index == EOF_PACKET_STREAM_INDEX;
+    // The marker carries the index of the next item in pos, gone once the packet is unreferenced.
+    int index = (int)pkt.pos;
+    if (!drain && apply_audio_switch(m, &pkt) != 0) {
+        // Left over from the track we switched away from.
+        av_packet_unref(&pkt);
+        return 0;
+    }
+    // A packet the decoder rejects only costs its samples, -1 stays for the end of the stream and quit.
+    if (avcodec_send_packet(m->audio_codec_ctx, drain ? NULL : &pkt) != 0 && !drain) {
+        fprintf(stderr, "Failed to send the packet to the audio decoder, skipping it.\n");
+        av_packet_unref(&pkt);
+        return 0;
     }
+    av_packet_unref(&pkt);
 
-    int num_frames = 0;
+    int rate = SDL_AtomicGet(&m->playback_rate);
+    int bytes_per_sample = m->audio_spec.channels * av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
+    uint8_t *resampled = rate == 100 ? m->audio_buffer : m->resample_buffer;
     int data_size = 0;
 
+    AVFrame *audio_frame = m->audio_frame;
+    AVRational time_base = m->fmt_ctx->streams[m->active_audio_stream_id]->time_base;
+    double offset = 0.0;
+    if (m->playlist.audio_item > 0) {
+        time_base = m->playlist.items[m->playlist.audio_item].audio_time_base;
+        offset = m->playlist.items[m->playlist.audio_item].offset;
+    }
     while (avcodec_receive_frame(m->audio_codec_ctx, audio_frame) == 0) {
-      num_frames++;
-      uint8_t *out[] = {m->audio_buffer};
-      int out_samples = swr_convert(m->resampler_ctx, out, audio_frame->nb_samples, (const uint8_t **) audio_frame->data, audio_frame->nb_samples);
-      int bufsize = out_samples * m-> audio_codec_ctx->channels * av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
-      SDL_memcpy4(m->audio_buffer, audio_frame->data[0], bufsize);
-      data_size += bufsize;
+        if (audio_frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+            m->audio_decoded_pts = audio_frame->best_effort_timestamp * av_q2d(time_base) + offset +
+                                   (double)audio_frame->nb_samples / audio_frame->sample_rate;
+        }
+        uint8_t *out[] = {resampled + data_size};
+        int out_capacity = (MAX_AUDIO_FRAME_SIZE - data_size) / bytes_per_sample;
+        int out_samples = swr_convert(m->resampler_ctx, out, out_capacity, (const uint8_t **) audio_frame->data, audio_frame->nb_samples);
+        if (out_samples < 0) {
+            break;
+        }
+        data_size += out_samples * bytes_per_sample;
+    }
+    if (drain) {
+        uint8_t *out[] = {resampled + data_size};
+        int out_samples = swr_convert(m->resampler_ctx, out, (MAX_AUDIO_FRAME_SIZE - data_size) / bytes_per_sample, NULL, 0);
+        if (out_samples > 0) {
+            data_size += out_samples * bytes_per_sample;
+        }
+    }
+    if (handover) {
+        playlist_take_audio(m, index);
+    } else if (drain) {
+        m->audio_eof = 1;
     }
 
     SDL_assert(data_size <= MAX_AUDIO_FRAME_SIZE);
+    // Before the time stretch, levels are those of the media and not of the playback rate.
+    if (m->meter.enabled && data_size > 0) {
+        meter_process(&m->meter, (const int16_t *)resampled, data_size / bytes_per_sample);
+    }
 
-    return data_size;
-
-    printf("Number of audio frames: %d\n", num_frames);
-  }
-
-  av_frame_free(&audio_frame);
-
-  return -1;
-}
-
-void audio_callback(void *userdata, Uint8 *stream, int len) {
-    printf("Audio callback being called.\n");
-    SDL_memset4(stream, 0, len);
-    MediaPlayerState *m = (MediaPlayerState *)userdata;
-
-    if (m->audio_buffer_index >= m->audio_buffer_size) {
-        m->audio_buffer_index = 0;
-        m->audio_buffer_size = audio_decode_frame(m);
-        if (m->audio_buffer_size < 0) {
-            fprintf(stderr, "Error decoding frame");
-            SDL_memset(stream, 0, len);
-            return;
+    if (rate == 100) {
+        if (m->tempo.ref_pos >= 0) {
+            tempo_reset(&m->tempo);
         }
-    }
-    int buffer_to_copy = m->audio_buffer_size - m->audio_buffer_index;
-    if (buffer_to_copy > len) {
-        buffer_to_copy = len;
+        return data_size;
     }
 
-    SDL_memcpy4(stream, m->audio_buffer + m->audio_buffer_index, buffer_to_copy);
-    m->audio_buffer_index += buffer_to_copy;
+    int stretched = tempo_process(&m->tempo, rate / 100.0, (const int16_t *)m->resample_buffer, data_size / bytes_per_sample,
+                                  (int16_t *)m->audio_buffer, MAX_AUDIO_FRAME_SIZE / bytes_per_sample);
+    if (stretched < 0) {
+        fprintf(stderr, "Failed to time stretch the audio, dropping the block.\n");
+        return 0;
+    }
+    return stretched * bytes_per_sample;
 }
-
-#endif
\ No newline at end of file
@@ -0,0 +1,30 @@
+#include <SDL.h>
+#include <libavcodec/avcodec.h>
+
+#ifndef OUTPUT_H
+#define OUTPUT_H
+#include "typedefs.h"
+
+#define PRINT_SDL_ERROR() fprintf(stderr, "[SDL ERROR] %s\n", SDL_GetError())
+#define RENDER_FLAGS (SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC)
+#define WINDOW_HEIGHT 800
+#define WINDOW_WIDTH 640
+#define MAX_AUDIO_FRAME_SIZE 192000
+#define SDL_INIT_FLAGS (SDL_INIT_VIDEO | SDL_INIT_AUDIO)
+// Device format used when the audio device is opened before the audio stream has been probed.
+#define DEFAULT_AUDIO_FREQ 48000
+#define DEFAULT_AUDIO_CHANNELS 2
+
+void display_fit(DisplayOutput *display, int width, int height);
+int setup_sdl(MediaPlayerState *m);
+SwrContext* create_resampler(MediaPlayerState *m, AVCodecContext *codec_ctx);
+int setup_resampler(MediaPlayerState *m);
+void set_playback_rate(MediaPlayerState *m, int rate);
+void set_paused(MediaPlayerState *m, int paused);
+int render_frame(MediaPlayerState *m, AVFrame *frame);
+int playback_finished(MediaPlayerState *m);
+int display_frame(MediaPlayerState *m);
+int apply_audio_switch(MediaPlayerState *m, AVPacket *pkt);
+int audio_decode_frame(MediaPlayerState *m);
+
+#endif
@@ -0,0 +1,370 @@
+#include <math.h>
+#include <stdio.h>
+
+#include "playlist.h"
+#include "clock.h"
+#include "decoder.h"
+#include "output.h"
+
+// Gapless playlist. While one item plays, the preload thread opens the next one, probes it, opens
+// its decoders and decodes its first video frames. When the demuxer reaches the end of an item it
+// switches over to the next one and leaves a handover marker in the video and audio queue: the
+// decoders drain the old codec, so its last frames and samples still come out, and continue with
+// the pre-opened one. Nothing is stopped or reopened, so the audio device never runs dry and the
+// first frame of the next item is ready right away.
+
+#define PLAYLIST_LINE_SIZE 4096
+// Packets read at most while waiting for the first video frame of the next item.
+#define PLAYLIST_PREROLL_MAX_READS 256
+#define PLAYLIST_INITIAL_CAPACITY 16
+
+int playlist_add(MediaPlayerState *m, const char *path) {
+    Playlist *p = &m->playlist;
+    if (p->nb_items == p->capacity) {
+        int capacity = FFMAX(PLAYLIST_INITIAL_CAPACITY, 2 * p->capacity);
+        PlaylistItem *items = arena_alloc(&m->arena, capacity * sizeof(PlaylistItem));
+        if (items == NULL) {
+            fprintf(stderr, "Failed to allocate the playlist.\n");
+            return -1;
+        }
+        if (p->nb_items > 0) {
+            SDL_memcpy(items, p->items, p->nb_items * sizeof(PlaylistItem));
+        }
+        p->items = items;
+        p->capacity = capacity;
+    }
+    p->items[p->nb_items++].path = path;
+    return 0;
+}
+
+// One path per line, empty lines and lines starting with # are skipped.
+int playlist_add_file(MediaPlayerState *m, const char *list_path) {
+    FILE *file = fopen(list_path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open the playlist %s.\n", list_path);
+        return -1;
+    }
+    char line[PLAYLIST_LINE_SIZE];
+    int ret = 0;
+    while (ret == 0 && fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        char *path = arena_alloc(&m->arena, strlen(line) + 1);
+        if (path == NULL) {
+            fprintf(stderr, "Failed to allocate the playlist.\n");
+            ret = -1;
+            break;
+        }
+        strcpy(path, line);
+        ret = playlist_add(m, path);
+    }
+    fclose(file);
+    return ret;
+}
+
+// Reads until the first video frames are decoded, the audio packets read on the way are kept for
+// the demuxer. Without video a few audio packets are read ahead.
+static int playlist_preroll(PlaylistItem *item) {
+    AVPacket pkt;
+    int reads = 0;
+    while (item->nb_preroll < PLAYLIST_PREROLL_PACKETS && reads++ < PLAYLIST_PREROLL_MAX_READS &&
+           (item->video_codec_ctx == NULL || item->nb_frames == 0)) {
+        if (av_read_frame(item->fmt_ctx, &pkt) < 0) {
+            break;
+        }
+        if (pkt.stream_index == item->video_stream_id) {
+            int ret = avcodec_send_packet(item->video_codec_ctx, &pkt);
+            av_packet_unref(&pkt);
+            if (ret < 0) {
+                fprintf(stderr, "Failed to send the packet to the decoder.\n");
+                return -1;
+            }
+            while (item->nb_frames < PLAYLIST_PREROLL_FRAMES) {
+                AVFrame *frame = av_frame_alloc();
+                if (frame == NULL) {
+                    return -1;
+                }
+                if (avcodec_receive_frame(item->video_codec_ctx, frame) != 0) {
+                    av_frame_free(&frame);
+                    break;
+                }
+                item->frames[item->nb_frames++] = frame;
+            }
+        } else if (pkt.stream_index == item->audio_stream_id) {
+            item->preroll[item->nb_preroll++] = pkt;
+        } else {
+            av_packet_unref(&pkt);
+        }
+    }
+    return 0;
+}
+
+// Needs streams of the same types as the first item, they take over its place on the timeline.
+static int playlist_open_item(MediaPlayerState *m, PlaylistItem *item) {
+    Uint64 begin = SDL_GetPerformanceCounter();
+    item->fmt_ctx = avformat_alloc_context();
+    if (item->fmt_ctx == NULL) {
+        fprintf(stderr, "Failed to allocate the input context for %s.\n", item->path);
+        return -1;
+    }
+    item->fmt_ctx->interrupt_callback = (AVIOInterruptCB){ input_interrupt, m };
+    if (avformat_open_input(&item->fmt_ctx, item->path, NULL, NULL) != 0 ||
+        avformat_find_stream_info(item->fmt_ctx, NULL) < 0) {
+        fprintf(stderr, "Failed to open %s, skipping it.\n", item->path);
+        return -1;
+    }
+    AVFormatContext *fmt_ctx = item->fmt_ctx;
+    item->video_stream_id = -1;
+    item->audio_stream_id = -1;
+    if (m->video_stream_id >= 0) {
+        item->video_stream_id = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    }
+    if (m->audio_stream_id >= 0) {
+        item->audio_stream_id = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, item->video_stream_id, NULL, 0);
+    }
+    if ((m->video_stream_id >= 0 && item->video_stream_id < 0) || (m->audio_stream_id >= 0 && item->audio_stream_id < 0)) {
+        fprintf(stderr, "%s does not have the streams of the first item, skipping it.\n", item->path);
+        return -1;
+    }
+    for (int i = 0; i < fmt_ctx->nb_streams; i++) {
+        int played = i == item->video_stream_id || i == item->audio_stream_id;
+        fmt_ctx->streams[i]->discard = played ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+    }
+
+    if (item->video_stream_id >= 0) {
+        AVStream *stream = fmt_ctx->streams[item->video_stream_id];
+        item->video_time_base = stream->time_base;
+        item->video_codec_ctx = open_stream_codec(stream, m->decoder_threads);
+        if (item->video_codec_ctx == NULL) {
+            return -1;
+        }
+    }
+    if (item->audio_stream_id >= 0) {
+        AVStream *stream = fmt_ctx->streams[item->audio_stream_id];
+        item->audio_time_base = stream->time_base;
+        item->audio_codec_ctx = open_stream_codec(stream, m->decoder_threads);
+        if (item->audio_codec_ctx == NULL) {
+            return -1;
+        }
+        item->resampler_ctx = create_resampler(m, item->audio_codec_ctx);
+        if (item->resampler_ctx == NULL) {
+            return -1;
+        }
+    }
+    item->start = fmt_ctx->start_time != AV_NOPTS_VALUE ? fmt_ctx->start_time / (double)AV_TIME_BASE : 0.0;
+    if (playlist_preroll(item) != 0) {
+        return -1;
+    }
+    item->open_ticks = SDL_GetPerformanceCounter() - begin;
+    return 0;
+}
+
+// Opens item i once the demuxer is on item i - 1.
+static int playlist_preload(void *arg) {
+    MediaPlayerState *m = (MediaPlayerState *)arg;
+    Playlist *p = &m->playlist;
+    for (int i = 1; i < p->nb_items; i++) {
+        SDL_LockMutex(p->mutex);
+        while (p->demux_item < i - 1 && !m->quit) {
+            SDL_CondWait(p->cond, p->mutex);
+        }
+        SDL_UnlockMutex(p->mutex);
+        if (m->quit) {
+            break;
+        }
+
+        PlaylistItem *item = &p->items[i];
+        int ret = playlist_open_item(m, item);
+        if (ret != 0) {
+            playlist_item_free(item);
+        }
+        SDL_LockMutex(p->mutex);
+        item->status = ret == 0 ? 1 : -1;
+        SDL_CondBroadcast(p->cond);
+        SDL_UnlockMutex(p->mutex);
+    }
+    return 0;
+}
+
+// Needs the first item opened and the audio output set up, the next items get resamplers for the
+// device format. Has to run before decoder_thread.
+int playlist_start(MediaPlayerState *m) {
+    Playlist *p = &m->playlist;
+    p->items[0].status = 1;
+    p->preload_tid = SDL_CreateThread(playlist_preload, "playlist-preload", m);
+    if (p->preload_tid == NULL) {
+        PRINT_SDL_ERROR();
+        return -1;
+    }
+    return 0;
+}
+
+AVFormatContext* playlist_input(MediaPlayerState *m) {
+    Playlist *p = &m->playlist;
+    return p->demux_item > 0 ? p->items[p->demux_item].fmt_ctx : m->fmt_ctx;
+}
+
+// Id in the demuxed item of the stream that has stream_id on the timeline.
+int playlist_input_stream(MediaPlayerState *m, int stream_id) {
+    Playlist *p = &m->playlist;
+    if (p->demux_item == 0) {
+        return stream_id;
+    }
+    PlaylistItem *item = &p->items[p->demux_item];
+    if (stream_id == m->video_stream_id) {
+        return item->video_stream_id;
+    }
+    return stream_id == m->audio_stream_id ? item->audio_stream_id : -1;
+}
+
+// Timeline seconds minus this are seconds of the demuxed item.
+double playlist_offset(MediaPlayerState *m) {
+    Playlist *p = &m->playlist;
+    return p->demux_item > 0 ? p->items[p->demux_item].offset : 0.0;
+}
+
+static void playlist_track_end(Playlist *p, AVPacket *pkt, AVRational time_base, double offset) {
+    int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+    if (ts != AV_NOPTS_VALUE) {
+        p->end = FFMAX(p->end, (ts + pkt->duration) * av_q2d(time_base) + offset);
+    }
+}
+
+// Demuxer thread. Reads the next packet of the demuxed item with the stream ids of the first item,
+// returns what av_read_frame returns.
+int playlist_read_packet(MediaPlayerState *m, AVPacket *pkt) {
+    Playlist *p = &m->playlist;
+    if (p->demux_item == 0) {
+        int ret = av_read_frame(m->fmt_ctx, pkt);
+        if (ret >= 0 && (pkt->stream_index == m->video_stream_id || pkt->stream_index == m->audio_stream_id)) {
+            playlist_track_end(p, pkt, m->fmt_ctx->streams[pkt->stream_index]->time_base, 0.0);
+        }
+        return ret;
+    }
+
+    PlaylistItem *item = &p->items[p->demux_item];
+    while (1) {
+        if (item->preroll_index < item->nb_preroll) {
+            *pkt = item->preroll[item->preroll_index++];
+        } else {
+            int ret = av_read_frame(item->fmt_ctx, pkt);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        if (pkt->stream_index == item->video_stream_id) {
+            playlist_track_end(p, pkt, item->video_time_base, item->offset);
+            pkt->stream_index = m->video_stream_id;
+            return 0;
+        } else if (pkt->stream_index == item->audio_stream_id) {
+            playlist_track_end(p, pkt, item->audio_time_base, item->offset);
+            pkt->stream_index = m->audio_stream_id;
+            return 0;
+        }
+        av_packet_unref(pkt);
+    }
+}
+
+// Demuxer thread, at the end of the demuxed item. Waits for the next item that could be opened and
+// queues the handover to it. Returns -1 when there is none left.
+int playlist_next(MediaPlayerState *m) {
+    Playlist *p = &m->playlist;
+    SDL_LockMutex(p->mutex);
+    int index = p->demux_item + 1;
+    while (index < p->nb_items && !m->quit) {
+        while (p->items[index].status == 0 && !m->quit) {
+            SDL_CondWait(p->cond, p->mutex);
+        }
+        if (p->items[index].status == 1) {
+            break;
+        }
+        // Lets the preload thread go on with the item after the skipped one.
+        p->demux_item = index++;
+        SDL_CondBroadcast(p->cond);
+    }
+    if (index >= p->nb_items || m->quit) {
+        SDL_UnlockMutex(p->mutex);
+        return -1;
+    }
+    if (p->demux_item > 0) {
+        avformat_close_input(&p->items[p->demux_item].fmt_ctx);
+    }
+    PlaylistItem *item = &p->items[index];
+    // Starts where the demuxed part of the timeline ends.
+    item->offset = p->end - item->start;
+    p->demux_item = index;
+    SDL_CondBroadcast(p->cond);
+    SDL_UnlockMutex(p->mutex);
+
+    printf("Playing %s, opened in %.1f ms.\n", item->path,
+           (double)item->open_ticks / (double)SDL_GetPerformanceFrequency() * 1000.0);
+    AVPacket marker = { .stream_index = PLAYLIST_PACKET_STREAM_INDEX, .pos = index };
+    if (m->video_stream_id >= 0 && pkt_queue_put(&m->video_pkt_queue, &marker) != 0) {
+        return -1;
+    }
+    if (m->audio_stream_id >= 0 && pkt_queue_put(&m->audio_pkt_queue, &marker) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Video decoder thread. Frames of the item are brought into the time base of the first item.
+void playlist_frame_to_timeline(MediaPlayerState *m, int index, AVFrame *frame) {
+    PlaylistItem *item = &m->playlist.items[index];
+    double item_tb = av_q2d(item->video_time_base);
+    double timeline_tb = av_q2d(m->fmt_ctx->streams[m->video_stream_id]->time_base);
+    if (frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+        frame->best_effort_timestamp = llrint((frame->best_effort_timestamp * item_tb + item->offset) / timeline_tb);
+    }
+    if (frame->pts != AV_NOPTS_VALUE) {
+        frame->pts = llrint((frame->pts * item_tb + item->offset) / timeline_tb);
+    }
+}
+
+// Video decoder thread, once the old decoder is drained.
+void playlist_take_video(MediaPlayerState *m, int index) {
+    PlaylistItem *item = &m->playlist.items[index];
+    avcodec_free_context(&m->video_codec_ctx);
+    m->video_codec_ctx = item->video_codec_ctx;
+    item->video_codec_ctx = NULL;
+    m->playlist.video_item = index;
+}
+
+// Audio decoder thread, once the old decoder and resampler are drained.
+void playlist_take_audio(MediaPlayerState *m, int index) {
+    PlaylistItem *item = &m->playlist.items[index];
+    avcodec_free_context(&m->audio_codec_ctx);
+    swr_free(&m->resampler_ctx);
+    m->audio_codec_ctx = item->audio_codec_ctx;
+    m->resampler_ctx = item->resampler_ctx;
+    item->audio_codec_ctx = NULL;
+    item->resampler_ctx = NULL;
+    m->playlist.audio_item = index;
+    m->playlist.handover_underrun_bytes = m->stats.audio_underrun_bytes;
+}
+
+// Main thread, after a frame of item index was shown. The gap of a transition is how much later
+// than its timestamp asks for the first shown frame of the next item came, the audio silence is
+// what the device had to fill in since the audio handover.
+void playlist_frame_shown(MediaPlayerState *m, int index, double pts) {
+    Playlist *p = &m->playlist;
+    double now = clock_now(&m->clock);
+    if (index != p->shown_item && p->last_frame_time > 0) {
+        double gap = FFMAX((now - p->last_frame_time) - (pts - p->last_frame_pts) / m->clock.rate, 0.0);
+        double silence = 0.0;
+        if (m->audio_device_id != 0) {
+            int bytes_per_second = m->audio_spec.freq * m->audio_spec.channels * av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
+            silence = (double)(m->stats.audio_underrun_bytes - p->handover_underrun_bytes) / bytes_per_second;
+        }
+        p->transitions++;
+        p->gap_sum += gap;
+        p->gap_max = FFMAX(p->gap_max, gap);
+        p->silence_sum += silence;
+        printf("Transition to item %d: %.1f ms video gap, %.1f ms audio silence.\n", index + 1, gap * 1000.0, silence * 1000.0);
+    }
+    p->shown_item = index;
+    p->last_frame_time = now;
+    p->last_frame_pts = pts;
+}
@@ -0,0 +1,20 @@
+#include <SDL.h>
+
+#ifndef PLAYLIST_H
+#define PLAYLIST_H
+#include "typedefs.h"
+
+int playlist_add(MediaPlayerState *m, const char *path);
+int playlist_add_file(MediaPlayerState *m, const char *list_path);
+int playlist_start(MediaPlayerState *m);
+int playlist_read_packet(MediaPlayerState *m, AVPacket *pkt);
+int playlist_next(MediaPlayerState *m);
+AVFormatContext* playlist_input(MediaPlayerState *m);
+int playlist_input_stream(MediaPlayerState *m, int stream_id);
+double playlist_offset(MediaPlayerState *m);
+void playlist_frame_to_timeline(MediaPlayerState *m, int index, AVFrame *frame);
+void playlist_take_video(MediaPlayerState *m, int index);
+void playlist_take_audio(MediaPlayerState *m, int index);
+void playlist_frame_shown(MediaPlayerState *m, int index, double pts);
+
+#endif
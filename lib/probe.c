@@ -0,0 +1,338 @@
+#include <math.h>
+#include <libavutil/pixdesc.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "probe.h"
+#include "clock.h"
+#include "output.h"
+#include "decoder.h"
+
+// Headless analysis of the video for ingest QA. Every frame that video_decoder produces is reduced
+// to a thumbnail of 16x16 block means of its Y plane, sampling every other row, and from that:
+// average luma, the share of black blocks, the mean absolute difference to the previous frame and
+// a scene change score computed like libavfilter's scdet. The analysis runs on the main thread
+// while the demuxer and decoder threads keep going, so it costs one core next to decoding.
+//
+// The timeline goes to a CSV file, one line per frame:
+//
+//     frame,pts,time,luma,black,diff,scene,flags
+//
+// or, when the path ends in .bin, to a binary file: "WPRB", a uint32 version and record size, then
+// one ProbeRecord per frame in host byte order. Black and freeze intervals are printed at the end.
+
+#define PROBE_BLOCK_SIZE 16
+#define PROBE_ROW_STEP 2
+// Block mean (8 bit levels) up to which a block counts as black, and the share of black blocks
+// that makes a black frame.
+#define PROBE_BLACK_LUMA 32
+#define PROBE_BLACK_RATIO 0.98
+// Mean absolute difference to the previous frame, in 8 bit levels, below which nothing moved.
+#define PROBE_FREEZE_DIFF 0.5
+#define PROBE_FREEZE_MIN_DURATION 2.0
+#define PROBE_BLACK_MIN_DURATION 0.1
+// Scene change score in percent from which a frame starts a new scene.
+#define PROBE_SCENE_THRESHOLD 10.0
+
+#define PROBE_FLAG_BLACK 1
+#define PROBE_FLAG_FROZEN 2
+#define PROBE_FLAG_SCENE 4
+#define PROBE_VERSION 1
+
+typedef struct ProbeRecord {
+    int64_t pts;
+    float time, luma, black, diff, scene;
+    uint32_t flags;
+} ProbeRecord;
+
+typedef struct Probe {
+    MediaPlayerState *m;
+    FILE *out;
+    int binary;
+    AVRational time_base;
+    // Block means of the current and previous frame, thumb_width * thumb_height bytes each.
+    uint8_t *thumb, *prev_thumb;
+    uint32_t *block_sums;
+    int width, height, thumb_width, thumb_height;
+    int have_prev;
+    double prev_diff, prev_time;
+    // Start of the current black/freeze run in seconds, NAN when not in one.
+    double black_start, freeze_start;
+    int nb_frames, nb_skipped, nb_scenes, nb_black, nb_freezes;
+    int failed;
+} Probe;
+
+#ifdef __SSE2__
+static uint64_t probe_sum_epi64(__m128i v) {
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, v);
+    return lanes[0] + lanes[1];
+}
+#endif
+
+// Adds the sampled bytes of one row to the sums of its blocks.
+static void probe_row_sums(const uint8_t *row, int nb_blocks, uint32_t *sums) {
+    int bx = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; bx < nb_blocks; bx++) {
+        __m128i sad = _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(row + bx * PROBE_BLOCK_SIZE)), zero);
+        sums[bx] += _mm_cvtsi128_si32(sad) + _mm_extract_epi16(sad, 4);
+    }
+#endif
+    for (; bx < nb_blocks; bx++) {
+        uint32_t sum = 0;
+        for (int x = 0; x < PROBE_BLOCK_SIZE; x++) {
+            sum += row[bx * PROBE_BLOCK_SIZE + x];
+        }
+        sums[bx] += sum;
+    }
+}
+
+// Same for more than 8 bits per sample, scaled down to 8 bit levels.
+static void probe_row_sums16(const uint16_t *row, int nb_blocks, int shift, uint32_t *sums) {
+    for (int bx = 0; bx < nb_blocks; bx++) {
+        uint32_t sum = 0;
+        for (int x = 0; x < PROBE_BLOCK_SIZE; x++) {
+            sum += row[bx * PROBE_BLOCK_SIZE + x];
+        }
+        sums[bx] += sum >> shift;
+    }
+}
+
+static void probe_thumbnail(Probe *p, const AVFrame *frame, int depth) {
+    int samples = PROBE_BLOCK_SIZE * PROBE_BLOCK_SIZE / PROBE_ROW_STEP;
+    for (int by = 0; by < p->thumb_height; by++) {
+        SDL_memset(p->block_sums, 0, p->thumb_width * sizeof(uint32_t));
+        for (int y = 0; y < PROBE_BLOCK_SIZE; y += PROBE_ROW_STEP) {
+            const uint8_t *row = frame->data[0] + (ptrdiff_t)(by * PROBE_BLOCK_SIZE + y) * frame->linesize[0];
+            if (depth == 8) {
+                probe_row_sums(row, p->thumb_width, p->block_sums);
+            } else {
+                probe_row_sums16((const uint16_t *)row, p->thumb_width, depth - 8, p->block_sums);
+            }
+        }
+        uint8_t *thumb = p->thumb + by * p->thumb_width;
+        for (int bx = 0; bx < p->thumb_width; bx++) {
+            thumb[bx] = (p->block_sums[bx] + samples / 2) / samples;
+        }
+    }
+}
+
+// Sum of the block means and the number of black blocks.
+static void probe_thumbnail_stats(const uint8_t *thumb, int size, uint64_t *sum, int *nb_black) {
+    uint64_t total = 0;
+    int black = 0;
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i limit = _mm_set1_epi8(PROBE_BLACK_LUMA - 1);
+    __m128i acc = zero;
+    for (; i + 16 <= size; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(thumb + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(x, zero));
+        // x - limit saturates to 0 exactly for x < PROBE_BLACK_LUMA.
+        black += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(x, limit), zero)));
+    }
+    total = probe_sum_epi64(acc);
+#endif
+    for (; i < size; i++) {
+        total += thumb[i];
+        black += thumb[i] < PROBE_BLACK_LUMA;
+    }
+    *sum = total;
+    *nb_black = black;
+}
+
+static uint64_t probe_sad(const uint8_t *a, const uint8_t *b, int size) {
+    uint64_t total = 0;
+    int i = 0;
+#ifdef __SSE2__
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 16 <= size; i += 16) {
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + i)),
+                                              _mm_loadu_si128((const __m128i *)(b + i))));
+    }
+    total = probe_sum_epi64(acc);
+#endif
+    for (; i < size; i++) {
+        total += FFABS(a[i] - b[i]);
+    }
+    return total;
+}
+
+// (Re)allocates the thumbnails for the size of frame, the difference restarts after a change.
+static int probe_resize(Probe *p, const AVFrame *frame) {
+    if (p->thumb != NULL && frame->width == p->width && frame->height == p->height) {
+        return 0;
+    }
+    av_freep(&p->thumb);
+    av_freep(&p->prev_thumb);
+    av_freep(&p->block_sums);
+    p->width = frame->width;
+    p->height = frame->height;
+    p->thumb_width = frame->width / PROBE_BLOCK_SIZE;
+    p->thumb_height = frame->height / PROBE_BLOCK_SIZE;
+    p->have_prev = 0;
+    int size = p->thumb_width * p->thumb_height;
+    if (size == 0) {
+        fprintf(stderr, "Frames of %dx%d are too small to probe.\n", frame->width, frame->height);
+        return -1;
+    }
+    p->thumb = av_malloc(size);
+    p->prev_thumb = av_malloc(size);
+    p->block_sums = av_malloc(p->thumb_width * sizeof(uint32_t));
+    if (p->thumb == NULL || p->prev_thumb == NULL || p->block_sums == NULL) {
+        fprintf(stderr, "Failed to allocate the probe thumbnails.\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void probe_interval(const char *what, double start, double end, double min_duration, int *count) {
+    if (end - start < min_duration) {
+        return;
+    }
+    printf("%s: %.3f - %.3f (%.3f s)\n", what, start, end, end - start);
+    (*count)++;
+}
+
+static void probe_write(Probe *p, const ProbeRecord *r) {
+    if (p->binary) {
+        fwrite(r, sizeof(ProbeRecord), 1, p->out);
+    } else {
+        fprintf(p->out, "%d,%lld,%.3f,%.2f,%.3f,%.3f,%.2f,%u\n", p->nb_frames, (long long)r->pts, r->time,
+                r->luma, r->black, r->diff, r->scene, r->flags);
+    }
+}
+
+static void probe_frame(void *opaque, AVFrame *frame, int dropped) {
+    Probe *p = (Probe *)opaque;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    // Planar YUV and NV12 style formats only, the Y plane has to be plane 0 without interleaving.
+    if (p->failed || desc == NULL || (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL)) ||
+        desc->comp[0].plane != 0 || desc->comp[0].step != (desc->comp[0].depth > 8 ? 2 : 1)) {
+        p->nb_skipped++;
+        return;
+    }
+    if (probe_resize(p, frame) != 0) {
+        p->failed = 1;
+        return;
+    }
+    probe_thumbnail(p, frame, desc->comp[0].depth);
+
+    int size = p->thumb_width * p->thumb_height;
+    uint64_t sum;
+    int nb_black;
+    probe_thumbnail_stats(p->thumb, size, &sum, &nb_black);
+
+    ProbeRecord r = { .pts = frame->best_effort_timestamp };
+    r.time = r.pts != AV_NOPTS_VALUE ? r.pts * av_q2d(p->time_base) : p->prev_time;
+    r.luma = (double)sum / size;
+    r.black = (double)nb_black / size;
+    if (p->have_prev) {
+        double diff = (double)probe_sad(p->thumb, p->prev_thumb, size) / size;
+        r.diff = diff;
+        r.scene = av_clipd(FFMIN(diff, fabs(diff - p->prev_diff)) * 100.0 / 255.0, 0.0, 100.0);
+        p->prev_diff = diff;
+    }
+
+    if (r.black >= PROBE_BLACK_RATIO) {
+        r.flags |= PROBE_FLAG_BLACK;
+        if (isnan(p->black_start)) {
+            p->black_start = r.time;
+        }
+    } else if (!isnan(p->black_start)) {
+        probe_interval("black", p->black_start, r.time, PROBE_BLACK_MIN_DURATION, &p->nb_black);
+        p->black_start = NAN;
+    }
+    if (p->have_prev && r.diff < PROBE_FREEZE_DIFF) {
+        r.flags |= PROBE_FLAG_FROZEN;
+        if (isnan(p->freeze_start)) {
+            p->freeze_start = p->prev_time;
+        }
+    } else if (!isnan(p->freeze_start)) {
+        probe_interval("freeze", p->freeze_start, r.time, PROBE_FREEZE_MIN_DURATION, &p->nb_freezes);
+        p->freeze_start = NAN;
+    }
+    if (r.scene >= PROBE_SCENE_THRESHOLD) {
+        r.flags |= PROBE_FLAG_SCENE;
+        p->nb_scenes++;
+    }
+
+    probe_write(p, &r);
+    p->nb_frames++;
+    p->prev_time = r.time;
+    p->have_prev = 1;
+    uint8_t *tmp = p->prev_thumb;
+    p->prev_thumb = p->thumb;
+    p->thumb = tmp;
+}
+
+// Decodes the video of m headless as fast as it goes and writes the per frame metrics to
+// output_path. Audio and subtitles are not opened.
+int run_probe(MediaPlayerState *m, const char *output_path) {
+    Probe p = { .m = m, .black_start = NAN, .freeze_start = NAN };
+    m->headless = 1;
+    m->clock.virtual_time = 1;
+    m->no_audio = 1;
+    m->no_subtitles = 1;
+
+    if (open_codec(m->filepath, m) != 0) {
+        return -1;
+    }
+    if (m->video_codec_ctx == NULL) {
+        fprintf(stderr, "No video stream to probe.\n");
+        return -1;
+    }
+    AVStream *stream = m->fmt_ctx->streams[m->video_stream_id];
+    p.time_base = stream->time_base;
+
+    size_t len = strlen(output_path);
+    p.binary = len > 4 && strcmp(output_path + len - 4, ".bin") == 0;
+    if ((p.out = fopen(output_path, p.binary ? "wb" : "w")) == NULL) {
+        fprintf(stderr, "Unable to open %s for writing.\n", output_path);
+        return -1;
+    }
+    if (p.binary) {
+        uint32_t header[2] = { PROBE_VERSION, sizeof(ProbeRecord) };
+        fwrite("WPRB", 4, 1, p.out);
+        fwrite(header, sizeof(header), 1, p.out);
+    } else {
+        fprintf(p.out, "frame,pts,time,luma,black,diff,scene,flags\n");
+    }
+    m->frame_observer = probe_frame;
+    m->frame_observer_opaque = &p;
+
+    Uint64 started = SDL_GetPerformanceCounter();
+    m->decoder_tid = SDL_CreateThread(decoder_thread, "decoder-thread", m);
+    m->video_tid = SDL_CreateThread(video_decoder, "video-decoder", m);
+    while (display_frame(m) == 0 && !p.failed) {
+    }
+    double elapsed = (double)(SDL_GetPerformanceCounter() - started) / (double)SDL_GetPerformanceFrequency();
+
+    if (!isnan(p.black_start)) {
+        probe_interval("black", p.black_start, p.prev_time, PROBE_BLACK_MIN_DURATION, &p.nb_black);
+    }
+    if (!isnan(p.freeze_start)) {
+        probe_interval("freeze", p.freeze_start, p.prev_time, PROBE_FREEZE_MIN_DURATION, &p.nb_freezes);
+    }
+    double fps = elapsed > 0 ? p.nb_frames / elapsed : 0.0;
+    double stream_fps = av_q2d(stream->avg_frame_rate);
+    printf("probe: %d frames (%d skipped), %d scene changes, %d black, %d frozen intervals\n",
+           p.nb_frames, p.nb_skipped, p.nb_scenes, p.nb_black, p.nb_freezes);
+    printf("probe: %.3f s, %.1f fps", elapsed, fps);
+    if (stream_fps > 0) {
+        printf(" (%.2fx real time)", fps / stream_fps);
+    }
+    printf("\n");
+
+    m->frame_observer = NULL;
+    int failed = p.failed || ferror(p.out);
+    fclose(p.out);
+    av_freep(&p.thumb);
+    av_freep(&p.prev_thumb);
+    av_freep(&p.block_sums);
+    return failed ? -1 : 0;
+}
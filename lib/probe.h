@@ -0,0 +1,7 @@
+#ifndef PROBE_H
+#define PROBE_H
+#include "typedefs.h"
+
+int run_probe(MediaPlayerState *m, const char *output_path);
+
+#endif
@@ -0,0 +1,179 @@
+#include <libavutil/md5.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+
+#include "replay.h"
+#include "clock.h"
+#include "output.h"
+#include "decoder.h"
+
+// Headless and deterministic run of the decode pipeline. The playback clock runs on virtual time,
+// every video frame taken off the framebuffer and every audio block produced for the output is
+// hashed and written as one line:
+//
+//     video <n> <pts> <md5> [dropped]
+//     audio <n> <samples> <md5>
+//
+// With a golden file each line is compared against it instead, so changes to the pipeline can be
+// checked for bit-exactness across decoder thread counts and framebuffer sizes.
+
+#define REPLAY_LINE_SIZE 128
+#define REPLAY_MAX_REPORTED_MISMATCHES 10
+
+typedef struct Replay {
+    MediaPlayerState *m;
+    struct AVMD5 *md5;
+    FILE *out, *golden;
+    // Virtual time each shown frame takes, lets drop behaviour be exercised deterministically.
+    double frame_cost;
+    int nb_video, nb_audio;
+    int nb_lines, nb_mismatches;
+} Replay;
+
+static void replay_line(Replay *r, const char *line) {
+    r->nb_lines++;
+    if (r->out != NULL) {
+        fprintf(r->out, "%s\n", line);
+    }
+    if (r->golden == NULL) {
+        return;
+    }
+    char expected[REPLAY_LINE_SIZE];
+    if (fgets(expected, sizeof(expected), r->golden) == NULL) {
+        expected[0] = '\0';
+    }
+    expected[strcspn(expected, "\n")] = '\0';
+    if (strcmp(expected, line) != 0) {
+        if (r->nb_mismatches < REPLAY_MAX_REPORTED_MISMATCHES) {
+            fprintf(stderr, "line %d: expected \"%s\", got \"%s\"\n", r->nb_lines, expected, line);
+        }
+        r->nb_mismatches++;
+    }
+}
+
+static void replay_md5_hex(Replay *r, char *hex) {
+    uint8_t digest[16];
+    av_md5_final(r->md5, digest);
+    for (int i = 0; i < 16; i++) {
+        snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+    }
+}
+
+// Only the visible part of each plane is hashed, the linesize padding differs between runs.
+static void replay_video_frame(void *opaque, AVFrame *frame, int dropped) {
+    Replay *r = (Replay *)opaque;
+    int chroma_w = 0, chroma_h = 0;
+    av_pix_fmt_get_chroma_sub_sample(frame->format, &chroma_w, &chroma_h);
+
+    av_md5_init(r->md5);
+    int nb_planes = av_pix_fmt_count_planes(frame->format);
+    for (int plane = 0; plane < nb_planes; plane++) {
+        int width = av_image_get_linesize(frame->format, frame->width, plane);
+        int height = (plane == 1 || plane == 2) ? AV_CEIL_RSHIFT(frame->height, chroma_h) : frame->height;
+        for (int y = 0; y < height; y++) {
+            av_md5_update(r->md5, frame->data[plane] + y * frame->linesize[plane], width);
+        }
+    }
+
+    char hex[33], line[REPLAY_LINE_SIZE];
+    replay_md5_hex(r, hex);
+    snprintf(line, sizeof(line), "video %d %lld %s%s", r->nb_video++,
+             (long long)frame->best_effort_timestamp, hex, dropped ? " dropped" : "");
+    replay_line(r, line);
+
+    if (!dropped && r->frame_cost > 0) {
+        clock_sleep(&r->m->clock, r->frame_cost);
+    }
+}
+
+static void replay_audio_block(Replay *r, const uint8_t *data, int size, int bytes_per_sample) {
+    av_md5_init(r->md5);
+    av_md5_update(r->md5, data, size);
+
+    char hex[33], line[REPLAY_LINE_SIZE];
+    replay_md5_hex(r, hex);
+    snprintf(line, sizeof(line), "audio %d %d %s", r->nb_audio++, size / bytes_per_sample, hex);
+    replay_line(r, line);
+}
+
+// Opens the input of m headless and plays it through. Writes the hashes to output_path and/or
+// compares them against golden_path. Returns 0 when everything matched.
+int run_replay(MediaPlayerState *m, const char *output_path, const char *golden_path, double frame_cost) {
+    Replay r = { .m = m, .frame_cost = frame_cost };
+    m->headless = 1;
+    m->clock.virtual_time = 1;
+    // The overlay is only drawn by render_frame, it has no effect on what is hashed.
+    m->no_subtitles = 1;
+
+    if (open_codec(m->filepath, m) != 0) {
+        return -1;
+    }
+    // Fixed output format so the audio hashes do not depend on the machine's audio device.
+    m->audio_spec.freq = DEFAULT_AUDIO_FREQ;
+    m->audio_spec.channels = DEFAULT_AUDIO_CHANNELS;
+    m->audio_spec.format = AUDIO_S16SYS;
+    if (setup_resampler(m) != 0) {
+        return -1;
+    }
+
+    r.md5 = av_md5_alloc();
+    if (r.md5 == NULL) {
+        fprintf(stderr, "Failed to allocate the md5 context.\n");
+        return -1;
+    }
+    if (output_path != NULL && (r.out = fopen(output_path, "w")) == NULL) {
+        fprintf(stderr, "Unable to open %s for writing.\n", output_path);
+        av_free(r.md5);
+        return -1;
+    }
+    if (golden_path != NULL && (r.golden = fopen(golden_path, "r")) == NULL) {
+        fprintf(stderr, "Unable to open %s.\n", golden_path);
+        if (r.out != NULL) {
+            fclose(r.out);
+        }
+        av_free(r.md5);
+        return -1;
+    }
+    m->frame_observer = replay_video_frame;
+    m->frame_observer_opaque = &r;
+
+    // Nothing waits on wall time here, so the elapsed time is the decode throughput of the build.
+    Uint64 started = SDL_GetPerformanceCounter();
+    m->decoder_tid = SDL_CreateThread(decoder_thread, "decoder-thread", m);
+    if (m->video_codec_ctx != NULL) {
+        m->video_tid = SDL_CreateThread(video_decoder, "video-decoder", m);
+        // The audio queue is unbounded, so pulling all video first does not change either sequence.
+        while (display_frame(m) == 0) {
+        }
+    }
+    if (m->resampler_ctx != NULL) {
+        int bytes_per_sample = m->audio_spec.channels * av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
+        int size;
+        while ((size = audio_decode_frame(m)) >= 0) {
+            if (size > 0) {
+                replay_audio_block(&r, m->audio_buffer, size, bytes_per_sample);
+            }
+        }
+    }
+
+    double elapsed = (double)(SDL_GetPerformanceCounter() - started) / (double)SDL_GetPerformanceFrequency();
+
+    char extra[REPLAY_LINE_SIZE];
+    if (r.golden != NULL && fgets(extra, sizeof(extra), r.golden) != NULL) {
+        fprintf(stderr, "golden file has more lines than the %d produced.\n", r.nb_lines);
+        r.nb_mismatches++;
+    }
+    printf("replay: %d video frames (%llu dropped), %d audio blocks, %d mismatches\n",
+           r.nb_video, (unsigned long long)m->stats.frames_dropped, r.nb_audio, r.nb_mismatches);
+    printf("replay: %.3f s, %.1f fps\n", elapsed, elapsed > 0 ? r.nb_video / elapsed : 0.0);
+
+    m->frame_observer = NULL;
+    if (r.out != NULL) {
+        fclose(r.out);
+    }
+    if (r.golden != NULL) {
+        fclose(r.golden);
+    }
+    av_free(r.md5);
+    return r.nb_mismatches == 0 ? 0 : 1;
+}
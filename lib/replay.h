@@ -0,0 +1,7 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+#include "typedefs.h"
+
+int run_replay(MediaPlayerState *m, const char *output_path, const char *golden_path, double frame_cost);
+
+#endif
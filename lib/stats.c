@@ -0,0 +1,188 @@
+#include <sys/resource.h>
+
+#include "stats.h"
+
+static const char *startup_phase_names[STARTUP_PHASE_COUNT] = {
+    "open", "probe", "codec open", "window", "first frame"
+};
+
+void stats_startup_begin(PlayerStats *s) {
+    SDL_memset(s->phase_begin, 0, sizeof(s->phase_begin));
+    SDL_memset(s->phase_end, 0, sizeof(s->phase_end));
+    s->startup_origin = SDL_GetPerformanceCounter();
+}
+
+void stats_phase_begin(PlayerStats *s, StartupPhase phase) {
+    s->phase_begin[phase] = SDL_GetPerformanceCounter();
+}
+
+void stats_phase_end(PlayerStats *s, StartupPhase phase) {
+    if (s->phase_end[phase] == 0) {
+        s->phase_end[phase] = SDL_GetPerformanceCounter();
+    }
+}
+
+static double stats_ticks_to_ms(Uint64 ticks) {
+    return (double)ticks * 1000.0 / (double)SDL_GetPerformanceFrequency();
+}
+
+// Phases may overlap (window creation runs alongside probing in fast-start mode), so every
+// phase is reported with its start offset from startup_origin as well as its own duration.
+void print_startup_report(PlayerStats *s) {
+    printf("%-12s %10s %10s\n", "phase", "start(ms)", "took(ms)");
+    for (int i = 0; i < STARTUP_PHASE_COUNT; i++) {
+        if (s->phase_begin[i] == 0 || s->phase_end[i] == 0) {
+            printf("%-12s %10s %10s\n", startup_phase_names[i], "-", "-");
+            continue;
+        }
+        printf("%-12s %10.2f %10.2f\n", startup_phase_names[i],
+               stats_ticks_to_ms(s->phase_begin[i] - s->startup_origin),
+               stats_ticks_to_ms(s->phase_end[i] - s->phase_begin[i]));
+    }
+    if (s->phase_end[STARTUP_PHASE_FIRST_FRAME] != 0) {
+        printf("time to first frame: %.2f ms\n",
+               stats_ticks_to_ms(s->phase_end[STARTUP_PHASE_FIRST_FRAME] - s->startup_origin));
+    }
+}
+
+static void print_arena_usage(const char *name, Arena *a) {
+    printf("%-14s %8zu KiB used, %8zu KiB peak, %8zu KiB reserved in %d blocks\n", name,
+           a->used / 1024, a->peak / 1024, a->capacity / 1024, a->nb_blocks);
+}
+
+// Arena block allocations after the first frame are the steady-state allocations of the buffers the
+// playback threads own. Buffers allocated inside FFmpeg (demuxed packets, decoder frame pools,
+// filter graph frames) are not counted, nor are the GOP cache frames and the probe buffers.
+void print_alloc_report(MediaPlayerState *m) {
+    print_arena_usage("session arena", &m->arena);
+    print_arena_usage("audio scratch", &m->audio_scratch);
+    print_arena_usage("demux scratch", &m->demux_scratch);
+    print_arena_usage("render scratch", &m->render_scratch);
+    int total = arena_total_block_allocs();
+    printf("arena block allocations: %d total, %d after the first frame\n",
+           total, m->stats.frames_displayed > 0 ? total - m->stats.block_allocs_at_first_frame : 0);
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        long max_rss_kib = usage.ru_maxrss / 1024;
+#else
+        long max_rss_kib = usage.ru_maxrss;
+#endif
+        printf("peak RSS: %ld KiB\n", max_rss_kib);
+    }
+}
+
+// Average cost of drawing a frame, without the wait for vsync, and how much of it the subtitle
+// overlay adds.
+void print_render_report(PlayerStats *s) {
+    if (s->frames_rendered == 0) {
+        printf("No frames rendered.\n");
+        return;
+    }
+    double frames = (double)s->frames_rendered;
+    printf("%llu frames rendered, %.3f ms/frame, subtitles %.3f ms/frame\n", (unsigned long long)s->frames_rendered,
+           stats_ticks_to_ms(s->render_ticks) / frames, stats_ticks_to_ms(s->subtitle_ticks) / frames);
+}
+
+// Output latency is the device buffer plus what was queued in the audio ring at each callback,
+// an underrun is a callback the ring could not fill while audio was playing. Push mode has no
+// callback, it reports how often the pusher woke up and how much each SDL_QueueAudio call carried.
+static void print_audio_push_report(MediaPlayerState *m, int bytes_per_second) {
+    PlayerStats *s = &m->stats;
+    Uint64 end = s->audio_push_end != 0 ? s->audio_push_end : SDL_GetPerformanceCounter();
+    double seconds = (double)(end - s->audio_push_begin) / (double)SDL_GetPerformanceFrequency();
+    printf("audio device: %d Hz, %d channels, push mode\n", m->audio_spec.freq, m->audio_spec.channels);
+    printf("pushes: %llu, %.1f ms of audio each\n", (unsigned long long)s->audio_pushes,
+           (double)s->audio_pushed_bytes / s->audio_pushes / bytes_per_second * 1000.0);
+    printf("pusher wakeups: %llu (%.2f/s over %.1f s)\n", (unsigned long long)s->audio_pusher_wakeups,
+           seconds > 0 ? s->audio_pusher_wakeups / seconds : 0.0, seconds);
+}
+
+void print_audio_report(MediaPlayerState *m) {
+    PlayerStats *s = &m->stats;
+    int bytes_per_second = m->audio_spec.freq * m->audio_spec.channels * av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
+    if (m->audio_only && m->audio_device_id != 0 && s->audio_pushes > 0) {
+        print_audio_push_report(m, bytes_per_second);
+        return;
+    }
+    if (m->audio_device_id == 0 || s->audio_callbacks == 0) {
+        printf("No audio played.\n");
+        return;
+    }
+    double device_ms = m->audio_device_delay * 1000.0;
+    double queued_ms = (double)s->audio_queued_bytes / s->audio_callbacks / bytes_per_second * 1000.0;
+    printf("audio device: %d Hz, %d channels, %d samples (%.1f ms)\n",
+           m->audio_spec.freq, m->audio_spec.channels, m->audio_spec.samples, device_ms);
+    printf("output latency: %.1f ms (%.1f ms queued + device), target %.1f ms\n",
+           queued_ms + device_ms, queued_ms, (double)m->audio_ring_target / bytes_per_second * 1000.0 + device_ms);
+    printf("underruns: %llu of %llu callbacks (%.2f%%)\n", (unsigned long long)s->audio_underruns,
+           (unsigned long long)s->audio_callbacks, 100.0 * s->audio_underruns / s->audio_callbacks);
+    if (s->av_offset_samples > 0) {
+        printf("video ahead of audio: %.1f ms on average\n", s->av_offset_sum / s->av_offset_samples * 1000.0);
+    }
+}
+
+// Levels of the last metered block, the session maxima and what metering cost on the decode thread.
+void print_meter_report(MediaPlayerState *m) {
+    AudioMeter *meter = &m->meter;
+    if (meter->samples == 0) {
+        printf("No audio metered.\n");
+        return;
+    }
+    SDL_AtomicLock(&meter->lock);
+    for (int ch = 0; ch < meter->channels; ch++) {
+        printf("channel %d: peak %.1f dBFS, rms %.1f dBFS\n", ch, meter->peak_db[ch], meter->rms_db[ch]);
+    }
+    printf("momentary loudness: %.1f LUFS (max %.1f LUFS), max peak %.1f dBFS\n",
+           meter->momentary_lufs, meter->max_momentary_lufs, meter->max_peak_db);
+    SDL_AtomicUnlock(&meter->lock);
+
+    double seconds = (double)meter->ticks / (double)SDL_GetPerformanceFrequency();
+    double audio_seconds = (double)meter->samples / meter->freq;
+    printf("metering: %.3f ms per second of audio (%.3f%% of one core), %s scan%s\n",
+           seconds / audio_seconds * 1000.0, seconds / audio_seconds * 100.0,
+           meter->lanes == 16 ? "avx2" : meter->lanes == 8 ? "sse2" : "scalar",
+           meter->spectrum ? ", spectrum" : "");
+}
+
+void print_timeshift_report(MediaPlayerState *m) {
+    Timeshift *ts = &m->timeshift;
+    SDL_LockMutex(ts->lock);
+    int nb_segments = ts->next_segment - ts->first_segment;
+    double covered = 0.0;
+    if (nb_segments > 0) {
+        covered = ts->segments[(ts->next_segment - 1) % TIMESHIFT_MAX_SEGMENTS].end -
+                  ts->segments[ts->first_segment % TIMESHIFT_MAX_SEGMENTS].start;
+    }
+    SDL_UnlockMutex(ts->lock);
+    printf("timeshift: %d segments on disk covering %.1fs of a %.0fs window, %llu packets written, %llu dropped\n",
+           nb_segments, covered, ts->window, (unsigned long long)ts->packets_written,
+           (unsigned long long)ts->packets_dropped);
+}
+
+// Transition gaps measured by playlist_frame_shown.
+void print_playlist_report(MediaPlayerState *m) {
+    Playlist *p = &m->playlist;
+    if (p->transitions == 0) {
+        printf("No playlist transition shown.\n");
+        return;
+    }
+    printf("playlist: %d transitions, video gap %.1f ms on average (max %.1f ms), audio silence %.1f ms on average\n",
+           p->transitions, p->gap_sum / p->transitions * 1000.0, p->gap_max * 1000.0,
+           p->silence_sum / p->transitions * 1000.0);
+}
+
+void print_gop_cache_report(MediaPlayerState *m) {
+    GopCache *c = &m->gop_cache;
+    if (c->gops_decoded == 0) {
+        printf("No GOP decoded for stepping.\n");
+        return;
+    }
+    double seconds = c->decode_ticks / (double)SDL_GetPerformanceFrequency();
+    double fps = seconds > 0 ? c->frames_decoded / seconds : 0.0;
+    printf("gop cache: %llu GOPs, %llu frames decoded at %.1f fps (%.1fx real time), %llu evicted, %.1f MB held\n",
+           (unsigned long long)c->gops_decoded, (unsigned long long)c->frames_decoded, fps,
+           fps * c->frame_duration, (unsigned long long)c->evictions, c->bytes / (1024.0 * 1024.0));
+    printf("reverse stalls: %llu\n", (unsigned long long)c->stalls);
+}
@@ -0,0 +1,19 @@
+#include <SDL.h>
+
+#ifndef STATS_H
+#define STATS_H
+#include "typedefs.h"
+
+void stats_startup_begin(PlayerStats *s);
+void stats_phase_begin(PlayerStats *s, StartupPhase phase);
+void stats_phase_end(PlayerStats *s, StartupPhase phase);
+void print_startup_report(PlayerStats *s);
+void print_alloc_report(MediaPlayerState *m);
+void print_render_report(PlayerStats *s);
+void print_audio_report(MediaPlayerState *m);
+void print_meter_report(MediaPlayerState *m);
+void print_timeshift_report(MediaPlayerState *m);
+void print_playlist_report(MediaPlayerState *m);
+void print_gop_cache_report(MediaPlayerState *m);
+
+#endif
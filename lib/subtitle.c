@@ -0,0 +1,388 @@
+#include <math.h>
+
+#include "subtitle.h"
+#include "font.h"
+#include "output.h"
+
+// Subtitle decoding and the overlay drawn over the video. Subtitle packets get their own queue and
+// decoder thread, display_frame picks the subtitles whose time span covers the frame and
+// render_frame draws them on top of it.
+
+// Glyph cells in the atlas are one pixel larger on every side for the black outline.
+#define SUBTITLE_CELL_WIDTH (FONT_GLYPH_WIDTH + 2)
+#define SUBTITLE_CELL_HEIGHT (FONT_GLYPH_HEIGHT + 2)
+#define SUBTITLE_GLYPHS_PER_ROW 64
+#define SUBTITLE_GLYPH_ROWS ((FONT_NB_GLYPHS + SUBTITLE_GLYPHS_PER_ROW - 1) / SUBTITLE_GLYPHS_PER_ROW)
+#define SUBTITLE_ATLAS_SIZE 1024
+#define SUBTITLE_MAX_QUADS 2048
+#define SUBTITLE_TEXT_SIZE 1024
+// Text lines are sized so about this many fit on the picture.
+#define SUBTITLE_LINES_PER_SCREEN 20
+
+// Moves item into the queue, waiting while it is full. Returns -1 on quit.
+static int subtitle_queue_put(SubtitleQueue *q, SubtitleItem *item, MediaPlayerState *m) {
+    SDL_LockMutex(q->mutex);
+    while (q->nb_items == SUBTITLE_QUEUE_SIZE) {
+        if (m->quit) {
+            SDL_UnlockMutex(q->mutex);
+            return -1;
+        }
+        SDL_CondWait(q->cond, q->mutex);
+    }
+    q->items[(q->read_index + q->nb_items) % SUBTITLE_QUEUE_SIZE] = *item;
+    q->nb_items++;
+    SDL_UnlockMutex(q->mutex);
+    return 0;
+}
+
+static SubtitleItem* subtitle_queue_peek(SubtitleQueue *q, int i) {
+    return &q->items[(q->read_index + i) % SUBTITLE_QUEUE_SIZE];
+}
+
+// After a seek nothing queued belongs to the new position. The overlay belongs to the main thread,
+// it finds out through q->cleared.
+static void subtitle_queue_clear(SubtitleQueue *q) {
+    SDL_LockMutex(q->mutex);
+    while (q->nb_items > 0) {
+        avsubtitle_free(&subtitle_queue_peek(q, 0)->sub);
+        q->read_index = (q->read_index + 1) % SUBTITLE_QUEUE_SIZE;
+        q->nb_items--;
+    }
+    q->cleared = 1;
+    SDL_CondSignal(q->cond);
+    SDL_UnlockMutex(q->mutex);
+}
+
+// Main thread, with the queue locked. The shown mask refers to queue slots, after a clear they hold
+// other subtitles.
+static void subtitle_take_clear(SubtitleQueue *q, SubtitleOverlay *overlay) {
+    if (q->cleared) {
+        q->cleared = 0;
+        overlay->shown_mask = 0;
+        overlay->dirty = 1;
+    }
+}
+
+int subtitle_decoder(void *arg) {
+    MediaPlayerState *m = (MediaPlayerState *)arg;
+    AVRational time_base = m->fmt_ctx->streams[m->subtitle_stream_id]->time_base;
+    AVPacket pkt;
+
+    while (pkt_queue_get(&m->subtitle_pkt_queue, &pkt, m) == 0) {
+        if (pkt.stream_index == EOF_PACKET_STREAM_INDEX) {
+            // Subtitle decoders hold nothing back, there is nothing to drain. A seek may follow.
+            continue;
+        }
+        if (pkt.stream_index == FLUSH_PACKET_STREAM_INDEX) {
+            avcodec_flush_buffers(m->subtitle_codec_ctx);
+            subtitle_queue_clear(&m->subtitle_queue);
+            continue;
+        }
+        SubtitleItem item;
+        int got_subtitle = 0;
+        if (avcodec_decode_subtitle2(m->subtitle_codec_ctx, &item.sub, &got_subtitle, &pkt) < 0) {
+            fprintf(stderr, "Failed to decode a subtitle.\n");
+        } else if (got_subtitle) {
+            double pts = item.sub.pts != AV_NOPTS_VALUE ? item.sub.pts / (double)AV_TIME_BASE : pkt.pts * av_q2d(time_base);
+            item.start = pts + item.sub.start_display_time / 1000.0;
+            if (item.sub.end_display_time > item.sub.start_display_time && item.sub.end_display_time != UINT32_MAX) {
+                item.end = pts + item.sub.end_display_time / 1000.0;
+            } else if (pkt.duration > 0) {
+                item.end = item.start + pkt.duration * av_q2d(time_base);
+            } else {
+                item.end = INFINITY;
+            }
+            if (subtitle_queue_put(&m->subtitle_queue, &item, m) != 0) {
+                avsubtitle_free(&item.sub);
+                av_packet_unref(&pkt);
+                break;
+            }
+        }
+        av_packet_unref(&pkt);
+    }
+    return 0;
+}
+
+// Works out which subtitles cover pts, frees the ones that are over and marks the overlay for a
+// rebuild when what is shown changes. Subtitles without an end are replaced by the next one.
+void subtitle_update(MediaPlayerState *m, double pts) {
+    SubtitleQueue *q = &m->subtitle_queue;
+    SubtitleOverlay *overlay = &m->subtitle_overlay;
+    SDL_LockMutex(q->mutex);
+    subtitle_take_clear(q, overlay);
+
+    int mask = 0, expired = 0;
+    for (int i = 0; i < q->nb_items; i++) {
+        SubtitleItem *item = subtitle_queue_peek(q, i);
+        if (item->start > pts) {
+            break;
+        }
+        int replaced = 0;
+        if (isinf(item->end)) {
+            for (int j = i + 1; j < q->nb_items && !replaced; j++) {
+                replaced = subtitle_queue_peek(q, j)->start <= pts;
+            }
+        }
+        if (item->end <= pts || replaced) {
+            expired |= 1 << i;
+        } else {
+            mask |= 1 << i;
+        }
+    }
+
+    int popped = 0;
+    while (q->nb_items > 0 && (expired & 1)) {
+        avsubtitle_free(&subtitle_queue_peek(q, 0)->sub);
+        q->read_index = (q->read_index + 1) % SUBTITLE_QUEUE_SIZE;
+        q->nb_items--;
+        expired >>= 1;
+        popped++;
+    }
+    if (popped > 0) {
+        SDL_CondSignal(q->cond);
+    }
+    // Changed when a shown subtitle was freed or the shown set of those still queued differs.
+    int shown_popped = overlay->shown_mask & ((1 << popped) - 1);
+    mask >>= popped;
+    if (shown_popped != 0 || mask != overlay->shown_mask >> popped) {
+        overlay->dirty = 1;
+    }
+    overlay->shown_mask = mask;
+    SDL_UnlockMutex(q->mutex);
+}
+
+static int subtitle_font_bit(int glyph, int x, int y) {
+    if (x < 0 || y < 0 || x >= FONT_GLYPH_WIDTH || y >= FONT_GLYPH_HEIGHT) {
+        return 0;
+    }
+    return (font_glyphs[glyph][y] >> (FONT_GLYPH_WIDTH - 1 - x)) & 1;
+}
+
+// Creates the atlas and draws the outlined glyphs into its top rows.
+static int subtitle_atlas_init(MediaPlayerState *m) {
+    SubtitleOverlay *overlay = &m->subtitle_overlay;
+    DisplayOutput *display = m->display;
+    display->subtitle_atlas = SDL_CreateTexture(display->renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC,
+                                                SUBTITLE_ATLAS_SIZE, SUBTITLE_ATLAS_SIZE);
+    if (display->subtitle_atlas == NULL) {
+        PRINT_SDL_ERROR();
+        return -1;
+    }
+    overlay->vertices = arena_alloc(&m->arena, SUBTITLE_MAX_QUADS * 4 * sizeof(SDL_Vertex));
+    overlay->indices = arena_alloc(&m->arena, SUBTITLE_MAX_QUADS * 6 * sizeof(int));
+    // A bitmap never gets bigger than the atlas, so the staging buffer is never grown while playing.
+    overlay->pixels = arena_alloc(&m->render_scratch, SUBTITLE_ATLAS_SIZE * SUBTITLE_ATLAS_SIZE * sizeof(uint32_t));
+    if (overlay->vertices == NULL || overlay->indices == NULL || overlay->pixels == NULL) {
+        fprintf(stderr, "Failed to allocate the subtitle overlay.\n");
+        return -1;
+    }
+    SDL_SetTextureBlendMode(display->subtitle_atlas, SDL_BLENDMODE_BLEND);
+    // Quads always use the same corner order.
+    for (int i = 0; i < SUBTITLE_MAX_QUADS; i++) {
+        int *index = overlay->indices + i * 6;
+        index[0] = i * 4; index[1] = i * 4 + 1; index[2] = i * 4 + 2;
+        index[3] = i * 4 + 2; index[4] = i * 4 + 3; index[5] = i * 4;
+    }
+
+    int width = SUBTITLE_GLYPHS_PER_ROW * SUBTITLE_CELL_WIDTH;
+    int height = SUBTITLE_GLYPH_ROWS * SUBTITLE_CELL_HEIGHT;
+    for (int glyph = 0; glyph < FONT_NB_GLYPHS; glyph++) {
+        int cell_x = (glyph % SUBTITLE_GLYPHS_PER_ROW) * SUBTITLE_CELL_WIDTH;
+        int cell_y = (glyph / SUBTITLE_GLYPHS_PER_ROW) * SUBTITLE_CELL_HEIGHT;
+        for (int y = 0; y < SUBTITLE_CELL_HEIGHT; y++) {
+            for (int x = 0; x < SUBTITLE_CELL_WIDTH; x++) {
+                uint32_t color = 0;
+                if (subtitle_font_bit(glyph, x - 1, y - 1)) {
+                    color = 0xffffffff;
+                } else {
+                    for (int n = 0; n < 9 && color == 0; n++) {
+                        if (subtitle_font_bit(glyph, x - 2 + n % 3, y - 2 + n / 3)) {
+                            color = 0xff000000;
+                        }
+                    }
+                }
+                overlay->pixels[(cell_y + y) * width + cell_x + x] = color;
+            }
+        }
+    }
+    SDL_Rect glyphs = { 0, 0, width, height };
+    SDL_UpdateTexture(display->subtitle_atlas, &glyphs, overlay->pixels, width * sizeof(uint32_t));
+    return 0;
+}
+
+static void subtitle_add_quad(SubtitleOverlay *overlay, const SDL_Rect *src, float x, float y, float w, float h) {
+    if (overlay->nb_quads == SUBTITLE_MAX_QUADS) {
+        return;
+    }
+    SDL_Vertex *v = overlay->vertices + overlay->nb_quads * 4;
+    float u0 = (float)src->x / SUBTITLE_ATLAS_SIZE, v0 = (float)src->y / SUBTITLE_ATLAS_SIZE;
+    float u1 = (float)(src->x + src->w) / SUBTITLE_ATLAS_SIZE, v1 = (float)(src->y + src->h) / SUBTITLE_ATLAS_SIZE;
+    SDL_Color white = { 255, 255, 255, 255 };
+    v[0] = (SDL_Vertex){ { x, y }, white, { u0, v0 } };
+    v[1] = (SDL_Vertex){ { x + w, y }, white, { u1, v0 } };
+    v[2] = (SDL_Vertex){ { x + w, y + h }, white, { u1, v1 } };
+    v[3] = (SDL_Vertex){ { x, y + h }, white, { u0, v1 } };
+    overlay->nb_quads++;
+}
+
+// Copies a palettized bitmap rect into the next free spot of the atlas and adds its quad.
+static void subtitle_add_bitmap(MediaPlayerState *m, AVSubtitleRect *rect, int sub_width, int sub_height) {
+    SubtitleOverlay *overlay = &m->subtitle_overlay;
+    SDL_Rect *video = &m->display->rect;
+    if (rect->w <= 0 || rect->h <= 0 || rect->w > SUBTITLE_ATLAS_SIZE) {
+        return;
+    }
+    if (overlay->shelf_x + rect->w > SUBTITLE_ATLAS_SIZE) {
+        overlay->shelf_x = 0;
+        overlay->shelf_y += overlay->shelf_height;
+        overlay->shelf_height = 0;
+    }
+    if (overlay->shelf_y + rect->h > SUBTITLE_ATLAS_SIZE) {
+        return;
+    }
+    const uint32_t *palette = (const uint32_t *)rect->data[1];
+    for (int y = 0; y < rect->h; y++) {
+        const uint8_t *src = rect->data[0] + y * rect->linesize[0];
+        for (int x = 0; x < rect->w; x++) {
+            overlay->pixels[y * rect->w + x] = palette[src[x]];
+        }
+    }
+    SDL_Rect atlas_rect = { overlay->shelf_x, overlay->shelf_y, rect->w, rect->h };
+    SDL_UpdateTexture(m->display->subtitle_atlas, &atlas_rect, overlay->pixels, rect->w * sizeof(uint32_t));
+    overlay->shelf_x += rect->w;
+    overlay->shelf_height = FFMAX(overlay->shelf_height, rect->h);
+
+    float scale_x = (float)video->w / sub_width, scale_y = (float)video->h / sub_height;
+    subtitle_add_quad(overlay, &atlas_rect, video->x + rect->x * scale_x, video->y + rect->y * scale_y,
+                      rect->w * scale_x, rect->h * scale_y);
+}
+
+// Plain text of a rect. Decoded ASS lines are "ReadOrder,Layer,Style,Name,MarginL,MarginR,MarginV,
+// Effect,Text", override blocks in braces are dropped and \N becomes a line break.
+static void subtitle_rect_text(AVSubtitleRect *rect, char *text, int size) {
+    const char *src = rect->text;
+    if (rect->type == SUBTITLE_ASS && rect->ass != NULL) {
+        src = rect->ass;
+        for (int fields = 0; fields < 8 && src != NULL; fields++) {
+            src = strchr(src, ',');
+            src = src != NULL ? src + 1 : NULL;
+        }
+    }
+    int len = 0, in_override = 0;
+    for (; src != NULL && *src != '\0' && len < size - 1; src++) {
+        if (*src == '{') {
+            in_override = 1;
+        } else if (*src == '}') {
+            in_override = 0;
+        } else if (in_override || *src == '\r') {
+            continue;
+        } else if (*src == '\\' && (src[1] == 'N' || src[1] == 'n')) {
+            text[len++] = '\n';
+            src++;
+        } else {
+            text[len++] = *src;
+        }
+    }
+    while (len > 0 && text[len - 1] == '\n') {
+        len--;
+    }
+    text[len] = '\0';
+}
+
+// Lays text out centered above the bottom margin, from the last line up. Bytes outside of the
+// font (UTF-8 sequences) show as a single '?'.
+static void subtitle_add_text(MediaPlayerState *m, const char *text, int *bottom) {
+    SubtitleOverlay *overlay = &m->subtitle_overlay;
+    SDL_Rect *video = &m->display->rect;
+    int scale = FFMAX(1, video->h / (SUBTITLE_LINES_PER_SCREEN * SUBTITLE_CELL_HEIGHT));
+    int line_height = FONT_GLYPH_HEIGHT * scale;
+
+    const char *end = text + strlen(text);
+    while (end > text) {
+        const char *begin = end;
+        while (begin > text && begin[-1] != '\n') {
+            begin--;
+        }
+        int nb_chars = 0;
+        for (const char *c = begin; c < end; c++) {
+            nb_chars += ((uint8_t)*c & 0xc0) != 0x80;
+        }
+        *bottom -= line_height;
+        float x = video->x + (video->w - nb_chars * FONT_GLYPH_WIDTH * scale) / 2.0f;
+        for (const char *c = begin; c < end; c++) {
+            int ch = (uint8_t)*c;
+            if ((ch & 0xc0) == 0x80) {
+                continue;
+            }
+            if (ch < FONT_FIRST_CHAR || ch >= FONT_FIRST_CHAR + FONT_NB_GLYPHS) {
+                ch = '?';
+            }
+            int glyph = ch - FONT_FIRST_CHAR;
+            if (ch != ' ') {
+                SDL_Rect cell = { (glyph % SUBTITLE_GLYPHS_PER_ROW) * SUBTITLE_CELL_WIDTH,
+                                  (glyph / SUBTITLE_GLYPHS_PER_ROW) * SUBTITLE_CELL_HEIGHT,
+                                  SUBTITLE_CELL_WIDTH, SUBTITLE_CELL_HEIGHT };
+                subtitle_add_quad(overlay, &cell, x - scale, *bottom - scale,
+                                  SUBTITLE_CELL_WIDTH * scale, SUBTITLE_CELL_HEIGHT * scale);
+            }
+            x += FONT_GLYPH_WIDTH * scale;
+        }
+        end = begin > text ? begin - 1 : text;
+    }
+}
+
+static void subtitle_rebuild(MediaPlayerState *m) {
+    SubtitleQueue *q = &m->subtitle_queue;
+    SubtitleOverlay *overlay = &m->subtitle_overlay;
+    // Bitmaps are placed in the coordinate space of the subtitle stream, which usually is the video.
+    int sub_width = m->subtitle_codec_ctx->width > 0 ? m->subtitle_codec_ctx->width : m->video_codec_ctx->width;
+    int sub_height = m->subtitle_codec_ctx->height > 0 ? m->subtitle_codec_ctx->height : m->video_codec_ctx->height;
+    int bottom = m->display->rect.y + m->display->rect.h - m->display->rect.h / SUBTITLE_LINES_PER_SCREEN;
+    char text[SUBTITLE_TEXT_SIZE];
+
+    overlay->nb_quads = 0;
+    overlay->shelf_x = 0;
+    overlay->shelf_y = SUBTITLE_GLYPH_ROWS * SUBTITLE_CELL_HEIGHT;
+    overlay->shelf_height = 0;
+
+    SDL_LockMutex(q->mutex);
+    subtitle_take_clear(q, overlay);
+    // Later subtitles go above earlier ones.
+    for (int i = 0; i < q->nb_items; i++) {
+        if (!(overlay->shown_mask & (1 << i))) {
+            continue;
+        }
+        AVSubtitle *sub = &subtitle_queue_peek(q, i)->sub;
+        for (unsigned int r = 0; r < sub->num_rects; r++) {
+            AVSubtitleRect *rect = sub->rects[r];
+            if (rect->type == SUBTITLE_BITMAP) {
+                subtitle_add_bitmap(m, rect, sub_width, sub_height);
+            } else {
+                subtitle_rect_text(rect, text, sizeof(text));
+                subtitle_add_text(m, text, &bottom);
+            }
+        }
+    }
+    SDL_UnlockMutex(q->mutex);
+    overlay->dirty = 0;
+}
+
+// Draws the shown subtitles over the current frame, called by render_frame before presenting.
+int subtitle_render(MediaPlayerState *m) {
+    SubtitleOverlay *overlay = &m->subtitle_overlay;
+    if (m->display->subtitle_atlas == NULL && subtitle_atlas_init(m) != 0) {
+        return -1;
+    }
+    if (overlay->dirty) {
+        subtitle_rebuild(m);
+    }
+    if (overlay->nb_quads == 0) {
+        return 0;
+    }
+    if (SDL_RenderGeometry(m->display->renderer, m->display->subtitle_atlas, overlay->vertices, overlay->nb_quads * 4,
+                           overlay->indices, overlay->nb_quads * 6) != 0) {
+        PRINT_SDL_ERROR();
+        return -1;
+    }
+    return 0;
+}
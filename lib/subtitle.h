@@ -0,0 +1,11 @@
+#include <SDL.h>
+
+#ifndef SUBTITLE_H
+#define SUBTITLE_H
+#include "typedefs.h"
+
+int subtitle_decoder(void *arg);
+void subtitle_update(MediaPlayerState *m, double pts);
+int subtitle_render(MediaPlayerState *m);
+
+#endif
@@ -0,0 +1,129 @@
+#include <math.h>
+
+#include "tempo.h"
+
+// WSOLA (waveform similarity overlap-add) time stretching of interleaved S16 audio, the same idea
+// as ffmpeg's atempo filter. The output is built from Hann windowed frames placed every `hop`
+// samples. The input position advances by hop * rate per frame and is nudged by up to `search`
+// samples so that every frame lines up with the natural continuation of the previous one,
+// which keeps the pitch unchanged.
+
+#define TEMPO_WINDOW_MS 20
+
+// All buffers come from arena. max_input is the most samples a single tempo_process call is given.
+int tempo_init(TimeStretch *ts, Arena *arena, int sample_rate, int channels, int max_input) {
+    SDL_memset(ts, 0, sizeof(TimeStretch));
+    ts->channels = channels;
+    ts->hop = sample_rate * TEMPO_WINDOW_MS / 1000 / 2;
+    ts->window = ts->hop * 2;
+    ts->search = ts->hop / 2;
+    // Room for a full call on top of what is held back between calls.
+    ts->in_cap = max_input + ts->window + ts->search + ts->hop * MAX_PLAYBACK_RATE / 100;
+
+    ts->win = arena_alloc(arena, ts->window * sizeof(float));
+    ts->overlap = arena_alloc(arena, ts->hop * channels * sizeof(float));
+    ts->in = arena_alloc(arena, (size_t)ts->in_cap * channels * sizeof(int16_t));
+    if (ts->win == NULL || ts->overlap == NULL || ts->in == NULL) {
+        fprintf(stderr, "Failed to allocate the time stretch buffers.\n");
+        return -1;
+    }
+    // Periodic Hann, w[i] + w[i + hop] == 1 so frames overlapping by half sum to unity gain.
+    for (int i = 0; i < ts->window; i++) {
+        ts->win[i] = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * i / ts->window);
+    }
+    ts->in_pos = ts->search;
+    ts->ref_pos = -1;
+    return 0;
+}
+
+void tempo_reset(TimeStretch *ts) {
+    ts->in_len = 0;
+    ts->in_pos = ts->search;
+    ts->ref_pos = -1;
+    SDL_memset(ts->overlap, 0, ts->hop * ts->channels * sizeof(float));
+}
+
+static int tempo_append(TimeStretch *ts, const int16_t *src, int nb_samples) {
+    if (ts->in_len + nb_samples > ts->in_cap) {
+        return -1;
+    }
+    SDL_memcpy(ts->in + ts->in_len * ts->channels, src, (size_t)nb_samples * ts->channels * sizeof(int16_t));
+    ts->in_len += nb_samples;
+    return 0;
+}
+
+// Offset in [-search, search] around pos whose first half window correlates best with the
+// continuation of the previously placed frame. Correlates every other sample of the channel sum.
+static int tempo_best_offset(TimeStretch *ts, int pos) {
+    if (ts->ref_pos < 0) {
+        return 0;
+    }
+    const int channels = ts->channels;
+    const int16_t *ref = ts->in + ts->ref_pos * channels;
+    int best_offset = 0;
+    int64_t best_corr = INT64_MIN;
+    for (int offset = -ts->search; offset <= ts->search; offset++) {
+        const int16_t *cand = ts->in + (pos + offset) * channels;
+        int64_t corr = 0;
+        for (int i = 0; i < ts->hop; i += 2) {
+            int a = 0, b = 0;
+            for (int c = 0; c < channels; c++) {
+                a += ref[i * channels + c];
+                b += cand[i * channels + c];
+            }
+            corr += (int64_t)a * b;
+        }
+        if (corr > best_corr) {
+            best_corr = corr;
+            best_offset = offset;
+        }
+    }
+    return best_offset;
+}
+
+// Appends nb_samples of src and writes as many stretched samples as are ready to dst, at most
+// dst_capacity. Returns the number of samples written or -1 if src does not fit the input buffer.
+int tempo_process(TimeStretch *ts, double rate, const int16_t *src, int nb_samples, int16_t *dst, int dst_capacity) {
+    const int channels = ts->channels;
+    if (tempo_append(ts, src, nb_samples) != 0) {
+        return -1;
+    }
+
+    int written = 0;
+    while (written + ts->hop <= dst_capacity) {
+        int pos = (int)ts->in_pos;
+        if (pos + ts->search + ts->window > ts->in_len) {
+            break;
+        }
+        pos += tempo_best_offset(ts, pos);
+
+        const int16_t *frame = ts->in + pos * channels;
+        int16_t *out = dst + written * channels;
+        for (int i = 0; i < ts->hop; i++) {
+            for (int c = 0; c < channels; c++) {
+                float v = ts->overlap[i * channels + c] + ts->win[i] * frame[i * channels + c];
+                out[i * channels + c] = av_clip_int16(lrintf(v));
+                ts->overlap[i * channels + c] = ts->win[ts->hop + i] * frame[(ts->hop + i) * channels + c];
+            }
+        }
+        written += ts->hop;
+        ts->ref_pos = pos + ts->hop;
+        ts->in_pos += ts->hop * rate;
+    }
+
+    // Drop input that neither the next search window nor the correlation reference can reach.
+    int consumed = (int)ts->in_pos - ts->search;
+    if (ts->ref_pos >= 0) {
+        consumed = FFMIN(consumed, ts->ref_pos);
+    }
+    if (consumed > 0) {
+        SDL_memmove(ts->in, ts->in + consumed * channels, (size_t)(ts->in_len - consumed) * channels * sizeof(int16_t));
+        ts->in_len -= consumed;
+        ts->in_pos -= consumed;
+        if (ts->ref_pos >= 0) {
+            ts->ref_pos -= consumed;
+        }
+    }
+
+    return written;
+}
@@ -0,0 +1,11 @@
+#include <SDL.h>
+
+#ifndef TEMPO_H
+#define TEMPO_H
+#include "typedefs.h"
+
+int tempo_init(TimeStretch *ts, Arena *arena, int sample_rate, int channels, int max_input);
+void tempo_reset(TimeStretch *ts);
+int tempo_process(TimeStretch *ts, double rate, const int16_t *src, int nb_samples, int16_t *dst, int dst_capacity);
+
+#endif
@@ -0,0 +1,522 @@
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "timeshift.h"
+#include "decoder.h"
+#include "output.h"
+
+// Timeshift of a live input. decoder_thread hands every packet of the played video and audio stream
+// to timeshift_live_packet, which queues a reference for the writer thread and never waits for the
+// disk. The writer remuxes them without decoding into MPEG-TS segments that start at a video
+// keyframe and deletes the oldest once the rest still cover the window.
+//
+// Playback is either live, packets go from the demuxer straight to the decoders as usual, or
+// shifted, the reader thread demuxes the segments and feeds the decoders while the live packets
+// only go to disk. Seeking within the window, pausing a live input and going back to live switch
+// between the two.
+
+// Segments are cut at the first video keyframe after this many seconds.
+#define TIMESHIFT_SEGMENT_SECONDS 2.0
+// Packets waiting for the writer. Beyond this the tee drops packets up to the next keyframe.
+#define TIMESHIFT_MAX_QUEUED_BYTES (32 * 1024 * 1024)
+// Seeks closer than this to the newest recorded packet go live.
+#define TIMESHIFT_LIVE_MARGIN 1.0
+#define TIMESHIFT_PATH_SIZE 1024
+
+static void timeshift_segment_path(Timeshift *ts, int index, char *path) {
+    snprintf(path, TIMESHIFT_PATH_SIZE, "%s/witch-%06d.ts", ts->dir, index);
+}
+
+static TimeshiftSegment* timeshift_segment(Timeshift *ts, int index) {
+    return &ts->segments[index % TIMESHIFT_MAX_SEGMENTS];
+}
+
+// Index of the recorded stream, -1 when stream_id is not recorded.
+static int timeshift_stream(Timeshift *ts, int stream_id) {
+    for (int k = 0; k < ts->nb_streams; k++) {
+        if (ts->in_stream[k] == stream_id) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+static double timeshift_packet_time(MediaPlayerState *m, int stream_id, AVPacket *pkt) {
+    int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    if (ts == AV_NOPTS_VALUE) {
+        return NAN;
+    }
+    return ts * av_q2d(m->fmt_ctx->streams[stream_id]->time_base);
+}
+
+// Segments are cut in front of keyframes of the first recorded stream, the video one if there is
+// one. Every packet of an audio only recording is a keyframe.
+static int timeshift_is_boundary(int k, AVPacket *pkt) {
+    return k == 0 && (pkt->flags & AV_PKT_FLAG_KEY);
+}
+
+// Wakes the reader when it is waiting for the recording to grow.
+static void timeshift_appended(MediaPlayerState *m) {
+    SDL_AtomicIncRef(&m->timeshift.appended);
+    wake_waiters(m->demux_mutex, m->demux_cond);
+}
+
+static int timeshift_open_segment(MediaPlayerState *m, int index, double start) {
+    Timeshift *ts = &m->timeshift;
+    char path[TIMESHIFT_PATH_SIZE];
+    timeshift_segment_path(ts, index, path);
+
+    AVFormatContext *out = NULL;
+    if (avformat_alloc_output_context2(&out, NULL, "mpegts", path) < 0) {
+        fprintf(stderr, "Failed to create the timeshift segment %s.\n", path);
+        return -1;
+    }
+    for (int k = 0; k < ts->nb_streams; k++) {
+        AVStream *in = m->fmt_ctx->streams[ts->in_stream[k]];
+        AVStream *stream = avformat_new_stream(out, NULL);
+        if (stream == NULL || avcodec_parameters_copy(stream->codecpar, in->codecpar) < 0) {
+            fprintf(stderr, "Failed to add a stream to the timeshift segment.\n");
+            avformat_free_context(out);
+            return -1;
+        }
+        stream->codecpar->codec_tag = 0;
+        stream->time_base = in->time_base;
+    }
+    if (avio_open(&out->pb, path, AVIO_FLAG_WRITE) < 0) {
+        fprintf(stderr, "Failed to open %s for writing.\n", path);
+        avformat_free_context(out);
+        return -1;
+    }
+    // Keeps the timestamps of the input so every segment is on the same timeline, and flushes each
+    // packet so the reader can follow the segment being written.
+    AVDictionary *opts = NULL;
+    av_dict_set(&opts, "mpegts_copyts", "1", 0);
+    av_dict_set(&opts, "flush_packets", "1", 0);
+    int ret = avformat_write_header(out, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to write the header of %s.\n", path);
+        avio_closep(&out->pb);
+        avformat_free_context(out);
+        return -1;
+    }
+
+    SDL_LockMutex(ts->lock);
+    TimeshiftSegment *segment = timeshift_segment(ts, index);
+    segment->start = start;
+    segment->end = start;
+    segment->complete = 0;
+    ts->next_segment = index + 1;
+    SDL_UnlockMutex(ts->lock);
+    ts->out = out;
+    return 0;
+}
+
+static void timeshift_close_segment(MediaPlayerState *m) {
+    Timeshift *ts = &m->timeshift;
+    if (ts->out == NULL) {
+        return;
+    }
+    av_write_trailer(ts->out);
+    avio_closep(&ts->out->pb);
+    avformat_free_context(ts->out);
+    ts->out = NULL;
+    SDL_LockMutex(ts->lock);
+    timeshift_segment(ts, ts->next_segment - 1)->complete = 1;
+    SDL_UnlockMutex(ts->lock);
+    timeshift_appended(m);
+}
+
+// Deletes the oldest segments while the newer ones still cover the window. The segment the reader
+// is in and everything after it is kept. Called with lock held.
+static void timeshift_trim(Timeshift *ts) {
+    double live = timeshift_segment(ts, ts->next_segment - 1)->end;
+    while (ts->first_segment < ts->next_segment - 1 &&
+           (ts->reading_segment < 0 || ts->first_segment < ts->reading_segment) &&
+           live - timeshift_segment(ts, ts->first_segment + 1)->start >= ts->window) {
+        char path[TIMESHIFT_PATH_SIZE];
+        timeshift_segment_path(ts, ts->first_segment, path);
+        if (unlink(path) != 0) {
+            fprintf(stderr, "Failed to delete %s.\n", path);
+        }
+        ts->first_segment++;
+    }
+}
+
+static int timeshift_writer(void *arg) {
+    MediaPlayerState *m = (MediaPlayerState *)arg;
+    Timeshift *ts = &m->timeshift;
+    AVPacket pkt;
+
+    while (pkt_queue_get(&ts->queue, &pkt, m) == 0) {
+        int k = pkt.stream_index;
+        double t = timeshift_packet_time(m, ts->in_stream[k], &pkt);
+        if (timeshift_is_boundary(k, &pkt) && !isnan(t)) {
+            SDL_LockMutex(ts->lock);
+            double start = ts->out != NULL ? timeshift_segment(ts, ts->next_segment - 1)->start : t;
+            int room = ts->next_segment - ts->first_segment < TIMESHIFT_MAX_SEGMENTS;
+            SDL_UnlockMutex(ts->lock);
+            if (ts->out == NULL || (t - start >= TIMESHIFT_SEGMENT_SECONDS && room)) {
+                timeshift_close_segment(m);
+                if (timeshift_open_segment(m, ts->next_segment, t) != 0) {
+                    av_packet_unref(&pkt);
+                    break;
+                }
+            }
+        }
+        if (ts->out == NULL) {
+            // Before the first keyframe.
+            av_packet_unref(&pkt);
+            continue;
+        }
+
+        av_packet_rescale_ts(&pkt, m->fmt_ctx->streams[ts->in_stream[k]]->time_base, ts->out->streams[k]->time_base);
+        if (av_interleaved_write_frame(ts->out, &pkt) < 0) {
+            fprintf(stderr, "Failed to write a timeshift packet.\n");
+        }
+        ts->packets_written++;
+        if (!isnan(t)) {
+            SDL_LockMutex(ts->lock);
+            TimeshiftSegment *segment = timeshift_segment(ts, ts->next_segment - 1);
+            segment->end = FFMAX(segment->end, t);
+            timeshift_trim(ts);
+            SDL_UnlockMutex(ts->lock);
+        }
+        timeshift_appended(m);
+    }
+    timeshift_close_segment(m);
+    return 0;
+}
+
+// Queues a reference to pkt for the writer, never waits. When the writer falls too far behind,
+// packets are dropped up to the next keyframe so the recording stays decodable.
+static void timeshift_tee(MediaPlayerState *m, int k, AVPacket *pkt) {
+    Timeshift *ts = &m->timeshift;
+    // The writer thread takes packets off the queue concurrently.
+    SDL_LockMutex(ts->queue.mutex);
+    int queued = ts->queue.size;
+    SDL_UnlockMutex(ts->queue.mutex);
+    if (queued >= TIMESHIFT_MAX_QUEUED_BYTES) {
+        ts->tee_wait_keyframe = 1;
+    }
+    if (ts->tee_wait_keyframe && !timeshift_is_boundary(k, pkt)) {
+        ts->packets_dropped++;
+        return;
+    }
+    ts->tee_wait_keyframe = 0;
+
+    AVPacket ref = { 0 };
+    if (av_packet_ref(&ref, pkt) < 0) {
+        ts->packets_dropped++;
+        ts->tee_wait_keyframe = 1;
+        return;
+    }
+    ref.stream_index = k;
+    if (pkt_queue_put(&ts->queue, &ref) != 0) {
+        av_packet_unref(&ref);
+        ts->packets_dropped++;
+    }
+}
+
+// Runs on the demuxer thread in place of route_packet. Takes the reference to pkt.
+int timeshift_live_packet(MediaPlayerState *m, AVPacket *pkt) {
+    Timeshift *ts = &m->timeshift;
+    int k = timeshift_stream(ts, pkt->stream_index);
+    if (k >= 0) {
+        timeshift_tee(m, k, pkt);
+    }
+
+    int ret = 0;
+    SDL_LockMutex(ts->switch_lock);
+    if (SDL_AtomicGet(&ts->shifted)) {
+        av_packet_unref(pkt);
+    } else {
+        if (k >= 0) {
+            ts->live_dts[k] = pkt->dts;
+        }
+        ret = route_packet(m, pkt);
+    }
+    SDL_UnlockMutex(ts->switch_lock);
+    return ret;
+}
+
+// Called by the demuxer thread when the live input is over. Returns 1 when playback is shifted and
+// goes on from the recording.
+int timeshift_live_ended(MediaPlayerState *m) {
+    Timeshift *ts = &m->timeshift;
+    SDL_LockMutex(ts->switch_lock);
+    ts->live_ended = 1;
+    int shifted = SDL_AtomicGet(&ts->shifted);
+    SDL_UnlockMutex(ts->switch_lock);
+    pkt_queue_finish(&ts->queue);
+    // The reader may be waiting at the end of the last segment for more that never comes.
+    timeshift_appended(m);
+    return shifted;
+}
+
+// Pausing a live input: the decoders stop taking packets, so playback continues from the recording
+// where the live packets left off.
+void timeshift_hold(MediaPlayerState *m) {
+    SDL_AtomicSet(&m->timeshift.hold_request, 1);
+    wake_waiters(m->demux_mutex, m->demux_cond);
+}
+
+static void timeshift_end_playback(MediaPlayerState *m) {
+    finish_play_queues(m);
+    wake_waiters(m->timeshift.queue.mutex, m->timeshift.queue.cond);
+}
+
+static void timeshift_close_input(Timeshift *ts) {
+    avformat_close_input(&ts->in);
+    SDL_LockMutex(ts->lock);
+    ts->reading_segment = -1;
+    SDL_UnlockMutex(ts->lock);
+}
+
+// Makes index the segment read from, it is opened by timeshift_read once it can be.
+static void timeshift_select_segment(Timeshift *ts, int index) {
+    avformat_close_input(&ts->in);
+    SDL_LockMutex(ts->lock);
+    ts->reading_segment = FFMAX(index, ts->first_segment);
+    SDL_UnlockMutex(ts->lock);
+}
+
+// Last segment starting at or before t, the oldest when t is before all of them. Called with lock
+// held and at least one segment on disk.
+static int timeshift_find_segment(Timeshift *ts, double t) {
+    int index = ts->first_segment;
+    while (index + 1 < ts->next_segment && timeshift_segment(ts, index + 1)->start <= t) {
+        index++;
+    }
+    return index;
+}
+
+static void timeshift_go_live(MediaPlayerState *m, int serial) {
+    Timeshift *ts = &m->timeshift;
+    SDL_LockMutex(ts->switch_lock);
+    if (SDL_AtomicGet(&ts->shifted)) {
+        flush_play_queues(m, serial);
+        if (m->video_stream_id >= 0) {
+            m->video_wait_keyframe = 1;
+        }
+        SDL_AtomicSet(&ts->shifted, 0);
+        if (ts->live_ended) {
+            timeshift_end_playback(m);
+        }
+    }
+    SDL_UnlockMutex(ts->switch_lock);
+    timeshift_close_input(ts);
+}
+
+static void timeshift_seek(MediaPlayerState *m, int serial, double target) {
+    Timeshift *ts = &m->timeshift;
+    SDL_LockMutex(ts->lock);
+    if (ts->first_segment == ts->next_segment) {
+        // Nothing recorded yet.
+        SDL_UnlockMutex(ts->lock);
+        return;
+    }
+    double live = timeshift_segment(ts, ts->next_segment - 1)->end;
+    int index = timeshift_find_segment(ts, target);
+    SDL_UnlockMutex(ts->lock);
+    if (target >= live - TIMESHIFT_LIVE_MARGIN) {
+        timeshift_go_live(m, serial);
+        return;
+    }
+
+    SDL_LockMutex(ts->switch_lock);
+    SDL_AtomicSet(&ts->shifted, 1);
+    flush_play_queues(m, serial);
+    if (m->video_stream_id >= 0) {
+        m->video_wait_keyframe = 1;
+    }
+    for (int k = 0; k < ts->nb_streams; k++) {
+        ts->skip_to_live[k] = 0;
+    }
+    SDL_UnlockMutex(ts->switch_lock);
+    // Playback starts at the keyframe the segment starts with.
+    timeshift_select_segment(ts, index);
+}
+
+// Switches a live playback over to the recording without a flush. What the decoders already got is
+// skipped in the recording, so they continue with the next packet of each stream.
+static void timeshift_hold_live(MediaPlayerState *m) {
+    Timeshift *ts = &m->timeshift;
+    SDL_LockMutex(ts->switch_lock);
+    if (SDL_AtomicGet(&ts->shifted) || ts->live_ended) {
+        SDL_UnlockMutex(ts->switch_lock);
+        return;
+    }
+    SDL_AtomicSet(&ts->shifted, 1);
+    double resume = INFINITY;
+    for (int k = 0; k < ts->nb_streams; k++) {
+        ts->skip_to_live[k] = ts->live_dts[k] != AV_NOPTS_VALUE;
+        if (ts->skip_to_live[k]) {
+            resume = FFMIN(resume, ts->live_dts[k] * av_q2d(m->fmt_ctx->streams[ts->in_stream[k]]->time_base));
+        }
+    }
+    SDL_UnlockMutex(ts->switch_lock);
+
+    SDL_LockMutex(ts->lock);
+    int index = ts->next_segment > ts->first_segment ? timeshift_find_segment(ts, resume) : 0;
+    SDL_UnlockMutex(ts->lock);
+    timeshift_select_segment(ts, index);
+}
+
+static int timeshift_open_input(MediaPlayerState *m) {
+    Timeshift *ts = &m->timeshift;
+    SDL_LockMutex(ts->lock);
+    int index = ts->reading_segment;
+    int exists = index < ts->next_segment;
+    SDL_UnlockMutex(ts->lock);
+    if (!exists) {
+        return -1;
+    }
+    char path[TIMESHIFT_PATH_SIZE];
+    timeshift_segment_path(ts, index, path);
+    if (avformat_open_input(&ts->in, path, av_find_input_format("mpegts"), NULL) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Recorded stream of a stream of the segment being read, the segments hold one stream per type.
+static int timeshift_map_stream(MediaPlayerState *m, AVStream *stream) {
+    Timeshift *ts = &m->timeshift;
+    for (int k = 0; k < ts->nb_streams; k++) {
+        if (m->fmt_ctx->streams[ts->in_stream[k]]->codecpar->codec_type == stream->codecpar->codec_type) {
+            return k;
+        }
+    }
+    return -1;
+}
+
+// Reads the next packet of the recording and routes it. Returns 1 when there was nothing to read
+// yet, -1 once the recording is over.
+static int timeshift_read(MediaPlayerState *m) {
+    Timeshift *ts = &m->timeshift;
+    if (ts->in == NULL && timeshift_open_input(m) != 0) {
+        return 1;
+    }
+
+    AVPacket pkt;
+    if (av_read_frame(ts->in, &pkt) < 0) {
+        SDL_LockMutex(ts->lock);
+        int index = ts->reading_segment;
+        int complete = timeshift_segment(ts, index)->complete;
+        int last = index + 1 >= ts->next_segment;
+        SDL_UnlockMutex(ts->lock);
+        if (complete && !last) {
+            timeshift_select_segment(ts, index + 1);
+            return 0;
+        }
+        if (complete && ts->live_ended) {
+            return -1;
+        }
+        // Follow the segment the writer is still appending to.
+        ts->in->pb->eof_reached = 0;
+        ts->in->pb->error = 0;
+        return 1;
+    }
+
+    AVStream *stream = ts->in->streams[pkt.stream_index];
+    int k = timeshift_map_stream(m, stream);
+    if (k < 0) {
+        av_packet_unref(&pkt);
+        return 0;
+    }
+    AVRational time_base = m->fmt_ctx->streams[ts->in_stream[k]]->time_base;
+    av_packet_rescale_ts(&pkt, stream->time_base, time_base);
+    if (ts->skip_to_live[k]) {
+        if (pkt.dts != AV_NOPTS_VALUE && pkt.dts <= ts->live_dts[k]) {
+            av_packet_unref(&pkt);
+            return 0;
+        }
+        ts->skip_to_live[k] = 0;
+    }
+    pkt.stream_index = ts->in_stream[k];
+    pkt.pos = -1;
+    return route_packet(m, &pkt) == 0 ? 0 : -1;
+}
+
+// Nothing to read: at the end, while live or while the play queues are full.
+static int timeshift_reader_idle(MediaPlayerState *m) {
+    return m->eof || !SDL_AtomicGet(&m->timeshift.shifted) || play_queues_full(m);
+}
+
+// Sleeps on demux_cond until a seek or hold request comes in or, unless idle, the recording grew
+// past appended. Everything is checked again under demux_mutex, like demux_wait does.
+static void timeshift_reader_wait(MediaPlayerState *m, int seek_handled, int appended) {
+    Timeshift *ts = &m->timeshift;
+    SDL_LockMutex(m->demux_mutex);
+    if (!m->quit && SDL_AtomicGet(&m->seek_serial) == seek_handled && !SDL_AtomicGet(&ts->hold_request) &&
+        (timeshift_reader_idle(m) || SDL_AtomicGet(&ts->appended) == appended)) {
+        SDL_CondWait(m->demux_cond, m->demux_mutex);
+    }
+    SDL_UnlockMutex(m->demux_mutex);
+}
+
+// Stays around at the end of the recording, a seek back into it plays on.
+static int timeshift_reader(void *arg) {
+    MediaPlayerState *m = (MediaPlayerState *)arg;
+    Timeshift *ts = &m->timeshift;
+    int seek_handled = 0;
+
+    while (!m->quit) {
+        double target;
+        int serial = take_seek_request(m, &seek_handled, &target);
+        if (serial >= 0) {
+            timeshift_seek(m, serial, target);
+            continue;
+        }
+        if (SDL_AtomicSet(&ts->hold_request, 0)) {
+            timeshift_hold_live(m);
+            continue;
+        }
+        // Taken before reading, so a packet written meanwhile is not slept through.
+        int appended = SDL_AtomicGet(&ts->appended);
+        if (timeshift_reader_idle(m)) {
+            timeshift_reader_wait(m, seek_handled, appended);
+            continue;
+        }
+        int ret = timeshift_read(m);
+        if (ret < 0) {
+            timeshift_end_playback(m);
+        } else if (ret > 0) {
+            timeshift_reader_wait(m, seek_handled, appended);
+        }
+    }
+    return 0;
+}
+
+// Records the played video and audio stream into dir and starts the writer and reader threads.
+// Needs the streams selected and has to run before decoder_thread.
+int timeshift_start(MediaPlayerState *m) {
+    Timeshift *ts = &m->timeshift;
+    if (mkdir(ts->dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create the timeshift directory %s.\n", ts->dir);
+        return -1;
+    }
+    if (m->video_stream_id >= 0) {
+        ts->in_stream[ts->nb_streams++] = m->video_stream_id;
+    }
+    if (m->audio_stream_id >= 0) {
+        ts->in_stream[ts->nb_streams++] = m->audio_stream_id;
+    }
+    for (int k = 0; k < ts->nb_streams; k++) {
+        ts->live_dts[k] = AV_NOPTS_VALUE;
+    }
+    ts->tee_wait_keyframe = 1;
+    ts->reading_segment = -1;
+
+    ts->writer_tid = SDL_CreateThread(timeshift_writer, "timeshift-writer", m);
+    ts->reader_tid = SDL_CreateThread(timeshift_reader, "timeshift-reader", m);
+    if (ts->writer_tid == NULL || ts->reader_tid == NULL) {
+        PRINT_SDL_ERROR();
+        return -1;
+    }
+    return 0;
+}
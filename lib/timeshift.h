@@ -0,0 +1,12 @@
+#include <SDL.h>
+
+#ifndef TIMESHIFT_H
+#define TIMESHIFT_H
+#include "typedefs.h"
+
+int timeshift_start(MediaPlayerState *m);
+int timeshift_live_packet(MediaPlayerState *m, AVPacket *pkt);
+int timeshift_live_ended(MediaPlayerState *m);
+void timeshift_hold(MediaPlayerState *m);
+
+#endif
@@ -1,82 +1,99 @@
-#include <libavformat/avformat.h>
-#include <libavcodec/avcodec.h>
-#include <libswresample/swresample.h>
-#include <SDL.h>
-
-#ifndef TYPEDEFS
-#define TYPEDEFS
-
-#define VIDEO_FRAME_BUFFER_SIZE 10
-#define REFRESH_VIDEO_DISPLAY (SDL_USEREVENT + 1)
-
-typedef struct FrameBufferItem {
-    AVFrame frame;
-    int allocated;
-} FrameBufferItem;
-
-typedef struct PacketItem {
-    AVPacket pkt;
-    struct PacketItem *next;
-} PacketItem;
-
-typedef struct PacketQueue {
-    PacketItem *first, *last;
-    int nb_packets;
-    int size;
-    SDL_mutex *mutex;
-    SDL_cond *cond;
-} PacketQueue;
-
-typedef struct DisplayOutput {
-    SDL_Window *window;
-    SDL_Renderer *renderer;
-    SDL_Texture *texture;
-    SDL_Rect rect;
-} DisplayOutput;
-
-typedef struct MediaPlayerState {
-    AVFormatContext *fmt_ctx;
-    AVCodecContext *video_codec_ctx, *audio_codec_ctx;
-    SwrContext *resampler_ctx;
-    int video_stream_id, audio_stream_id;
-    int audio_device_id;
-    DisplayOutput *display;
-
-    FrameBufferItem framebuffer[VIDEO_FRAME_BUFFER_SIZE];
-    int frame_read_index;
-    int frame_write_index;
-    SDL_mutex *framebuffer_mutex;
-    SDL_cond *framebuffer_cond;
-    int audio_buffer_index;
-    int audio_buffer_size;
-    uint8_t *audio_buffer;
-
-    PacketQueue video_pkt_queue, audio_pkt_queue;
-
-    SDL_Thread *decoder_tid, *video_tid;
-
-    int quit;
-} MediaPlayerState;
+#include <math.h>
+
+#include "typedefs.h"
 
 MediaPlayerState* alloc_media_player_state() {
-    MediaPlayerState *m = (MediaPlayerState *)av_mallocz(sizeof(MediaPlayerState));
+    Arena arena;
+    if (arena_init(&arena, SESSION_ARENA_BLOCK_SIZE) != 0) {
+        return NULL;
+    }
+    MediaPlayerState *m = (MediaPlayerState *)arena_alloc(&arena, sizeof(MediaPlayerState));
     if (!m) {
         fprintf(stderr, "Failed to allocate memory for the media player.\n");
+        arena_destroy(&arena);
+        return NULL;
+    }
+    m->arena = arena;
+    if (arena_init(&m->audio_scratch, AUDIO_SCRATCH_ARENA_BLOCK_SIZE) != 0) {
+        arena_destroy(&arena);
+        return NULL;
+    }
+    if (arena_init(&m->demux_scratch, DEMUX_SCRATCH_ARENA_BLOCK_SIZE) != 0) {
+        arena_destroy(&m->audio_scratch);
+        arena_destroy(&arena);
+        return NULL;
+    }
+    if (arena_init(&m->render_scratch, RENDER_SCRATCH_ARENA_BLOCK_SIZE) != 0) {
+        arena_destroy(&m->demux_scratch);
+        arena_destroy(&m->audio_scratch);
+        arena_destroy(&arena);
         return NULL;
     }
     m->video_stream_id = -1;
     m->audio_stream_id = -1;
+    m->subtitle_stream_id = -1;
+    m->framebuffer_size = VIDEO_FRAME_BUFFER_SIZE;
+    m->requested_video_stream = -1;
+    m->requested_audio_stream = -1;
+    m->requested_subtitle_stream = -1;
+    m->pending_audio_stream_id = -1;
+    m->active_audio_stream_id = -1;
+    SDL_AtomicSet(&m->audio_switch_request, -1);
+    SDL_AtomicSet(&m->playback_rate, 100);
+    m->clock.rate = 1.0;
+    m->displayed_pts = NAN;
+    m->audio_clock_serial = -1;
+    m->audio_switch_mutex = SDL_CreateMutex();
+    m->audio_ring.space = SDL_CreateSemaphore(0);
 
     m->framebuffer_mutex = SDL_CreateMutex();
     m->framebuffer_cond = SDL_CreateCond();
+    m->demux_mutex = SDL_CreateMutex();
+    m->demux_cond = SDL_CreateCond();
 
     m->video_pkt_queue.mutex = SDL_CreateMutex();
     m->video_pkt_queue.cond = SDL_CreateCond();
+    m->video_pkt_queue.arena = &m->demux_scratch;
 
     m->audio_pkt_queue.mutex = SDL_CreateMutex();
     m->audio_pkt_queue.cond = SDL_CreateCond();
+    m->audio_pkt_queue.arena = &m->demux_scratch;
+
+    m->subtitle_pkt_queue.mutex = SDL_CreateMutex();
+    m->subtitle_pkt_queue.cond = SDL_CreateCond();
+    m->subtitle_pkt_queue.arena = &m->demux_scratch;
+    m->subtitle_queue.mutex = SDL_CreateMutex();
+    m->subtitle_queue.cond = SDL_CreateCond();
 
-    m->display = SDL_malloc(sizeof(DisplayOutput));
+    m->timeshift.queue.mutex = SDL_CreateMutex();
+    m->timeshift.queue.cond = SDL_CreateCond();
+    m->timeshift.queue.arena = &m->demux_scratch;
+    m->timeshift.lock = SDL_CreateMutex();
+    m->timeshift.switch_lock = SDL_CreateMutex();
+    m->playlist.mutex = SDL_CreateMutex();
+    m->playlist.cond = SDL_CreateCond();
+    m->gop_cache.mutex = SDL_CreateMutex();
+    m->gop_cache.cond = SDL_CreateCond();
+
+    m->filter_queue.mutex = SDL_CreateMutex();
+    m->filter_queue.cond = SDL_CreateCond();
+
+    for (int i = 0; i < VIDEO_FRAME_BUFFER_SIZE; i++) {
+        m->framebuffer[i].frame = av_frame_alloc();
+    }
+    for (int i = 0; i < FILTER_QUEUE_SIZE; i++) {
+        m->filter_queue.frames[i] = av_frame_alloc();
+    }
+    m->video_frame = av_frame_alloc();
+    m->audio_frame = av_frame_alloc();
+
+    m->display = arena_alloc(&m->arena, sizeof(DisplayOutput));
+    if (m->display == NULL || m->video_frame == NULL || m->audio_frame == NULL) {
+        fprintf(stderr, "Failed to allocate memory for the media player.\n");
+        free_media_player_state(m);
+        return NULL;
+    }
+    m->display->texture = NULL;
     m->display->rect.h = -1;
     m->display->rect.w = -1;
     m->display->rect.x = 0;
@@ -86,15 +103,21 @@ MediaPlayerState* alloc_media_player_state() {
 }
 
 int pkt_queue_put(PacketQueue *pkt_queue, AVPacket *pkt) {
-    PacketItem *pkt_item = av_malloc(sizeof(PacketItem));
-    if (!pkt_item) {
-        fprintf(stderr, "Failed to allocate a PacketItem for the pkt_queue_put op.\n");
-        return -1;
+    SDL_LockMutex(pkt_queue->mutex);
+    PacketItem *pkt_item = pkt_queue->free_items;
+    if (pkt_item != NULL) {
+        pkt_queue->free_items = pkt_item->next;
+    } else {
+        pkt_item = arena_alloc(pkt_queue->arena, sizeof(PacketItem));
+        if (!pkt_item) {
+            SDL_UnlockMutex(pkt_queue->mutex);
+            fprintf(stderr, "Failed to allocate a PacketItem for the pkt_queue_put op.\n");
+            return -1;
+        }
     }
     pkt_item->pkt = *pkt;
     pkt_item->next = NULL;
 
-    SDL_LockMutex(pkt_queue->mutex);
     if (pkt_queue->last == NULL) {
         pkt_queue->first = pkt_item;
     } else {
@@ -117,6 +140,7 @@ int pkt_queue_get(PacketQueue *pkt_queue, AVPacket *pkt, MediaPlayerState *m) {
     while (1) {
         if (m->quit) {
             ret = -1;
+            break;
         }
 
         if (pkt_queue->first) {
@@ -128,14 +152,227 @@ int pkt_queue_get(PacketQueue *pkt_queue, AVPacket *pkt, MediaPlayerState *m) {
             pkt_queue->nb_packets--;
             pkt_queue->size -= pkt_item->pkt.size;
             *pkt = pkt_item->pkt;
-            av_free(pkt_item);
+            pkt_item->next = pkt_queue->free_items;
+            pkt_queue->free_items = pkt_item;
+            break;
+        } else if (pkt_queue->finished) {
+            ret = -1;
             break;
         } else {
             SDL_CondWait(pkt_queue->cond, pkt_queue->mutex);
         }
     }
     SDL_UnlockMutex(pkt_queue->mutex);
+    if (ret == 0) {
+        wake_waiters(m->demux_mutex, m->demux_cond);
+    }
     return ret;
 }
 
-#endif
\ No newline at end of file
+// Playlist handover markers are kept, the decoders have to see them whatever is flushed. An end of
+// input marker goes, after a seek the end is reached again and marked anew.
+void pkt_queue_flush(PacketQueue *pkt_queue) {
+    SDL_LockMutex(pkt_queue->mutex);
+    PacketItem *pkt_item = pkt_queue->first;
+    pkt_queue->first = NULL;
+    pkt_queue->last = NULL;
+    pkt_queue->nb_packets = 0;
+    pkt_queue->size = 0;
+    while (pkt_item) {
+        PacketItem *next = pkt_item->next;
+        if (pkt_item->pkt.stream_index == PLAYLIST_PACKET_STREAM_INDEX) {
+            pkt_item->next = NULL;
+            if (pkt_queue->last == NULL) {
+                pkt_queue->first = pkt_item;
+            } else {
+                pkt_queue->last->next = pkt_item;
+            }
+            pkt_queue->last = pkt_item;
+            pkt_queue->nb_packets++;
+        } else {
+            av_packet_unref(&pkt_item->pkt);
+            pkt_item->next = pkt_queue->free_items;
+            pkt_queue->free_items = pkt_item;
+        }
+        pkt_item = next;
+    }
+    SDL_UnlockMutex(pkt_queue->mutex);
+}
+
+// Empties the queue and leaves a marker telling the decoder to drop its state, see request_seek.
+int pkt_queue_put_flush(PacketQueue *pkt_queue, int serial) {
+    pkt_queue_flush(pkt_queue);
+    AVPacket marker = { .stream_index = FLUSH_PACKET_STREAM_INDEX, .pos = serial };
+    return pkt_queue_put(pkt_queue, &marker);
+}
+
+// Leaves the end of input marker, the decoder drains on it and waits for a seek. With finish the
+// queue is finished behind it as well.
+int pkt_queue_put_eof(PacketQueue *pkt_queue, int finish) {
+    AVPacket marker = { .stream_index = EOF_PACKET_STREAM_INDEX };
+    int ret = pkt_queue_put(pkt_queue, &marker);
+    if (finish) {
+        pkt_queue_finish(pkt_queue);
+    }
+    return ret;
+}
+
+void pkt_queue_finish(PacketQueue *pkt_queue) {
+    SDL_LockMutex(pkt_queue->mutex);
+    pkt_queue->finished = 1;
+    SDL_CondBroadcast(pkt_queue->cond);
+    SDL_UnlockMutex(pkt_queue->mutex);
+}
+
+void wake_waiters(SDL_mutex *mutex, SDL_cond *cond) {
+    SDL_LockMutex(mutex);
+    SDL_CondBroadcast(cond);
+    SDL_UnlockMutex(mutex);
+}
+
+void playlist_item_free(PlaylistItem *item) {
+    avformat_close_input(&item->fmt_ctx);
+    avcodec_free_context(&item->video_codec_ctx);
+    avcodec_free_context(&item->audio_codec_ctx);
+    swr_free(&item->resampler_ctx);
+    for (int i = item->preroll_index; i < item->nb_preroll; i++) {
+        av_packet_unref(&item->preroll[i]);
+    }
+    item->nb_preroll = item->preroll_index = 0;
+    for (int i = 0; i < item->nb_frames; i++) {
+        av_frame_free(&item->frames[i]);
+    }
+    item->nb_frames = 0;
+}
+
+void gop_cache_entry_free(GopCacheEntry *gop) {
+    for (int i = 0; i < gop->nb_frames; i++) {
+        av_frame_free(&gop->frames[i]);
+    }
+    av_freep(&gop->frames);
+    gop->nb_frames = gop->capacity = 0;
+    gop->bytes = 0;
+}
+
+// Stops every thread and releases everything the player owns, including m itself.
+void free_media_player_state(MediaPlayerState *m) {
+    if (m == NULL) {
+        return;
+    }
+
+    m->quit = 1;
+    SDL_SemPost(m->audio_ring.space);
+    wake_waiters(m->demux_mutex, m->demux_cond);
+    wake_waiters(m->video_pkt_queue.mutex, m->video_pkt_queue.cond);
+    wake_waiters(m->audio_pkt_queue.mutex, m->audio_pkt_queue.cond);
+    wake_waiters(m->framebuffer_mutex, m->framebuffer_cond);
+    wake_waiters(m->filter_queue.mutex, m->filter_queue.cond);
+    wake_waiters(m->subtitle_pkt_queue.mutex, m->subtitle_pkt_queue.cond);
+    wake_waiters(m->subtitle_queue.mutex, m->subtitle_queue.cond);
+    wake_waiters(m->timeshift.queue.mutex, m->timeshift.queue.cond);
+    wake_waiters(m->playlist.mutex, m->playlist.cond);
+    wake_waiters(m->gop_cache.mutex, m->gop_cache.cond);
+    // Does not wait for a running callback, gop_cache_timer does not use m.
+    if (m->gop_cache.timer != 0) {
+        SDL_RemoveTimer(m->gop_cache.timer);
+    }
+    if (m->audio_device_id != 0) {
+        // Waits for a running callback to return.
+        SDL_CloseAudioDevice(m->audio_device_id);
+    }
+    SDL_WaitThread(m->decoder_tid, NULL);
+    SDL_WaitThread(m->video_tid, NULL);
+    // Started by the video decoder, so it is known once video_tid has been joined.
+    SDL_WaitThread(m->filter_tid, NULL);
+    SDL_WaitThread(m->subtitle_tid, NULL);
+    SDL_WaitThread(m->audio_tid, NULL);
+    SDL_WaitThread(m->timeshift.writer_tid, NULL);
+    SDL_WaitThread(m->timeshift.reader_tid, NULL);
+    SDL_WaitThread(m->playlist.preload_tid, NULL);
+    SDL_WaitThread(m->gop_cache.tid, NULL);
+
+    pkt_queue_flush(&m->video_pkt_queue);
+    pkt_queue_flush(&m->audio_pkt_queue);
+    pkt_queue_flush(&m->subtitle_pkt_queue);
+    pkt_queue_flush(&m->timeshift.queue);
+    for (int i = 0; i < m->subtitle_queue.nb_items; i++) {
+        avsubtitle_free(&m->subtitle_queue.items[(m->subtitle_queue.read_index + i) % SUBTITLE_QUEUE_SIZE].sub);
+    }
+    for (int i = 0; i < VIDEO_FRAME_BUFFER_SIZE; i++) {
+        av_frame_free(&m->framebuffer[i].frame);
+    }
+    for (int i = 0; i < FILTER_QUEUE_SIZE; i++) {
+        av_frame_free(&m->filter_queue.frames[i]);
+    }
+    avfilter_graph_free(&m->filter_graph);
+    av_tx_uninit(&m->meter.tx);
+    av_frame_free(&m->video_frame);
+    av_frame_free(&m->audio_frame);
+
+    avcodec_free_context(&m->video_codec_ctx);
+    avcodec_free_context(&m->audio_codec_ctx);
+    avcodec_free_context(&m->pending_audio_codec_ctx);
+    avcodec_free_context(&m->subtitle_codec_ctx);
+    swr_free(&m->resampler_ctx);
+    swr_free(&m->pending_resampler_ctx);
+    avformat_close_input(&m->fmt_ctx);
+    avformat_close_input(&m->timeshift.in);
+    for (int i = 1; i < m->playlist.nb_items; i++) {
+        playlist_item_free(&m->playlist.items[i]);
+    }
+    for (int i = 0; i < m->gop_cache.nb_gops; i++) {
+        gop_cache_entry_free(&m->gop_cache.gops[i]);
+    }
+    avformat_close_input(&m->gop_cache.fmt_ctx);
+    avcodec_free_context(&m->gop_cache.codec_ctx);
+    av_packet_free(&m->gop_cache.pkt);
+    av_frame_free(&m->gop_cache.frame);
+    av_frame_free(&m->gop_cache.shown);
+
+    if (m->display != NULL) {
+        if (m->display->texture) {
+            SDL_DestroyTexture(m->display->texture);
+        }
+        if (m->display->subtitle_atlas) {
+            SDL_DestroyTexture(m->display->subtitle_atlas);
+        }
+        if (m->display->renderer) {
+            SDL_DestroyRenderer(m->display->renderer);
+        }
+        if (m->display->window) {
+            SDL_DestroyWindow(m->display->window);
+        }
+    }
+
+    SDL_DestroyMutex(m->framebuffer_mutex);
+    SDL_DestroyCond(m->framebuffer_cond);
+    SDL_DestroyMutex(m->demux_mutex);
+    SDL_DestroyCond(m->demux_cond);
+    SDL_DestroyMutex(m->video_pkt_queue.mutex);
+    SDL_DestroyCond(m->video_pkt_queue.cond);
+    SDL_DestroyMutex(m->audio_pkt_queue.mutex);
+    SDL_DestroyCond(m->audio_pkt_queue.cond);
+    SDL_DestroyMutex(m->subtitle_pkt_queue.mutex);
+    SDL_DestroyCond(m->subtitle_pkt_queue.cond);
+    SDL_DestroyMutex(m->subtitle_queue.mutex);
+    SDL_DestroyCond(m->subtitle_queue.cond);
+    SDL_DestroyMutex(m->filter_queue.mutex);
+    SDL_DestroyCond(m->filter_queue.cond);
+    SDL_DestroyMutex(m->audio_switch_mutex);
+    SDL_DestroySemaphore(m->audio_ring.space);
+    SDL_DestroyMutex(m->timeshift.queue.mutex);
+    SDL_DestroyCond(m->timeshift.queue.cond);
+    SDL_DestroyMutex(m->timeshift.lock);
+    SDL_DestroyMutex(m->timeshift.switch_lock);
+    SDL_DestroyMutex(m->playlist.mutex);
+    SDL_DestroyCond(m->playlist.cond);
+    SDL_DestroyMutex(m->gop_cache.mutex);
+    SDL_DestroyCond(m->gop_cache.cond);
+
+    arena_destroy(&m->audio_scratch);
+    arena_destroy(&m->demux_scratch);
+    arena_destroy(&m->render_scratch);
+    // m lives in its own arena, destroy it through a copy.
+    Arena arena = m->arena;
+    arena_destroy(&arena);
+}
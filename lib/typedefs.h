@@ -0,0 +1,554 @@
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libswresample/swresample.h>
+#include <libavfilter/avfilter.h>
+#include <libavutil/tx.h>
+#include <SDL.h>
+
+#ifndef TYPEDEFS_H
+#define TYPEDEFS_H
+#include "arena.h"
+
+#define VIDEO_FRAME_BUFFER_SIZE 10
+// Long lived player state is carved out of blocks of this size.
+#define SESSION_ARENA_BLOCK_SIZE (256 * 1024)
+#define AUDIO_SCRATCH_ARENA_BLOCK_SIZE (1024 * 1024)
+#define DEMUX_SCRATCH_ARENA_BLOCK_SIZE (64 * 1024)
+#define RENDER_SCRATCH_ARENA_BLOCK_SIZE (1024 * 1024)
+#define REFRESH_VIDEO_DISPLAY (SDL_USEREVENT + 1)
+// user.code of the refresh the video and the audio push once they are over, it carries no frame.
+#define REFRESH_END_OF_STREAM 1
+// Pushed by the GOP cache, user.code is one of the GOP_CACHE_* codes below.
+#define GOP_CACHE_EVENT (SDL_USEREVENT + 3)
+#define GOP_CACHE_TICK 0
+#define GOP_CACHE_READY 1
+// Pushed by the control thread when commands are waiting for the player thread.
+#define CONTROL_EVENT (SDL_USEREVENT + 2)
+// Decoded frames that can wait for the filter graph before the video decoder blocks.
+#define FILTER_QUEUE_SIZE 16
+// Decoded subtitles waiting for or being shown.
+#define SUBTITLE_QUEUE_SIZE 16
+// stream_index of the marker packet a seek leaves in the packet queues, its pos is the seek serial.
+#define FLUSH_PACKET_STREAM_INDEX -1
+// Timeshift segments kept track of at most, the window is normally far fewer.
+#define TIMESHIFT_MAX_SEGMENTS 1024
+// Streams a timeshift records: the played video and audio.
+#define TIMESHIFT_MAX_STREAMS 2
+// stream_index of the marker packet the demuxer leaves in the video and audio queue when it moves on
+// to the next playlist item, its pos is the item index.
+#define PLAYLIST_PACKET_STREAM_INDEX -2
+// stream_index of the marker packet left at the end of the input, the decoders drain on it.
+#define EOF_PACKET_STREAM_INDEX -3
+// Packets of the next playlist item read ahead while pre-decoding its first video frames.
+#define PLAYLIST_PREROLL_PACKETS 32
+#define PLAYLIST_PREROLL_FRAMES 2
+
+// GOPs the cache holds at most, the memory budget is normally reached first.
+#define GOP_CACHE_MAX_GOPS 16
+#define GOP_CACHE_DEFAULT_BUDGET_MB 512
+
+// Audio meter: channels metered, lanes of the widest scan kernel and bands of the spectrum.
+#define METER_MAX_CHANNELS 8
+#define METER_MAX_LANES 16
+#define METER_SPECTRUM_BANDS 32
+
+// Playback speed limits, the rate is stored in percent so it can be shared through an SDL_atomic_t.
+#define MIN_PLAYBACK_RATE 25
+#define MAX_PLAYBACK_RATE 400
+// From this rate up the video decoder skips non-reference frames.
+#define SKIP_NONREF_PLAYBACK_RATE 200
+
+typedef struct PlaybackClock {
+    double pts;         // Media time in seconds at `updated`.
+    double updated;     // clock_now() at the last clock_set.
+    double rate;
+    int started;
+    int paused;
+    int virtual_time;
+    double virtual_now;
+} PlaybackClock;
+
+typedef struct TimeStretch {
+    int channels;
+    int window, hop, search;    // In samples per channel.
+    float *win;
+    float *overlap;             // Windowed second half of the last placed frame.
+    int16_t *in;                // Interleaved input not consumed yet.
+    int in_len, in_cap;
+    double in_pos;              // Nominal position of the next frame in `in`.
+    int ref_pos;                // Where the last placed frame continues in `in`, -1 before the first frame.
+} TimeStretch;
+
+// Levels of the audio output, computed on the audio decode thread in blocks of 100 ms. The scan
+// state is only touched by that thread, the published values are guarded by lock.
+typedef struct AudioMeter {
+    int enabled, spectrum;
+    int channels, freq;
+    int (*scan)(const int16_t *src, int nb_values, uint16_t *lane_peak, int64_t *lane_sq);
+    int lanes;
+
+    // ITU-R BS.1770 K-weighting: a high shelf followed by a high pass, per channel state.
+    double shelf_b[3], shelf_a[2], highpass_b[3], highpass_a[2];
+    double k_state[METER_MAX_CHANNELS][4];
+    double k_gain[METER_MAX_CHANNELS];
+
+    int block_size, block_fill;     // In samples per channel.
+    uint16_t block_peak[METER_MAX_CHANNELS];
+    int64_t block_sq[METER_MAX_CHANNELS];
+    double block_k_sq;              // Weighted sum over the channels of the K-weighted squares.
+    // Mean K-weighted power of the last four blocks, the momentary loudness window.
+    double k_power[4];
+    int nb_blocks;
+
+    // Mono downmix ring of the last spectrum_size samples and the transform over it.
+    AVTXContext *tx;
+    av_tx_fn tx_fn;
+    int spectrum_size, spectrum_pos;
+    float *spectrum_ring, *spectrum_window, *tx_in;
+    AVComplexFloat *tx_out;
+    int band_edges[METER_SPECTRUM_BANDS + 1];
+
+    SDL_SpinLock lock;
+    // In dBFS and LUFS of the last block, -INFINITY for silence.
+    float peak_db[METER_MAX_CHANNELS], rms_db[METER_MAX_CHANNELS];
+    float momentary_lufs;
+    float spectrum_db[METER_SPECTRUM_BANDS];
+    float max_peak_db, max_momentary_lufs;
+    Uint64 blocks_published;
+
+    // Performance counter ticks spent metering and the samples per channel they covered.
+    Uint64 ticks, samples;
+} AudioMeter;
+
+typedef enum StartupPhase {
+    STARTUP_PHASE_OPEN,
+    STARTUP_PHASE_PROBE,
+    STARTUP_PHASE_CODEC_OPEN,
+    STARTUP_PHASE_WINDOW,
+    STARTUP_PHASE_FIRST_FRAME,
+    STARTUP_PHASE_COUNT
+} StartupPhase;
+
+typedef struct PlayerStats {
+    // Performance counter values, 0 means the phase has not started/finished yet.
+    Uint64 startup_origin;
+    Uint64 phase_begin[STARTUP_PHASE_COUNT];
+    Uint64 phase_end[STARTUP_PHASE_COUNT];
+
+    Uint64 frames_displayed;
+    Uint64 frames_dropped;
+    // Performance counter ticks spent in render_frame and, part of it, in the subtitle overlay.
+    Uint64 frames_rendered;
+    Uint64 render_ticks, subtitle_ticks;
+    int block_allocs_at_first_frame;
+
+    // Written by the audio callback only.
+    Uint64 audio_callbacks, audio_underruns;
+    Uint64 audio_queued_bytes, audio_underrun_bytes;
+    // Push mode (audio only): SDL_QueueAudio calls, bytes handed over and times the pusher woke up,
+    // between the performance counter values push_begin and push_end.
+    Uint64 audio_pushes, audio_pushed_bytes, audio_pusher_wakeups;
+    Uint64 audio_push_begin, audio_push_end;
+    // Shown video pts minus the audio clock, summed over every shown frame while audio plays.
+    double av_offset_sum;
+    Uint64 av_offset_samples;
+} PlayerStats;
+
+typedef struct FrameBufferItem {
+    AVFrame *frame;
+    int allocated;
+    // Seek serial the frame was decoded after, display_frame drops frames of older serials.
+    int serial;
+    int playlist_item;
+} FrameBufferItem;
+
+typedef struct PacketItem {
+    AVPacket pkt;
+    struct PacketItem *next;
+} PacketItem;
+
+typedef struct PacketQueue {
+    PacketItem *first, *last;
+    int nb_packets;
+    int size;
+    // Items are recycled through free_items and only taken from the arena when it runs dry.
+    PacketItem *free_items;
+    Arena *arena;
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+    // Set by pkt_queue_finish, pkt_queue_get returns -1 once the queue ran empty.
+    int finished;
+} PacketQueue;
+
+// Lock free single producer, single consumer byte ring between the audio feeder thread and the
+// audio callback. The positions are free running byte counters, capacity is a power of two.
+typedef struct AudioRing {
+    uint8_t *data;
+    int capacity;
+    SDL_atomic_t write_pos, read_pos;
+    // Set by the feeder after a seek, the callback skips everything before discard_pos. read_pos
+    // stays written by the callback alone.
+    SDL_atomic_t discard, discard_pos;
+    // Posted by the callback when it leaves less than the target in the ring, the feeder waits on
+    // it while the ring is full. Nothing posts it while the device is paused.
+    SDL_sem *space;
+} AudioRing;
+
+typedef struct FrameQueue {
+    AVFrame *frames[FILTER_QUEUE_SIZE];
+    int read_index, write_index;
+    int nb_frames;
+    // Set by the producer once no more frames follow.
+    int finished;
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+} FrameQueue;
+
+typedef struct SubtitleItem {
+    AVSubtitle sub;
+    // Media time in seconds, end is INFINITY until the next subtitle replaces this one.
+    double start, end;
+} SubtitleItem;
+
+typedef struct SubtitleQueue {
+    SubtitleItem items[SUBTITLE_QUEUE_SIZE];
+    int read_index;
+    int nb_items;
+    // Set by the decoder when a seek emptied the queue, the main thread then resets the overlay.
+    int cleared;
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+} SubtitleQueue;
+
+// Everything on screen is drawn from one atlas texture, the glyphs of the built in font at the top
+// and the bitmaps of the shown subtitles shelf packed below, so the overlay is a single
+// SDL_RenderGeometry call. Only rebuilt when the set of shown subtitles changes.
+typedef struct SubtitleOverlay {
+    // Bit i is set when the i-th queued subtitle is on screen.
+    int shown_mask;
+    int dirty;
+    int shelf_x, shelf_y, shelf_height;
+    SDL_Vertex *vertices;
+    int *indices;
+    int nb_quads;
+    // ARGB staging for bitmap subtitles on their way into the atlas, big enough for the whole atlas.
+    uint32_t *pixels;
+} SubtitleOverlay;
+
+typedef struct DisplayOutput {
+    SDL_Window *window;
+    SDL_Renderer *renderer;
+    SDL_Texture *texture;
+    int texture_width, texture_height;
+    SDL_Texture *subtitle_atlas;
+    SDL_Rect rect;
+} DisplayOutput;
+
+typedef struct TimeshiftSegment {
+    double start, end;      // Media time of the first and the latest packet, in seconds.
+    int complete;
+} TimeshiftSegment;
+
+// Disk backed ring of remuxed MPEG-TS segments of a live input, see timeshift.c.
+typedef struct Timeshift {
+    const char *dir;
+    double window;          // Seconds kept on disk.
+    // Input stream ids recorded, output stream k of every segment is in_stream[k].
+    int in_stream[TIMESHIFT_MAX_STREAMS];
+    int nb_streams;
+
+    // Packets referenced by the demuxer, written to disk by the writer thread.
+    PacketQueue queue;
+    int tee_wait_keyframe;
+    Uint64 packets_written, packets_dropped;
+    AVFormatContext *out;
+
+    // Segment i is segments[i % TIMESHIFT_MAX_SEGMENTS], first_segment to next_segment - 1 are on
+    // disk. Guarded by lock, the reader never has its segment deleted.
+    SDL_mutex *lock;
+    TimeshiftSegment segments[TIMESHIFT_MAX_SEGMENTS];
+    int first_segment, next_segment;
+    int reading_segment;
+    // Bumped by the writer whenever the recording grows, the reader sleeps until it moves once it
+    // has caught up.
+    SDL_atomic_t appended;
+
+    // Playback comes from the disk ring instead of the live demuxer. switch_lock is held while a live
+    // packet is routed and while playback switches between the two.
+    SDL_atomic_t shifted;
+    SDL_mutex *switch_lock;
+    // dts of the last live packet routed to playback per recorded stream, for a seamless pause.
+    int64_t live_dts[TIMESHIFT_MAX_STREAMS];
+    int skip_to_live[TIMESHIFT_MAX_STREAMS];
+    SDL_atomic_t hold_request;
+    int live_ended;
+    AVFormatContext *in;
+
+    SDL_Thread *writer_tid, *reader_tid;
+} Timeshift;
+
+// A playlist item after the first. The preload thread opens it, selects streams of the same types as
+// the first item and decodes its first video frames while the item before it plays. The decoders take
+// its codecs over at the handover marker.
+typedef struct PlaylistItem {
+    const char *path;
+    // 0 while loading, 1 when ready, -1 when it could not be opened and is skipped.
+    int status;
+    AVFormatContext *fmt_ctx;
+    int video_stream_id, audio_stream_id;
+    AVRational video_time_base, audio_time_base;
+    AVCodecContext *video_codec_ctx, *audio_codec_ctx;
+    SwrContext *resampler_ctx;
+    // Seconds added to the timestamps of the item to put it on the timeline of the first item.
+    double start, offset;
+    AVPacket preroll[PLAYLIST_PREROLL_PACKETS];
+    int nb_preroll, preroll_index;
+    AVFrame *frames[PLAYLIST_PREROLL_FRAMES];
+    int nb_frames;
+    Uint64 open_ticks;
+} PlaylistItem;
+
+// Gapless playback of several inputs. Every item is played on the timeline of the first one: the
+// packets of later items get the stream ids of the first item and their frames timestamps in its time
+// bases, so the queues, the clock and the display carry on as if it were one input.
+typedef struct Playlist {
+    PlaylistItem *items;
+    int nb_items, capacity;
+    // Item the demuxer reads, guarded by mutex, the preload thread opens the one after it.
+    int demux_item;
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+    SDL_Thread *preload_tid;
+    // Timeline end of what was demuxed so far, in seconds.
+    double end;
+    // Items the video and audio decoder are on.
+    int video_item, audio_item;
+
+    // Main thread: the transition being shown and the gaps measured so far.
+    int shown_item;
+    double last_frame_time, last_frame_pts;
+    Uint64 handover_underrun_bytes;
+    int transitions;
+    double gap_sum, gap_max, silence_sum;
+} Playlist;
+
+// Decoded frames of one GOP in presentation order. start is the time of its keyframe and end that of
+// the next one, -INFINITY and INFINITY for the first and the last GOP of the input.
+typedef struct GopCacheEntry {
+    double start, end;
+    int64_t key_pts;
+    AVFrame **frames;
+    int nb_frames, capacity;
+    size_t bytes;
+} GopCacheEntry;
+
+// Frame stepping and reverse playback. Normal playback is paused while reviewing, the cache worker
+// decodes whole GOPs forward with its own demuxer and decoder and the main thread shows their frames
+// in either direction. Entries are guarded by mutex.
+typedef struct GopCache {
+    AVFormatContext *fmt_ctx;
+    AVCodecContext *codec_ctx;
+    AVPacket *pkt;
+    AVFrame *frame;
+    AVRational time_base;
+    double frame_duration;
+    size_t budget, bytes;
+    GopCacheEntry gops[GOP_CACHE_MAX_GOPS];
+    int nb_gops;
+    SDL_mutex *mutex;
+    SDL_cond *cond;
+    SDL_Thread *tid;
+    // Position the worker decodes around and the direction it prefetches in, bumped with serial.
+    double request_pos;
+    int request_dir, request_serial;
+
+    // Main thread: review state, time of the frame on screen and a copy of it.
+    int active, reverse;
+    double position;
+    // Direction of a step waiting for its GOP, 0 for none.
+    int pending_step;
+    double hinted_start;
+    AVFrame *shown;
+    // Reverse playback ticks, every timer_interval ms. The callback touches nothing of the player,
+    // so one still running after SDL_RemoveTimer at teardown is harmless.
+    SDL_TimerID timer;
+    Uint32 timer_interval;
+
+    // Written by the worker.
+    Uint64 gops_decoded, frames_decoded, decode_ticks, evictions;
+    // Main thread: reverse ticks that found the previous frame not decoded yet.
+    Uint64 stalls;
+} GopCache;
+
+typedef struct MediaPlayerState {
+    // Owns the MediaPlayerState itself and the display.
+    Arena arena;
+    // Resampling and time stretch buffers, only touched by the audio callback once playing.
+    Arena audio_scratch;
+    // Packet queue items, taken by the thread feeding the queues: the demuxer, and the timeshift
+    // reader while a timeshift plays back.
+    Arena demux_scratch;
+    // Pixels converted on the main thread on their way into a texture.
+    Arena render_scratch;
+
+    const char *filepath;
+    // Caps probesize/analyzeduration and brings SDL up while the demuxer is still probing.
+    int fast_start;
+    // No window or audio device, frames and audio are pulled by the caller (see replay.c).
+    int headless;
+    // No window and no video decoding, audio goes to the device through SDL_QueueAudio.
+    int audio_only;
+    // Passed to the decoders as thread_count, 0 lets FFmpeg pick.
+    int decoder_threads;
+    // Called by display_frame for every frame taken off the framebuffer, shown or dropped.
+    void (*frame_observer)(void *opaque, AVFrame *frame, int dropped);
+    void *frame_observer_opaque;
+
+    // libavfilter chain run on decoded video before it reaches the framebuffer, e.g. "yadif,scale=1280:-1".
+    const char *video_filters;
+
+    AVFormatContext *fmt_ctx;
+    AVCodecContext *video_codec_ctx, *audio_codec_ctx;
+    SwrContext *resampler_ctx;
+    AVCodecContext *subtitle_codec_ctx;
+    int video_stream_id, audio_stream_id, subtitle_stream_id;
+    // Stream selection asked for on the command line, -1 leaves the choice to av_find_best_stream.
+    int requested_video_stream, requested_audio_stream, requested_subtitle_stream;
+    int no_subtitles, no_audio;
+    const char *requested_audio_language;
+
+    // Audio track switching. The main thread posts a stream index to audio_switch_request, the
+    // demuxer thread opens the new decoder into the pending_* slot and the audio decoder swaps it
+    // in once the first packet of the new stream arrives. active_audio_stream_id is the stream
+    // audio_codec_ctx decodes, it lags audio_stream_id until then.
+    SDL_atomic_t audio_switch_request;
+    SDL_mutex *audio_switch_mutex;
+    AVCodecContext *pending_audio_codec_ctx;
+    SwrContext *pending_resampler_ctx;
+    int pending_audio_stream_id;
+    int active_audio_stream_id;
+    int audio_device_id;
+    SDL_AudioSpec audio_spec;
+
+    // Audio output. Decoded audio is fed into audio_ring by the audio feeder thread and kept
+    // around audio_ring_target bytes, the callback only copies out of it.
+    int audio_latency_ms;
+    int low_latency;
+    AudioRing audio_ring;
+    int audio_ring_target;
+    // Push mode (audio_only): the audio pusher collects up to audio_push_size bytes in
+    // audio_push_buffer and hands them to SDL_QueueAudio in one call.
+    uint8_t *audio_push_buffer;
+    int audio_push_size;
+    // Seconds the device holds after the callback returned, from the obtained buffer size.
+    double audio_device_delay;
+    // Media time at the end of the last decoded audio, set by audio_decode_frame.
+    double audio_decoded_pts;
+    // Media time of the audio at audio_clock_pos in the ring and the seek serial it belongs to, all
+    // guarded by audio_clock_lock.
+    double audio_clock_pts;
+    unsigned int audio_clock_pos;
+    int audio_clock_serial;
+    SDL_SpinLock audio_clock_lock;
+    // Serial of the last flush marker the audio decoder took, feeding thread only.
+    int audio_serial;
+    // SDL_GetTicks() at the last callback, the device plays its buffer out from there.
+    SDL_atomic_t audio_callback_ms;
+    // Set by the callback (or pusher) once audio has been played, by the feeder when no more will come.
+    int audio_started, audio_finished;
+    // Set by audio_decode_frame on the end of input marker, cleared by the next flush marker. Feeding
+    // thread only.
+    int audio_eof;
+    DisplayOutput *display;
+
+    FrameBufferItem framebuffer[VIDEO_FRAME_BUFFER_SIZE];
+    // Slots of framebuffer in use, at most VIDEO_FRAME_BUFFER_SIZE.
+    int framebuffer_size;
+    int frame_read_index;
+    int frame_write_index;
+    SDL_mutex *framebuffer_mutex;
+    SDL_cond *framebuffer_cond;
+    // Decode targets reused for every frame.
+    AVFrame *video_frame, *audio_frame;
+    int audio_buffer_index;
+    int audio_buffer_size;
+    uint8_t *audio_buffer;
+    // Set by audio_output_discard, the pusher drops the batch it was collecting.
+    int audio_discarded;
+    // swr_convert output waiting to be time stretched when playing at rate != 1.
+    uint8_t *resample_buffer;
+    TimeStretch tempo;
+    AudioMeter meter;
+
+    // Video suspension while the window is hidden. The main thread posts to video_suspend_request,
+    // the demuxer thread stops reading the video stream and restarts it at the next keyframe, with
+    // video_flush telling the video decoder to drop its state first.
+    SDL_atomic_t video_suspend_request;
+    int video_suspended;
+    int video_wait_keyframe;
+    SDL_atomic_t video_flush;
+
+    // Seeking. request_seek bumps seek_serial with seek_target under seek_lock, the thread feeding the
+    // packet queues seeks and leaves a flush marker carrying the serial in each of them. play_serial
+    // is the serial of the last marker, video_serial the one the video decoder has seen.
+    SDL_SpinLock seek_lock;
+    double seek_target;
+    SDL_atomic_t seek_serial;
+    SDL_atomic_t play_serial;
+    int video_serial;
+    // The demuxer and the timeshift reader sleep on demux_cond. pkt_queue_get signals it when a
+    // packet was taken, so do the seek, track switch, video suspend and timeshift hold requests, the
+    // timeshift writer and the teardown.
+    SDL_mutex *demux_mutex;
+    SDL_cond *demux_cond;
+    // Serial the playback clock was last set for, main thread only.
+    int clock_serial;
+    // Pts of the frame on screen, NAN before the first one. Main thread only.
+    double displayed_pts;
+    int paused;
+    // REFRESH_VIDEO_DISPLAY events that came in while paused.
+    int pending_refreshes;
+    Timeshift timeshift;
+    Playlist playlist;
+    GopCache gop_cache;
+
+    // Playback speed in percent, written by the main thread and read by the decoders.
+    SDL_atomic_t playback_rate;
+    PlaybackClock clock;
+
+    PacketQueue video_pkt_queue, audio_pkt_queue, subtitle_pkt_queue;
+    SubtitleQueue subtitle_queue;
+    SubtitleOverlay subtitle_overlay;
+
+    // Only used with video_filters. The graph is configured from the first decoded frame on the
+    // filter thread, filter_queue decouples it from the video decoder.
+    AVFilterGraph *filter_graph;
+    AVFilterContext *filter_src, *filter_sink;
+    FrameQueue filter_queue;
+
+    SDL_Thread *decoder_tid, *video_tid, *filter_tid, *subtitle_tid, *audio_tid;
+
+    PlayerStats stats;
+
+    // Set once the input is exhausted and cleared by the next seek, see finish_play_queues. Written
+    // by the thread feeding the packet queues only.
+    int eof;
+    // Set when the last video stage (decoder or filter thread) is done with the end of the stream or
+    // has returned, display_frame stops waiting for frames. Cleared by the next frame after a seek.
+    int video_finished;
+    int quit;
+} MediaPlayerState;
+
+MediaPlayerState* alloc_media_player_state(void);
+int pkt_queue_put(PacketQueue *pkt_queue, AVPacket *pkt);
+int pkt_queue_get(PacketQueue *pkt_queue, AVPacket *pkt, MediaPlayerState *m);
+void pkt_queue_flush(PacketQueue *pkt_queue);
+int pkt_queue_put_flush(PacketQueue *pkt_queue, int serial);
+int pkt_queue_put_eof(PacketQueue *pkt_queue, int finish);
+void pkt_queue_finish(PacketQueue *pkt_queue);
+void wake_waiters(SDL_mutex *mutex, SDL_cond *cond);
+void playlist_item_free(PlaylistItem *item);
+void gop_cache_entry_free(GopCacheEntry *gop);
+void free_media_player_state(MediaPlayerState *m);
+
+#endif
@@ -33,6 +33,28 @@ fn main() {
                     gcc_include_path_args.push(String::from("-I"));
                     gcc_include_path_args.push(String::from(lib_path_str));
                 },
+                "--pkg-config" | "-pc" => {
+                    let mut val = args.pop_front();
+                    if val.is_none() {
+                        eprintln!("Usage: libmanager {command} {flag} <pkg-config package name> ...");
+                        return;
+                    }
+                    let package = val.take().unwrap();
+                    let out = std::process::Command::new("pkg-config").args(["--cflags", package.as_str()]).output();
+                    if out.is_err() {
+                        let err = out.err().unwrap();
+                        eprintln!("...error running pkg-config {err}");
+                        return;
+                    }
+                    let out = out.unwrap();
+                    if !out.status.success() {
+                        std::io::stderr().write_all(out.stderr.as_slice()).expect("Writing to stderr should work");
+                        return;
+                    }
+                    String::from_utf8_lossy(out.stdout.as_slice()).split_whitespace().for_each(|flag| {
+                        gcc_include_path_args.push(flag.to_string());
+                    });
+                },
                 _lib_dir => {
                     if lib_dir.is_none() {
                         lib_dir = Some(_lib_dir.to_string());
@@ -1,47 +1,356 @@
-#include "lib/decoder.c"
-#include "lib/output.c"
+#include <math.h>
 
-int main(int argc, char *argv[]) {
+#include "clock.h"
+#include "control.h"
+#include "decoder.h"
+#include "gopcache.h"
+#include "output.h"
+#include "playlist.h"
+#include "probe.h"
+#include "replay.h"
+#include "stats.h"
+#include "subtitle.h"
+#include "timeshift.h"
+
+// Seconds the arrow keys seek by.
+#define SEEK_STEP 10.0
+#define DEFAULT_TIMESHIFT_WINDOW 300.0
+
+// Plays the inputs given on the command line, or open_path instead when the control interface asked
+// for another input.
+static int play(int argc, char *argv[], ControlServer *control, const char *open_path) {
     // if (argc < 2) {
     //     fprintf(stderr, "Usage: witch <video file path>");
     //     return -1;
     // }
     SDL_Event event;
     const char *input = "av2.mp4";
+    int bench_startup = 0;
+    int bench_demuxer = 0;
+    int exit_at_end = 0;
+    int alloc_report = 0;
+    int render_report = 0;
+    int audio_report = 0;
+    int replay = 0;
+    const char *probe_output = NULL;
+    const char *replay_output = NULL, *replay_golden = NULL;
+    double replay_frame_cost = 0.0;
     MediaPlayerState *mp = alloc_media_player_state();
     if (mp == NULL) {
         return -1;
     }
 
-    if (open_codec(input, mp) != 0) {
-        return -1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--fast-start") == 0) {
+            mp->fast_start = 1;
+        } else if (strcmp(argv[i], "--bench-startup") == 0) {
+            // Quit as soon as the first frame is on screen and print the per-phase timings.
+            bench_startup = 1;
+        } else if (strcmp(argv[i], "--exit-at-end") == 0) {
+            // Quit once the last frame has been shown and the audio played out.
+            exit_at_end = 1;
+        } else if (strcmp(argv[i], "--bench-demux") == 0) {
+            bench_demuxer = 1;
+        } else if (strcmp(argv[i], "--alloc-report") == 0) {
+            alloc_report = 1;
+        } else if (strcmp(argv[i], "--render-report") == 0) {
+            // Average render and subtitle overlay time per frame on exit.
+            render_report = 1;
+        } else if (strcmp(argv[i], "--audio-report") == 0) {
+            // Output latency, underrun rate and A/V offset on exit.
+            audio_report = 1;
+        } else if (strcmp(argv[i], "--audio-latency") == 0 && i + 1 < argc) {
+            mp->audio_latency_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--audio-only") == 0) {
+            // No window, the video stream is not demuxed and audio is pushed in large batches.
+            mp->audio_only = 1;
+        } else if (strcmp(argv[i], "--meter") == 0) {
+            // Peak, RMS and loudness of the audio output, drawn over the video and reported on exit.
+            mp->meter.enabled = 1;
+        } else if (strcmp(argv[i], "--spectrum") == 0) {
+            mp->meter.enabled = 1;
+            mp->meter.spectrum = 1;
+        } else if (strcmp(argv[i], "--low-latency") == 0) {
+            mp->low_latency = 1;
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            // Headless run that writes a hash per decoded video frame and audio block.
+            replay = 1;
+            replay_output = argv[++i];
+        } else if (strcmp(argv[i], "--golden") == 0 && i + 1 < argc) {
+            replay = 1;
+            replay_golden = argv[++i];
+        } else if (strcmp(argv[i], "--probe") == 0 && i + 1 < argc) {
+            // Headless black/freeze/luma/scene change timeline, CSV or binary when the name ends in .bin.
+            probe_output = argv[++i];
+        } else if (strcmp(argv[i], "--frame-cost") == 0 && i + 1 < argc) {
+            replay_frame_cost = atof(argv[++i]) / 1000.0;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            mp->decoder_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--framebuffer") == 0 && i + 1 < argc) {
+            mp->framebuffer_size = av_clip(atoi(argv[++i]), 1, VIDEO_FRAME_BUFFER_SIZE);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            set_playback_rate(mp, (int)(atof(argv[++i]) * 100));
+        } else if (strcmp(argv[i], "--vf") == 0 && i + 1 < argc) {
+            // libavfilter chain applied to the decoded video, e.g. "yadif,scale=1280:-1".
+            mp->video_filters = argv[++i];
+        } else if (strcmp(argv[i], "--video-stream") == 0 && i + 1 < argc) {
+            mp->requested_video_stream = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--audio-stream") == 0 && i + 1 < argc) {
+            mp->requested_audio_stream = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sub-stream") == 0 && i + 1 < argc) {
+            mp->requested_subtitle_stream = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--no-subs") == 0) {
+            mp->no_subtitles = 1;
+        } else if (strcmp(argv[i], "--timeshift") == 0 && i + 1 < argc) {
+            // Records a live input into segments in this directory, playback can seek back into them.
+            mp->timeshift.dir = argv[++i];
+        } else if (strcmp(argv[i], "--timeshift-window") == 0 && i + 1 < argc) {
+            mp->timeshift.window = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--playlist") == 0 && i + 1 < argc) {
+            // One path per line, played gaplessly after the inputs given before it.
+            if (playlist_add_file(mp, argv[++i]) != 0) {
+                goto fail;
+            }
+        } else if (strcmp(argv[i], "--gop-cache-mb") == 0 && i + 1 < argc) {
+            // Memory the decoded frames kept for stepping and reverse playback may take.
+            mp->gop_cache.budget = (size_t)FFMAX(atoi(argv[++i]), 1) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--audio-lang") == 0 && i + 1 < argc) {
+            mp->requested_audio_language = argv[++i];
+        } else if (strcmp(argv[i], "--control") == 0 && i + 1 < argc) {
+            // Taken by main, the socket outlives the inputs it opens.
+            i++;
+        } else if (playlist_add(mp, argv[i]) != 0) {
+            goto fail;
+        }
+    }
+    if (open_path != NULL) {
+        mp->playlist.nb_items = 0;
+        if (playlist_add(mp, open_path) != 0) {
+            goto fail;
+        }
+    }
+    // More than one input is a playlist, they are played one after the other without a gap.
+    if (mp->playlist.nb_items > 0) {
+        input = mp->playlist.items[0].path;
+    }
+    if (mp->playlist.nb_items > 1 && mp->timeshift.dir != NULL) {
+        fprintf(stderr, "A timeshift needs a single live input, not a playlist.\n");
+        goto fail;
+    }
+    mp->filepath = input;
+    if (mp->timeshift.window <= 0) {
+        mp->timeshift.window = DEFAULT_TIMESHIFT_WINDOW;
     }
 
-    if (setup_sdl(mp) != 0) {
-        return -1;
+    if (bench_demuxer) {
+        int ret = -1;
+        if (open_input(mp) == 0 && select_streams(mp) == 0) {
+            ret = bench_demux(mp);
+        }
+        free_media_player_state(mp);
+        return ret;
+    }
+
+    if (probe_output != NULL) {
+        int ret = run_probe(mp, probe_output);
+        free_media_player_state(mp);
+        return ret;
+    }
+
+    if (replay) {
+        int ret = run_replay(mp, replay_output, replay_golden, replay_frame_cost);
+        free_media_player_state(mp);
+        return ret;
+    }
+
+    stats_startup_begin(&mp->stats);
+    if (mp->fast_start) {
+        // Probe the input on its own thread while the window and audio device come up.
+        SDL_Thread *probe_tid = SDL_CreateThread(open_input_thread, "probe-thread", mp);
+        int sdl_ret = setup_sdl(mp);
+        int probe_ret = -1;
+        SDL_WaitThread(probe_tid, &probe_ret);
+        if (sdl_ret != 0 || probe_ret != 0) {
+            goto fail;
+        }
+
+        if (open_codec(input, mp) != 0) {
+            goto fail;
+        }
+    } else {
+        if (open_codec(input, mp) != 0) {
+            goto fail;
+        }
+
+        if (setup_sdl(mp) != 0) {
+            goto fail;
+        }
     }
 
+    if (setup_resampler(mp) != 0) {
+        goto fail;
+    }
 
+    if (mp->timeshift.dir != NULL && timeshift_start(mp) != 0) {
+        goto fail;
+    }
+    if (mp->playlist.nb_items > 1 && playlist_start(mp) != 0) {
+        goto fail;
+    }
+    stats_phase_begin(&mp->stats, STARTUP_PHASE_FIRST_FRAME);
     mp->decoder_tid = SDL_CreateThread(decoder_thread, "decoder-thread", mp);
+    if (mp->video_codec_ctx != NULL) {
+        mp->video_tid = SDL_CreateThread(video_decoder, "video-decoder", mp);
+    }
+    if (mp->subtitle_codec_ctx != NULL) {
+        mp->subtitle_tid = SDL_CreateThread(subtitle_decoder, "subtitle-decoder", mp);
+    }
     // SDL_AddTimer(16, display_frame, (void *)mp);
+    // The input of an open command is playing, the client gets its reply now.
+    control_open_done(control, 1);
 
-    while (!mp->quit) {
-        while (SDL_PollEvent(&event)) {
-            switch (event.type) {
-                case SDL_QUIT:
-                    mp->quit = 1;
+    // Sleeps until there is something to do, frames arrive as REFRESH_VIDEO_DISPLAY events.
+    while (!mp->quit && SDL_WaitEvent(&event)) {
+        switch (event.type) {
+            case SDL_QUIT:
+                mp->quit = 1;
+                break;
+            case SDL_WINDOWEVENT:
+                // Nobody sees the video while the window is hidden, only the audio keeps playing.
+                if (event.window.event == SDL_WINDOWEVENT_HIDDEN || event.window.event == SDL_WINDOWEVENT_MINIMIZED) {
+                    request_video_suspend(mp, 1);
+                } else if (event.window.event == SDL_WINDOWEVENT_SHOWN || event.window.event == SDL_WINDOWEVENT_RESTORED) {
+                    request_video_suspend(mp, 0);
+                }
+                break;
+            case SDL_KEYDOWN:
+                switch (event.key.keysym.sym) {
+                    case SDLK_a:
+                        request_audio_stream(mp, next_audio_stream(mp));
+                        break;
+                    case SDLK_LEFTBRACKET:
+                        set_playback_rate(mp, SDL_AtomicGet(&mp->playback_rate) - 25);
+                        break;
+                    case SDLK_RIGHTBRACKET:
+                        set_playback_rate(mp, SDL_AtomicGet(&mp->playback_rate) + 25);
+                        break;
+                    case SDLK_SPACE:
+                        // Stepping or playing backwards ends, playback goes on from the frame on screen.
+                        if (mp->gop_cache.active) {
+                            gop_cache_leave(mp, 1);
+                        } else {
+                            set_paused(mp, !mp->paused);
+                        }
+                        break;
+                    case SDLK_LEFT:
+                    case SDLK_RIGHT: {
+                        double position = mp->gop_cache.active ? mp->gop_cache.position : clock_get(&mp->clock);
+                        gop_cache_leave(mp, 0);
+                        request_seek(mp, position + (event.key.keysym.sym == SDLK_LEFT ? -SEEK_STEP : SEEK_STEP));
+                        break;
+                    }
+                    case SDLK_PERIOD:
+                        gop_cache_step(mp, 1);
+                        break;
+                    case SDLK_COMMA:
+                        gop_cache_step(mp, -1);
+                        break;
+                    case SDLK_r:
+                        gop_cache_reverse(mp, !mp->gop_cache.reverse);
+                        break;
+                    case SDLK_l:
+                        // Back to the live edge of a timeshifted input.
+                        if (mp->timeshift.dir != NULL) {
+                            request_seek(mp, INFINITY);
+                        }
+                        break;
+                    default:
+                        break;
+                }
+                break;
+            case GOP_CACHE_EVENT:
+                gop_cache_event(mp, &event);
+                break;
+            case CONTROL_EVENT:
+                control_drain(control, mp);
+                break;
+            case REFRESH_VIDEO_DISPLAY:
+                if (mp->paused) {
+                    mp->pending_refreshes++;
                     break;
-                case REFRESH_VIDEO_DISPLAY:
-                    display_frame(mp);
-                default:
+                }
+                if (event.user.code == REFRESH_END_OF_STREAM || mp->video_tid == NULL || display_frame(mp) == 1) {
+                    if (exit_at_end && playback_finished(mp)) {
+                        mp->quit = 1;
+                    }
                     break;
+                }
+                if (bench_startup) {
+                    print_startup_report(&mp->stats);
+                    mp->quit = 1;
+                }
+            default:
+                break;
+        }
+    }
+
+    if (alloc_report) {
+        print_alloc_report(mp);
+    }
+    if (render_report) {
+        print_render_report(&mp->stats);
+    }
+    if (audio_report) {
+        // Stop the callback first, it writes the audio counters.
+        if (mp->audio_device_id != 0) {
+            SDL_PauseAudioDevice(mp->audio_device_id, 1);
+        }
+        print_audio_report(mp);
+    }
+    if (mp->meter.enabled) {
+        print_meter_report(mp);
+    }
+    if (mp->timeshift.dir != NULL) {
+        print_timeshift_report(mp);
+    }
+    if (mp->playlist.nb_items > 1) {
+        print_playlist_report(mp);
+    }
+    if (mp->gop_cache.tid != NULL) {
+        print_gop_cache_report(mp);
+    }
+    free_media_player_state(mp);
+
+    return 0;
+
+fail:
+    // A failed input must not keep threads or memory around, the control interface may open another.
+    free_media_player_state(mp);
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    ControlServer *control = NULL;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (strcmp(argv[i], "--control") == 0) {
+            // Line based JSON commands on this Unix domain socket, see control.c.
+            control = control_start(argv[i + 1]);
+            if (control == NULL) {
+                return -1;
             }
         }
     }
 
-    SDL_DestroyRenderer(mp->display->renderer);
-    SDL_DestroyWindow(mp->display->window);
+    int ret = play(argc, argv, control, NULL);
+    // An open command ends the playback, the new input is played with the same options. When it
+    // fails to open the client is told so and the player waits for the next command.
+    char open_path[1024];
+    while ((ret == 0 || control_idle(control)) && control_take_open(control, open_path, sizeof(open_path))) {
+        ret = play(argc, argv, control, open_path);
+        control_open_done(control, ret == 0);
+    }
+    control_stop(control);
     SDL_Quit();
 
-    return 0;
-}
\ No newline at end of file
+    return ret;
+}
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Usage: ./replay.sh [--record] <video file> <golden file> [player]
+# Replays the file headless with different decoder thread counts and framebuffer sizes and checks
+# every run against the golden checksums. Fails when the golden file is missing, --record writes it
+# from a run with the default settings instead. player defaults to ./build/main.
+record=0
+if [ "$1" = "--record" ]; then
+	record=1
+	shift
+fi
+if [ $# -lt 2 ]; then
+	echo "Usage: $0 [--record] <video file> <golden file> [player]" >&2
+	exit 2
+fi
+player=${3:-./build/main}
+if [ $record -eq 1 ]; then
+	"$player" --replay "$2" "$1" || exit 1
+	echo "Recorded $2"
+	exit 0
+fi
+if [ ! -f "$2" ]; then
+	echo "Golden file $2 is missing, record it from a known good build with: $0 --record $1 $2" >&2
+	exit 1
+fi
+status=0
+for threads in 1 2 4 8; do
+	for framebuffer in 1 3 10; do
+		echo "== threads: $threads, framebuffer: $framebuffer =="
+		"$player" --golden "$2" --threads $threads --framebuffer $framebuffer "$1" || status=1
+	done
+done
+exit $status
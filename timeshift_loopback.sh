@@ -0,0 +1,10 @@
+# Usage: ./timeshift_loopback.sh <video file> [port] [dir]
+# Plays a local loopback stream with timeshift: ffmpeg sends the file in real time as MPEG-TS over
+# UDP, witch records it into dir. Pause with space, seek back with the left arrow and return to
+# live with l, the report on exit shows how many packets the recording had to drop.
+port=${2:-12345}
+dir=${3:-/tmp/witch-timeshift}
+ffmpeg -loglevel error -re -stream_loop -1 -i "$1" -c copy -f mpegts "udp://127.0.0.1:$port?pkt_size=1316" &
+sender=$!
+trap 'kill $sender 2>/dev/null' EXIT
+./build/main --timeshift "$dir" "udp://127.0.0.1:$port"